@@ -4,10 +4,30 @@
 #include <QApplication>
 #include <QtWidgets>
 
+#include "HelperFunctions/ScratchArena.h"
+
 class Filter
 {
 	public:
+		Filter() : mSeed( 0 ) {}
 		virtual ~Filter() {}
 		virtual QImage* RunFilter( QImage* source ) = 0;
+
+		///
+		/// The seed of every random number the filter uses. The same seed and source
+		/// give the same result, whatever the number of threads.
+		///
+		void SetSeed( quint64 seed ) { mSeed = seed; }
+		quint64 Seed() const { return mSeed; }
+
+		///
+		/// The temporary planes of the filter's jobs. Whoever runs the filter resets it
+		/// once the job's result has been taken, which keeps the memory for the next job.
+		///
+		ScratchArena& Scratch() { return mScratch; }
+
+	protected:
+		quint64 mSeed;
+		ScratchArena mScratch;
 };
 #endif
\ No newline at end of file
@@ -10,6 +10,8 @@
 #include "Filters/GlassPatternsFilter.h"
 #include "Filters/LayeredStrokesFilter.h"
 #include "Filters/PointillismFilter.h"
+#include "HelperFunctions/Random.h"
+#include "HelperFunctions/ScaleSpaceCache.h"
 
 typedef boost::shared_ptr<Filter> filter_ptr;
 typedef boost::shared_ptr<uchar> uchar_ptr;
@@ -20,6 +22,8 @@ FilterProcessor::FilterProcessor()
 ///
 /// Constructor.
 ///
+: mSourceKey( 0 ),
+  mSeed( 0 )
 {
 	InitFilterLibrary();
 }
@@ -49,7 +53,23 @@ FilterProcessor::run()
 		QMutexLocker locker(&mutex);
 		if( mFilterLibrary.find(mFilterName) != mFilterLibrary.end() )
 		{
+			// Only the filter being run keeps its temporary memory for the next job
+			for( map<string, filter_ptr>::iterator it = mFilterLibrary.begin(); it != mFilterLibrary.end(); ++it )
+			{
+				if( it->first != mFilterName )
+				{
+					it->second->Scratch().Trim();
+				}
+			}
+
+			mFilterLibrary[mFilterName]->SetSeed( mSeed );
 			QImage* result = mFilterLibrary[mFilterName]->RunFilter(&mImage);
+
+			// Report the most temporary memory the job needed at once, then free its
+			// temporary planes, keeping the memory for the next job
+			ScratchArena& scratch = mFilterLibrary[mFilterName]->Scratch();
+			emit FilterMemoryUsed( (qint64)scratch.HighWaterMark() );
+			scratch.Reset();
 			if( *result != mImage )
 			{
 		        mImage = *result;
@@ -92,6 +112,26 @@ void
 FilterProcessor::StartFilter( string filter_name, QImage image )
 ///
 /// Sets the current image and filter name and starts the thread to begin filtering.
+/// The job gets a new random seed, so running it again gives a different result.
+///
+/// @param filter_name
+///  The name of the filter to be applied.
+///
+/// @param image
+///  The image to be filtered.
+///
+/// @return
+///  Nothing.
+///
+{
+	StartFilter( filter_name, image, Random::NewSeed() );
+}
+
+void
+FilterProcessor::StartFilter( string filter_name, QImage image, quint64 seed )
+///
+/// Sets the current image, filter name and random seed and starts the thread to begin
+/// filtering. The same image, filter and seed always give the same result.
 ///
 /// @param filter_name
 ///  The name of the filter to be applied.
@@ -99,12 +139,26 @@ FilterProcessor::StartFilter( string filter_name, QImage image )
 /// @param image
 ///  The image to be filtered.
 ///
+/// @param seed
+///  The seed of the random numbers used by the filter.
+///
 /// @return
 ///  Nothing.
 ///
 {
 	QMutexLocker locker(&mutex);
-	mImage = image.copy();
+
+	// Blurred copies of the last image are only reused when the same image is filtered
+	// again, so free them as soon as another one comes in
+	if( image.cacheKey() != mSourceKey )
+	{
+		ScaleSpaceCache::Clear();
+		mSourceKey = image.cacheKey();
+	}
+
+	// The filters read and write 32 bit pixels directly, so they all work on ARGB32
+	mImage = image.format() == QImage::Format_ARGB32 ? image.copy() : image.convertToFormat( QImage::Format_ARGB32 );
 	mFilterName = filter_name;
+	mSeed = seed;
 	start();
 }
\ No newline at end of file
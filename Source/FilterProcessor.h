@@ -18,10 +18,12 @@ class FilterProcessor : public QThread
 		~FilterProcessor();
 
 		void StartFilter( std::string filter_name, QImage image );
+		void StartFilter( std::string filter_name, QImage image, quint64 seed );
 
 	signals:
 		void FilterDone( QImage result );
 		void FilterStatus( QString status_text );
+		void FilterMemoryUsed( qint64 scratch_bytes );
 
 	protected:
 	    void run();
@@ -32,7 +34,9 @@ class FilterProcessor : public QThread
 		std::map<std::string, boost::shared_ptr<Filter> >  mFilterLibrary;
 
 		QImage mImage;
+		qint64 mSourceKey;
 		std::string mFilterName;
+		quint64 mSeed;
 
 		QMutex mutex;
 	    QWaitCondition condition;
@@ -1,19 +1,33 @@
 #include "GlassPatternsFilter.h"
+#include "HelperFunctions/CpuDispatch.h"
 #include "HelperFunctions/ImageProcessing.h"
+#include "HelperFunctions/NoiseCache.h"
+#include "HelperFunctions/Parallel.h"
+#include "HelperFunctions/Random.h"
+#include <string.h>
 
 const double GlassPatternsFilter::FILTER_STRENGTH_DEFAULT = 1.0;
 
-void ApplyGlassPatterns(QImage * source, QImage * destination, int a, double sd, double theta, int n, double h, double strength);
-void TranslateImageAccordingToGlassPattern( uchar* image, uchar* noise, double* v_x, double* v_y, int width, int height, int n, double h );
+void ApplyGlassPatterns(QImage * source, QImage * destination, int a, double sd, double theta, int n, double h, double strength, quint64 seed, ScratchArena& scratch);
+void TranslateImageAccordingToGlassPattern( uchar* image, uchar* noise, double* v_x, double* v_y, int width, int height, int n, double h, ScratchArena& scratch );
 void TranslatePixels(uchar* image, uchar* canvas, double* v_x, double* v_y, int width, int height, int channels, double h);
 void TranslatePixels(double* image, double* canvas, double* v_x, double* v_y, int width, int height, int channels, double h);
-void GetImageGradients(QImage * image, double* x_sigma, double* y_sigma, double sd);
-void GetVectorField( uchar* source, double* v_x, double* v_y, int width, int height, int a, double th0, double sd);
-double WhiteNoise();
-void GetRandomNoise( uchar* destination, int width, int height );
+void GetImageGradients(float* const* planes, float* const* x_sigma, float* const* y_sigma, int width, int height, double sd);
+void GetVectorField( const uchar* source, double* v_x, double* v_y, int width, int height, int a, double th0, double sd, ScratchArena& scratch );
+void GetRandomNoise( uchar* destination, int width, int height, quint64 seed, ScratchArena& scratch );
 
 #define PI 3.14159265
 
+// The noise added to the image and the noise that seeds the pattern are separate streams
+static const quint64 IMAGE_NOISE_RANDOM_STREAM = 1;
+static const quint64 PATTERN_NOISE_RANDOM_STREAM = 2;
+
+// Canvases with at least this many pixels tile a cached noise texture, see GetRandomNoise.
+// The tiled noise is not the noise the same seed makes directly, so a canvas just above this
+// size gets a different pattern than one just below it
+static const int TILED_NOISE_MIN_PIXELS = 4000000;
+static const int NOISE_TEXTURE_SIZE = 1024;
+
 GlassPatternsFilter::GlassPatternsFilter()
 {
 
@@ -25,12 +39,12 @@ GlassPatternsFilter::RunFilter( QImage* source )
 	const int filter_strength = FILTER_STRENGTH_DEFAULT;
 
 	QImage* canvas = new QImage(source->size(), QImage::Format_ARGB32);
-	ApplyGlassPatterns( source, canvas, 8, 8.0, PI/2.0, 4, 0.3, filter_strength );
+	ApplyGlassPatterns( source, canvas, 8, 8.0, PI/2.0, 4, 0.3, filter_strength, mSeed, mScratch );
 	return canvas;
 }
 
 void 
-ApplyGlassPatterns(QImage * img, QImage * canvas, int vector_length, double gauss_standard_deviation, double vector_angle, int translation_iteration, double euler_step_size, double strength) 
+ApplyGlassPatterns(QImage * img, QImage * canvas, int vector_length, double gauss_standard_deviation, double vector_angle, int translation_iteration, double euler_step_size, double strength, quint64 seed, ScratchArena& scratch) 
 ///
 /// Use pixel translation in the form of Glass patterns to give an impressionist look to an image.
 ///
@@ -60,6 +74,12 @@ ApplyGlassPatterns(QImage * img, QImage * canvas, int vector_length, double gaus
 /// @param strength
 ///  The strength of the filter.
 ///
+/// @param seed
+///  The seed of the random noise.
+///
+/// @param scratch
+///  Holds the temporary planes of the filter.
+///
 /// @return
 ///  Nothing.
 ///
@@ -70,71 +90,69 @@ ApplyGlassPatterns(QImage * img, QImage * canvas, int vector_length, double gaus
 	vector_length = new_vector_length;
 
 	// Smooth the image
-	uchar* smoothed = new uchar[img->width()*img->height()*4];
+	uchar* smoothed = scratch.Allocate<uchar>( img->width()*img->height()*4 );
 	int kernel_size = 5;
 	if(strength < 0.5) kernel_size = 3;
 	if(strength > 0.2)
 	{
-		ImageProcessing::GaussianBlur( img->bits(), smoothed, img->width(), img->height(), 4, kernel_size );
+		ImageProcessing::GaussianBlur( img->constBits(), smoothed, img->width(), img->height(), 4, kernel_size );
 	}
     else
     {
-        for( int j = 0; j < img->height(); j++ )
-        {
-            for( int i = 0; i < img->width(); i++ )
-            {
-                for( int c = 0; c < 4; c++ )
-                {
-                    smoothed[j*img->width()*4 + i*4 + c] = img->bits()[j*img->width()*4 + i*4 + c];
-                }
-            }
-        }
+        memcpy( smoothed, img->constBits(), img->width()*img->height()*4 );
     }
 	
 	// Create the noise to be used to determine the continuous Glass pattern.
-	uchar* random_noise = new uchar[img->width()*img->height()];
-	GetRandomNoise( random_noise, img->width(), img->height() );
+	uchar* random_noise = scratch.Allocate<uchar>( img->width()*img->height() );
+	GetRandomNoise( random_noise, img->width(), img->height(), seed, scratch );
 
 	// 
-	double* v_x = new double[ img->width()*img->height() ];
-	double* v_y = new double[ img->width()*img->height() ];
-	GetVectorField( img->bits(), v_x, v_y, img->width(), img->height(), vector_length, vector_angle, gauss_standard_deviation);
+	double* v_x = scratch.Allocate<double>( img->width()*img->height() );
+	double* v_y = scratch.Allocate<double>( img->width()*img->height() );
+	GetVectorField( img->constBits(), v_x, v_y, img->width(), img->height(), vector_length, vector_angle, gauss_standard_deviation, scratch );
 
-	// Add noise to the original image to make strokes more visible
-	for( int y = 0; y < canvas->height(); y++ )
-    {
-		for( int x = 0; x < canvas->width(); x++ )
-        {
-			double noise = (WhiteNoise() - 0.5)/8.0*strength;
-			for(int c = 0; c < 3; c++)
-            {
-            	int new_val = smoothed[y*canvas->width()*4 + x*4 + c] + noise*255;
-            	if( new_val > 255 )
-            	{
-            		new_val = 255;
-            	}
-            	else if( new_val < 0 )
-            	{
-					new_val = 0;
-            	}
-            	smoothed[y*canvas->width()*4 + x*4 + c] = new_val;
+	// Add noise to the original image to make strokes more visible. The noise is white noise
+	// with a standard deviation of 0.5, clipped to +/- 0.5
+	const KernelTable& kernels = CpuDispatch::Kernels();
+	const quint64 noise_key = Random::StreamKey( seed, IMAGE_NOISE_RANDOM_STREAM );
+	const int width = canvas->width();
+	Parallel::For( canvas->height(), [&]( int first_row, int last_row )
+	{
+		float* normal = new float[width];
+		for( int y = first_row; y < last_row; y++ )
+		{
+			kernels.GaussianNoise( noise_key, (quint32)y*width, normal, width );
+			for( int x = 0; x < width; x++ )
+			{
+				double noise = qBound( -0.5, 0.5*normal[x], 0.5 )/8.0*strength;
+				for( int c = 0; c < 3; c++ )
+				{
+					int new_val = smoothed[y*width*4 + x*4 + c] + noise*255;
+					if( new_val > 255 )
+					{
+						new_val = 255;
+					}
+					else if( new_val < 0 )
+					{
+						new_val = 0;
+					}
+					smoothed[y*width*4 + x*4 + c] = new_val;
+				}
 			}
 		}
-	}
+		delete [] normal;
+	} );
 
 	// Apply a continuous Glass pattern defined by the noise and vector field created.
-	TranslateImageAccordingToGlassPattern(smoothed, random_noise, v_x, v_y, canvas->width(), canvas->height(), translation_iteration, euler_step_size);
+	TranslateImageAccordingToGlassPattern(smoothed, random_noise, v_x, v_y, canvas->width(), canvas->height(), translation_iteration, euler_step_size, scratch);
 
-	// Copy the results to our canvas.
-    *canvas = QImage(smoothed, img->width(), img->height(), img->format() );
-	delete [] v_x;
-	delete [] v_y;
-    delete [] smoothed;
-    delete [] random_noise;
+	// Copy the results to our canvas. The scratch planes are reused by the next job, so
+	// the canvas takes a copy rather than wrapping them.
+    *canvas = QImage(smoothed, img->width(), img->height(), img->format() ).copy();
 }
 
 void 
-TranslateImageAccordingToGlassPattern(uchar* ref_image, uchar* ref_noise, double* v_x, double* v_y, int width, int height, int iterations, double euler_step_size) 
+TranslateImageAccordingToGlassPattern(uchar* ref_image, uchar* ref_noise, double* v_x, double* v_y, int width, int height, int iterations, double euler_step_size, ScratchArena& scratch) 
 ///
 /// Translates noise according to the trajectories of a given vector field giving
 /// a continuous Glass pattern. At the maximum points on each arc, translates the pixels of
@@ -164,11 +182,14 @@ TranslateImageAccordingToGlassPattern(uchar* ref_image, uchar* ref_noise, double
 /// @param euler_step_size
 ///  The step size of the euler algorithm.
 ///
+/// @param scratch
+///  Holds the translated copies of the image, noise and vector field.
+///
 /// @return
 ///  Nothing.
 ///
 {
-	uchar* glass_image = new uchar[width*height*4];
+	uchar* glass_image = scratch.Allocate<uchar>( width*height*4 );
 	for( int j = 0; j < height; j++ )
 	{
 		for( int i = 0; i < width; i++ )
@@ -180,9 +201,12 @@ TranslateImageAccordingToGlassPattern(uchar* ref_image, uchar* ref_noise, double
 		}
 	}
 
-	uchar* glass_noise = new uchar[width*height];
-	double* w_x = new double[width*height];
-	double* w_y = new double[width*height];
+	// Pixels whose trajectory leaves the image are never written by TranslatePixels, so the
+	// noise starts as a copy like the image does, and the moved vector field starts at zero
+	uchar* glass_noise = scratch.Allocate<uchar>( width*height );
+	memcpy( glass_noise, ref_noise, width*height );
+	double* w_x = scratch.AllocateZeroed<double>( width*height );
+	double* w_y = scratch.AllocateZeroed<double>( width*height );
 	for( int i = 0; i < iterations; i++ ) 
 	{
 		TranslatePixels(ref_noise, glass_noise, v_x, v_y, width, height, 1, euler_step_size);
@@ -206,10 +230,6 @@ TranslateImageAccordingToGlassPattern(uchar* ref_image, uchar* ref_noise, double
 		ImageProcessing::AddImages(v_x, w_x, v_x, width, height, 1);
 		ImageProcessing::AddImages(v_y, w_y, v_y, width, height, 1);
 	}
-	delete [] glass_image;
-	delete [] glass_noise;
-	delete [] w_x;
-	delete [] w_y;
 }
 
 void 
@@ -242,32 +262,10 @@ TranslatePixels(uchar* image, uchar* canvas, double* v_x, double* v_y, int width
 ///  Nothing.
 ///
 {
+	const KernelTable& kernels = CpuDispatch::Kernels();
 	for( int y = 0; y < height; y++ ) 
 	{
-		for( int x = 0; x < width; x++ ) 
-		{
-			double new_x = x + step_size*( v_x[y*width + x] );
-			double new_y = y + step_size*( v_y[y*width + x] );
-			int x1 = (int)new_x;
-			int x2 = x1 + 1;
-			int y1 = (int)new_y;
-			int y2 = y1 + 1;
-			if( x1 >= 0 && y1 >= 0 && x2 < width && y2 < height ) 
-			{
-				for( int c = 0; c < channels; c++ )
-				{
-					uchar color11 = image[y1*width*channels + x1*channels + c];
-					uchar color21 = image[y2*width*channels + x1*channels + c];
-					uchar color12 = image[y1*width*channels + x2*channels + c];
-					uchar color22 = image[y2*width*channels + x2*channels + c];
-
-					int new_color = color11*(x2 - new_x)*(y2 - new_y) + color21*(new_x - x1)*(y2 - new_y)
-						+ color12*(x2 - new_x)*(new_y - y1) + color22*(new_x - x1)*(new_y - y1);
-					if( new_color > 255 ) new_color = 255;
-					canvas[y*width*channels + x*channels + c] = (uchar)new_color;
-				}
-			}
-		}
+		kernels.WarpBilinear( image, canvas, v_x, v_y, y, width, height, channels, step_size );
 	}
 }
 
@@ -328,19 +326,21 @@ TranslatePixels(double* image, double* canvas, double* v_x, double* v_y, int wid
 }
 
 void 
-GetImageGradients(uchar* source, double* x_sigma, double* y_sigma, int width, int height, double standard_deviation) 
+GetImageGradients(float* const* planes, float* const* x_sigma, float* const* y_sigma, int width, int height, double standard_deviation) 
 ///
 /// Gets the convolution of the gradient of the Gaussian function with the image.
 /// The gives us the color gradient of the image in the x and y direction.
+/// Each color is a separate plane, and each row of the result is built up one kernel tap
+/// at a time, so the inner loops run along whole rows.
 ///
-/// @param source
-///  The reference image to use in the convolution.
+/// @param planes
+///  The red, green and blue planes of the reference image, from 0 to 1.
 ///
 /// @param x_sigma
-///  The calculated gradient in the x direction at each pixel.
+///  The planes that store the gradient of each color in the x direction.
 ///
 /// @param y_sigma
-///  The calculated gradient in the y direction at each pixel.
+///  The planes that store the gradient of each color in the y direction.
 ///
 /// @param width
 ///  The width of the image.
@@ -355,64 +355,75 @@ GetImageGradients(uchar* source, double* x_sigma, double* y_sigma, int width, in
 ///  Nothing.
 ///
 {	
-	// Create the Gaussian kernel for convolution.
-	int k = 31;
-	double* kernel_x = new double[k*k];
-	double* kernel_y = new double[k*k];
-	for(int j = -1*k/2; j < k/2 + 1; j+=5) 
+	// Create the Gaussian kernel for convolution. Only every fifth tap is used.
+	const int k = 31;
+	const int step = 5;
+	const int taps = k/step + 1;
+	float kernel_x[taps][taps];
+	float kernel_y[taps][taps];
+	for(int n = 0; n < taps; n++) 
 	{
-		for(int i = -1*k/2; i < k/2 + 1; i+=5) 
+		for(int m = 0; m < taps; m++) 
 		{
+			int j = n*step - k/2;
+			int i = m*step - k/2;
 			double c1 = 1.0/(2*PI*standard_deviation*standard_deviation);
 			double c2 = 2*standard_deviation*standard_deviation;
 			double g = c1*exp(-1.0*((i*i + j*j)/c2));
-			double g_x = g*((-1.0*i)/(standard_deviation*standard_deviation));
-			double g_y = g*((-1.0*j)/(standard_deviation*standard_deviation));
-			kernel_x[(j + k/2)*k + i + k/2] = g_x;
-			kernel_y[(j + k/2)*k + i + k/2] = g_y;
+			kernel_x[n][m] = g*((-1.0*i)/(standard_deviation*standard_deviation));
+			kernel_y[n][m] = g*((-1.0*j)/(standard_deviation*standard_deviation));
 		}
 	}
 
-	// Get the convolution of the image with the gaussian kernel
-	for( int j = 0; j < height; j++ ) 
+	// Get the convolution of the image with the gaussian kernel, clamping at the edges
+	Parallel::For( height, [&]( int first_row, int last_row )
 	{
-		for( int i = 0; i < width; i++ ) 
+		for( int j = first_row; j < last_row; j++ ) 
 		{
-			double x_sum[3] = {0.0, 0.0, 0.0};
-			double y_sum[3] = {0.0, 0.0, 0.0};
-			for( int n = 0; n < k; n+=5 ) 
+			for( int c = 0; c < 3; c++ )
 			{
-				for( int m = 0; m < k; m+=5 ) 
+				float* x_row = x_sigma[c] + j*width;
+				float* y_row = y_sigma[c] + j*width;
+				memset( x_row, 0, width*sizeof(float) );
+				memset( y_row, 0, width*sizeof(float) );
+				for( int n = 0; n < taps; n++ ) 
 				{
-					int x_pos = i + m - k/2;
-					int y_pos = j + n - k/2;
-					if(x_pos < 0) x_pos = 0;
-					if(x_pos >= width) x_pos = width - 1;
+					int y_pos = j + n*step - k/2;
 					if(y_pos < 0) y_pos = 0;
 					if(y_pos >= height) y_pos = height - 1;
-					
-					double gauss_x = kernel_x[n*k + m];
-					double gauss_y = kernel_y[n*k + m];
-					for(int c = 0; c < 3; c++) 
+					const float* row = planes[c] + y_pos*width;
+
+					for( int m = 0; m < taps; m++ ) 
 					{
-						x_sum[c] += source[y_pos*width*4 + x_pos*4 + c]*gauss_x/255.0;
-						y_sum[c] += source[y_pos*width*4 + x_pos*4 + c]*gauss_y/255.0;
+						const int offset = m*step - k/2;
+						const float gauss_x = kernel_x[n][m];
+						const float gauss_y = kernel_y[n][m];
+						const int first_inside = offset < 0 ? ( -offset < width ? -offset : width ) : 0;
+						const int last_inside = offset > 0 ? ( width - offset > first_inside ? width - offset : first_inside ) : width;
+						for( int i = 0; i < first_inside; i++ )
+						{
+							x_row[i] += row[0]*gauss_x;
+							y_row[i] += row[0]*gauss_y;
+						}
+						for( int i = first_inside; i < last_inside; i++ )
+						{
+							x_row[i] += row[i + offset]*gauss_x;
+							y_row[i] += row[i + offset]*gauss_y;
+						}
+						for( int i = last_inside; i < width; i++ )
+						{
+							x_row[i] += row[width - 1]*gauss_x;
+							y_row[i] += row[width - 1]*gauss_y;
+						}
 					}
 				}
 			}
-			for( int c = 0; c < 3; c++ )
-			{
-				x_sigma[j*width*3 + i*3 + c] = x_sum[c];
-				y_sigma[j*width*3 + i*3 + c] = y_sum[c];
-			}
 		}
-	}
-	delete [] kernel_x;
-	delete [] kernel_y;
+	} );
 }
 
 void 
-GetVectorField( uchar* source, double* v_x, double* v_y, int width, int height, int vector_length, double vector_angle, double gauss_standard_deviation ) 
+GetVectorField( const uchar* source, double* v_x, double* v_y, int width, int height, int vector_length, double vector_angle, double gauss_standard_deviation, ScratchArena& scratch ) 
 ///
 /// Get the vector field based on the image 'source', where each vector is relative to
 /// the image gradient at this point.
@@ -441,77 +452,76 @@ GetVectorField( uchar* source, double* v_x, double* v_y, int width, int height,
 /// @param gauss_standard_deviation
 ///  The standard deviation of the Gaussian function used to determine the image gradients.
 ///
+/// @param scratch
+///  Holds the color planes and the image gradients.
+///
 /// @return
 ///  Nothing.
 ///
 {
-	
-	// Convolve the smoothed image with the gradient of the gaussian function
-	double* x_sigma = new double[ width*height*3 ];
-	double* y_sigma = new double[ width*height*3 ];
-	GetImageGradients( source, x_sigma, y_sigma, width, height, gauss_standard_deviation);
+	ScratchArena::Marker start = scratch.Mark();
+
+	// Split the image into color planes, and convolve them with the gradient of the gaussian function
+	float* planes[3];
+	float* x_sigma[3];
+	float* y_sigma[3];
+	for( int c = 0; c < 3; c++ )
+	{
+		planes[c] = scratch.Allocate<float>( width*height );
+		x_sigma[c] = scratch.Allocate<float>( width*height );
+		y_sigma[c] = scratch.Allocate<float>( width*height );
+	}
+	ImageProcessing::ConvertToPlanes( source, planes[0], planes[1], planes[2], width, height, 1.0f/255.0f );
+	GetImageGradients( planes, x_sigma, y_sigma, width, height, gauss_standard_deviation);
 
-	for(int y = 0; y < height; y++) 
+	Parallel::For( height, [&]( int first_row, int last_row )
 	{
-		for(int x = 0; x < width; x++) 
+		for(int y = first_row; y < last_row; y++) 
 		{
-			// Find theta, the image gradient at this point
-			double e = 0.0;
-			double f = 0.0;
-			double g = 0.0;
-			for(int c = 0; c < 3; c++) {
-				e += x_sigma[y*width*3 + x*3 + c]*x_sigma[y*width*3 + x*3 + c];
-				f += x_sigma[y*width*3 + x*3 + c]*y_sigma[y*width*3 + x*3 + c];
-				g += y_sigma[y*width*3 + x*3 + c]*y_sigma[y*width*3 + x*3 + c];
-			}
-			
-			double lambda1 = (e + g + sqrt((e-g)*(e-g) + 4.0*f*f))/2.0;
-			double lambda2 = (e + g - sqrt((e-g)*(e-g) + 4.0*f*f))/2.0;
-			if(lambda1 != lambda2) {
-				double theta = 0.5*atan2((2.0*f),(e-g));
-				double theta2 = theta + PI/2.0;
-				double f_th1 = 0.5*((e + g) + cos(2.0*theta)*(e - g) + 2.0*f*sin(2.0*theta));
-				double f_th2 = 0.5*((e + g) + cos(2.0*theta2)*(e - g) + 2.0*f*sin(2.0*theta2));
-				if(f_th2 > f_th1) {
-					theta = theta2;
+			for(int x = 0; x < width; x++) 
+			{
+				// Find theta, the image gradient at this point, from the structure tensor summed over the colors
+				double e = 0.0;
+				double f = 0.0;
+				double g = 0.0;
+				for(int c = 0; c < 3; c++) {
+					double gradient_x = x_sigma[c][y*width + x];
+					double gradient_y = y_sigma[c][y*width + x];
+					e += gradient_x*gradient_x;
+					f += gradient_x*gradient_y;
+					g += gradient_y*gradient_y;
 				}
+				
+				double lambda1 = (e + g + sqrt((e-g)*(e-g) + 4.0*f*f))/2.0;
+				double lambda2 = (e + g - sqrt((e-g)*(e-g) + 4.0*f*f))/2.0;
+				if(lambda1 != lambda2) {
+					double theta = 0.5*atan2((2.0*f),(e-g));
+					double theta2 = theta + PI/2.0;
+					double f_th1 = 0.5*((e + g) + cos(2.0*theta)*(e - g) + 2.0*f*sin(2.0*theta));
+					double f_th2 = 0.5*((e + g) + cos(2.0*theta2)*(e - g) + 2.0*f*sin(2.0*theta2));
+					if(f_th2 > f_th1) {
+						theta = theta2;
+					}
 
-				// Find the vectors defined by our vector length, vector angle, and image gradient theta.
-				v_x[y*width + x] = (double)vector_length*cos(theta + vector_angle);
-				v_y[y*width + x] = (double)vector_length*sin(theta + vector_angle);
-			} else {
-				v_x[y*width + x] = 0.0;
-				v_y[y*width + x] = 0.0;
+					// Find the vectors defined by our vector length, vector angle, and image gradient theta.
+					v_x[y*width + x] = (double)vector_length*cos(theta + vector_angle);
+					v_y[y*width + x] = (double)vector_length*sin(theta + vector_angle);
+				} else {
+					v_x[y*width + x] = 0.0;
+					v_y[y*width + x] = 0.0;
+				}
 			}
 		}
-	}
-}
+	} );
 
-double 
-WhiteNoise() 
-///
-/// Returns Gaussian white noise between 0 and 1.
-///
-/// @return
-///  The white noise value calculated.
-///
-{
-	double r = 0.0;
-	for(int i = 0; i < 50; i++) {
-		r += rand()%100/100.0;
-	}
-	r = r - 25.0;
-	r = r*sqrt(12.0/50.0);
-	r = (r + 1)/2.0;
-	if(r < 0) r = 0.0;
-	if(r  > 1) r = 1.0;
-	return r;
+	scratch.Release( start );
 }
 
 void 
-GetRandomNoise( uchar* destination, int width, int height ) 
+GetRandomNoise( uchar* destination, int width, int height, quint64 seed, ScratchArena& scratch ) 
 ///
-/// Fills an image with Gaussian white noise
+/// Fills an image with blurred Gaussian white noise. Large images tile a cached texture
+/// of noise instead of making noise for every pixel.
 ///
 /// @param destination
 ///  The image to store the white noise in.
@@ -522,19 +532,25 @@ GetRandomNoise( uchar* destination, int width, int height )
 /// @param height
 ///  The height of the image.
 ///
+/// @param seed
+///  The seed of the random numbers.
+///
+/// @param scratch
+///  Holds the noise before it is blurred.
+///
 /// @return
 ///  Nothing.
 ///
 {
-	uchar* noise = new uchar[width*height];
-	for(int y = 0; y < height; y++) {
-		for(int x = 0; x < width; x++) {
-			double r = WhiteNoise();
-			
-			noise[y*width + x] = (uchar)r*255;
-		}
-	}
 	int k = 5;
+	if( width*height >= TILED_NOISE_MIN_PIXELS )
+	{
+		NoiseCache::GetBlurredNoise( destination, width, height, NOISE_TEXTURE_SIZE, k, seed );
+		return;
+	}
+
+	// Noise values are spread around the middle of the range, clipped to 0 and 255
+	uchar* noise = scratch.Allocate<uchar>( width*height );
+	ImageProcessing::GaussianNoise( noise, width, height, 127.5, 127.5, seed, PATTERN_NOISE_RANDOM_STREAM );
 	ImageProcessing::GaussianBlur( noise, destination, width, height, 1, k );
-	delete [] noise;
 }
\ No newline at end of file
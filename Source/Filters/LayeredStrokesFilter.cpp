@@ -1,6 +1,10 @@
 #include "LayeredStrokesFilter.h"
-#include "HelperFunctions/Drawing.h"
+#include "HelperFunctions/AtomicCanvas.h"
 #include "HelperFunctions/ImageProcessing.h"
+#include "HelperFunctions/ImageView.h"
+#include "HelperFunctions/Parallel.h"
+#include "HelperFunctions/Random.h"
+#include "HelperFunctions/ScaleSpaceCache.h"
 
 const int LayeredStrokesFilter::MAX_BRUSH_SIZE_DEFAULT = 7;
 const int LayeredStrokesFilter::MIN_BRUSH_SIZE_DEFAULT = 2;
@@ -10,8 +14,12 @@ const int LayeredStrokesFilter::MAXIMUM_POSSIBLE_BRUSH_SIZE = 100;
 const int LayeredStrokesFilter::MINIMUM_FIDELITY_THRESHOLD = 0;
 const int LayeredStrokesFilter::MAXIMUM_FIDELITY_THRESHOLD = 600;
 
-static void RunLayeredStrokesFilter(QImage* source, QImage* destination, int max_brush_size, int min_brush_size, int error_threshold);
-static void DrawBrushStroke(QImage* source, QImage* destination, QPoint position, QColor color, int radius, int z_depth, uchar* depth_buffer, int max_stroke_length);
+static void RunLayeredStrokesFilter(QImage* source, QImage* destination, int max_brush_size, int min_brush_size, int error_threshold, quint64 seed, ScratchArena& scratch);
+static void DrawBrushStroke(const ImageView<const QRgb, 1>& source, const ImageView<QRgb, 1>& destination, QPoint position, QRgb color, int radius, int z_depth, AtomicCanvas& strokes, quint32 sequence, int max_stroke_length);
+
+// Each brush layer draws its stroke depths from its own stream, this one plus the index of
+// the brush, keyed by pixel index
+static const quint64 STROKE_DEPTH_RANDOM_STREAM = 0;
 
 LayeredStrokesFilter::LayeredStrokesFilter()
 ///
@@ -72,12 +80,12 @@ LayeredStrokesFilter::RunFilter( QImage* source )
 	/// Run the filter
 	///
     QImage* canvas = new QImage(source->size(), QImage::Format_ARGB32);
-	RunLayeredStrokesFilter( source, canvas, max_brush_size, min_brush_size, fidelity_threshold );
+	RunLayeredStrokesFilter( source, canvas, max_brush_size, min_brush_size, fidelity_threshold, mSeed, mScratch );
     return canvas;
 }
 
 void 
-RunLayeredStrokesFilter(QImage* source, QImage* destination, int max_brush_size, int min_brush_size, int error_threshold)
+RunLayeredStrokesFilter(QImage* source, QImage* destination, int max_brush_size, int min_brush_size, int error_threshold, quint64 seed, ScratchArena& scratch)
 ///
 /// Runs a filter that creates a painted image by building up a series of curved brush strokes
 /// that approximate the reference image. Use three different brush sizes, a minimum, a maximum,
@@ -100,6 +108,13 @@ RunLayeredStrokesFilter(QImage* source, QImage* destination, int max_brush_size,
 ///  reference image at each point and if the total error exceeds this threshold then a new stroke will be painted.
 ///  Must be between 0 and 300.
 ///
+/// @param seed
+///  The seed of the random stroke depths. Each brush size is a separate stream and each
+///  grid point an index within it.
+///
+/// @param scratch
+///  Holds the depth buffer and the error planes of each layer.
+///
 /// @return
 ///  Nothing
 ///
@@ -119,10 +134,11 @@ RunLayeredStrokesFilter(QImage* source, QImage* destination, int max_brush_size,
 	destination->fill(Qt::white);
 
 	///
-	/// Create the reference image which will be a version of image that is blurred with
-	/// a kernel size equal to the current brush at each step.
+	/// The reference image is a version of the image that is blurred with a kernel size equal
+	/// to the current brush at each step. The blurs are cached by the content of the image,
+	/// so layers that blur the same way and later runs on the same image reuse them.
 	///
-	QImage* reference_image = new QImage(source->size(), QImage::Format_ARGB32);
+	const quint64 content_hash = ScaleSpaceCache::ContentHash( *source );
 
 	///
 	/// Create the depth buffer. This is used to give the strokes the appearance of being
@@ -131,7 +147,8 @@ RunLayeredStrokesFilter(QImage* source, QImage* destination, int max_brush_size,
 	/// strokes with transparency, but as all our strokes are opaque this speeds up the
 	/// process considerably as we can just randomize the depth value of each stroke.
 	///
-	uchar* depth_buffer = new uchar[source->width()*source->height()];
+	ImageView<uchar, 1> depth_buffer = ImageView<uchar, 1>::Allocate( scratch, source->width(), source->height() );
+	ImageView<QRgb, 1> canvas( destination );
 
 	// Do process for each brush size
 	for( int brush_index = 0; brush_index < 3; brush_index++ ) 
@@ -140,87 +157,108 @@ RunLayeredStrokesFilter(QImage* source, QImage* destination, int max_brush_size,
 		///
 		/// Clear the depth buffer
 		///
-        for( int i = 0; i < source->width()*source->height(); i++ ) 
-        {
-            depth_buffer[i] = 0;
-        }
+		depth_buffer.Clear();
+		ScratchArena::Marker layer_start = scratch.Mark();
 
 		///
 		/// Blur image using gaussian blurring, relative to the brush size
 		///
 		int blur_kernel = current_brush_size%2 == 0 ? current_brush_size + 1 : current_brush_size;
-		uchar* blurred_data = new uchar[source->width()*source->height()*4];
-		ImageProcessing::GaussianBlur(source->bits(), blurred_data, source->width(), source->height(), 4, blur_kernel );
-		*reference_image = QImage(blurred_data, source->width(), source->height(), source->format());
-		delete [] blurred_data;
+		boost::shared_ptr< std::vector<uchar> > reference_data = ScaleSpaceCache::GetLevel( *source, content_hash, blur_kernel );
+		ImageView<const QRgb, 1> reference( reinterpret_cast<const QRgb*>( &(*reference_data)[0] ), source->width(), source->height(), source->width() );
+
+		///
+		/// Find the error between the reference image and the canvas painted so far at every
+		/// pixel, and build a summed-area table of it, so the total error of any region takes
+		/// four lookups. The errors are found once for the whole layer, before any of its strokes
+		/// are painted.
+		///
+		const int width = source->width();
+		const int height = source->height();
+		int* error = scratch.Allocate<int>( width*height );
+		Parallel::For( height, [&]( int first_row, int last_row )
+		{
+			for( int j = first_row; j < last_row; j++ )
+			{
+				const QRgb* canvas_row = canvas.Row(j);
+				const QRgb* reference_row = reference.Row(j);
+				for( int i = 0; i < width; i++ )
+				{
+					error[j*width + i] = ImageProcessing::ColorDistance(canvas_row[i], reference_row[i]);
+				}
+			}
+		} );
+		qint64* error_table = scratch.Allocate<qint64>( (width + 1)*(height + 1) );
+		ImageProcessing::SummedAreaTable( error, error_table, width, height );
 
 		///
 		/// For each position on a grid with spacing relative to the current brush size
 		/// find the error between this grid point in the reference image and the canvas 
 		/// that has been painted so far. If this is greater than the error threshold
-		/// then add a new brush stroke to the depth buffer.
+		/// then add a new brush stroke to the depth buffer. The point of maximum error
+		/// of every grid region is found up front.
 		///
 		int grid_size = current_brush_size <= 1 ? 2 : current_brush_size;
-		for(int y = (int)grid_size/2; y < source->height(); y += grid_size ) 
+		const int columns = width > grid_size/2 ? ( width - grid_size/2 + grid_size - 1 )/grid_size : 0;
+		const int rows = height > grid_size/2 ? ( height - grid_size/2 + grid_size - 1 )/grid_size : 0;
+		int* max_errors = scratch.Allocate<int>( columns*rows );
+		int* max_error_positions = scratch.Allocate<int>( columns*rows );
+		ImageProcessing::RegionMaxima( error, width, height, grid_size + 1, grid_size + 1, 0, 0, grid_size, grid_size, columns, rows, max_errors, max_error_positions );
+
+		///
+		/// The strokes of the layer are painted in parallel. They all measure their color error
+		/// against the canvas as it was before the layer, and the atomic canvas puts the same
+		/// stroke on top whatever order the threads paint them in.
+		///
+		AtomicCanvas strokes( canvas, depth_buffer, scratch );
+		Parallel::For( rows, [&]( int first_row, int last_row )
 		{
-			for(int x = (int)grid_size/2; x < source->width(); x += grid_size ) 
+			for( int row = first_row; row < last_row; row++ ) 
 			{
-				const int x_min = fmax(x - grid_size/2, 0 );
-				const int x_max = fmin( x_min + grid_size + 1, source->width() );
-				const int y_min = fmax(y - grid_size/2, 0 );
-				const int y_max = fmin( y_min + grid_size + 1, source->height() );
-
-				///
-				/// Find total error of neighbouring region
-				/// Also store max error to save processing later
-				///
-				double total_error = 0.0;
-
-				double max_error = 0.0;
-				QPoint max_error_point;
-				for( int j = y_min; j < y_max; ++j ) 
+				for( int column = 0; column < columns; column++ ) 
 				{
-					for( int i = x_min; i < x_max; ++i ) 
-					{
-						QColor canvas_color = QColor(destination->pixel(i, j));
-						QColor reference_color = QColor(reference_image->pixel(i, j));
-						double new_diff = ImageProcessing::ColorDistance(canvas_color, reference_color);
-
-						total_error += new_diff;
-						if( new_diff > max_error ) 
-						{
-							max_error_point = QPoint(i, j);
-							max_error = new_diff;
-						}
-					}
-				}
+					const int x = grid_size/2 + column*grid_size;
+					const int y = grid_size/2 + row*grid_size;
+					const int x_min = fmax(x - grid_size/2, 0 );
+					const int x_max = fmin( x_min + grid_size + 1, width );
+					const int y_min = fmax(y - grid_size/2, 0 );
+					const int y_max = fmin( y_min + grid_size + 1, height );
 
-				// If the error is above the threshold, add a stroke to the buffer
-				if(current_brush_size == 1)
-				{ 
-					total_error = total_error/2;
-				}
-				if(total_error/grid_size > error_threshold) 
-				{
-					///
-					/// Render a new stroke at the point of maximum error with the color
-					/// defined by the reference image at this point where the length of the stroke
-					/// is 4 times the length of the largest brush stroke. Give this stroke a random depth value.
 					///
-					/// @todo [crystal 30.12.2012] Do we want to set the maximum stroke length manually?
+					/// Find total error of neighbouring region
 					///
-					DrawBrushStroke(reference_image, destination, max_error_point, QColor(reference_image->pixel(max_error_point.x(), max_error_point.y())), current_brush_size, rand()%256, depth_buffer, brushes[0]*4);
-				}
+					double total_error = ImageProcessing::RegionSum( error_table, width, x_min, y_min, x_max, y_max );
+					const int max_error_index = max_error_positions[row*columns + column];
+					QPoint max_error_point = QPoint( max_error_index%width, max_error_index/width );
+
+					// If the error is above the threshold, add a stroke to the buffer
+					if(current_brush_size == 1)
+					{ 
+						total_error = total_error/2;
+					}
+					if(total_error/grid_size > error_threshold) 
+					{
+						///
+						/// Render a new stroke at the point of maximum error with the color
+						/// defined by the reference image at this point where the length of the stroke
+						/// is 4 times the length of the largest brush stroke. Give this stroke a random depth value.
+						///
+						/// @todo [crystal 30.12.2012] Do we want to set the maximum stroke length manually?
+						///
+						Random random( seed, STROKE_DEPTH_RANDOM_STREAM + brush_index, y*width + x );
+						DrawBrushStroke(reference, canvas, max_error_point, reference.Row(max_error_point.y())[max_error_point.x()], current_brush_size, random.Below( 256 ), strokes, row*columns + column, brushes[0]*4);
+					}
 
+				}
 			}
-		}
+		} );
+		strokes.Resolve();
+		scratch.Release( layer_start );
 	}
-	delete [] depth_buffer;
-	delete reference_image;
 }
 
 void 
-DrawBrushStroke(QImage* source, QImage* destination, QPoint position, QColor color, int radius, int z_depth, uchar* depth_buffer, int max_stroke_length)
+DrawBrushStroke(const ImageView<const QRgb, 1>& source, const ImageView<QRgb, 1>& destination, QPoint position, QRgb color, int radius, int z_depth, AtomicCanvas& strokes, quint32 sequence, int max_stroke_length)
 ///
 /// Draws a brush stroke onto the given canvas with the specified parameters.
 /// Brush stokes are circles drawn at a series of control points until the maximum
@@ -244,8 +282,12 @@ DrawBrushStroke(QImage* source, QImage* destination, QPoint position, QColor col
 /// @param z_depth
 ///  The depth of the new stroke (i.e. whether or not other strokes will be drawn over top of it).
 ///
-/// @param depth_buffer
-///  The depth buffer to store the z_depth of each stroke in.
+/// @param strokes
+///  The canvas the circles of the stroke are drawn on, holding the depth of each stroke.
+///  The color error is measured against the canvas before any strokes of the layer.
+///
+/// @param sequence
+///  The place of the stroke in the order the strokes of the layer are painted in.
 ///
 /// @param max_stroke_length
 ///  The maximum stroke length to draw.
@@ -264,7 +306,7 @@ DrawBrushStroke(QImage* source, QImage* destination, QPoint position, QColor col
 
 	///
 	/// Draw a circle at the first point.
-	Drawing::DrawCircle(destination, position, color, radius, z_depth, depth_buffer);
+	strokes.DrawCircle(position, color, radius, z_depth, sequence);
 
 	float x = position.x();
 	float y = position.y();
@@ -292,12 +334,12 @@ DrawBrushStroke(QImage* source, QImage* destination, QPoint position, QColor col
 			for( int x_incr = -1; x_incr < 2; ++x_incr ) 
 			{
 				int temp_x = (int)x + x_incr < 0 ? 0 : 
-					( (int)x + x_incr >= source->width() ? source->width() - 1 : (int)x + x_incr);
+					( (int)x + x_incr >= source.Width() ? source.Width() - 1 : (int)x + x_incr);
 				int temp_y = (int)y + y_incr < 0 ? 0 : 
-					( (int)y + y_incr >= source->height() ? source->height() - 1 : (int)y + y_incr );
+					( (int)y + y_incr >= source.Height() ? source.Height() - 1 : (int)y + y_incr );
 
-				QColor reference_color = QColor(source->pixel(temp_x, temp_y));
-				float reference_luminance = reference_color.red()*0.3 + reference_color.green()*0.59 + reference_color.blue()*0.11;
+				QRgb reference_color = source.Row(temp_y)[temp_x];
+				float reference_luminance = qRed(reference_color)*0.3 + qGreen(reference_color)*0.59 + qBlue(reference_color)*0.11;
 
 				gradient_x += reference_luminance*sobel_x[x_incr + 1][y_incr + 1];
 				gradient_y += reference_luminance*sobel_y[x_incr + 1][y_incr + 1];
@@ -332,7 +374,7 @@ DrawBrushStroke(QImage* source, QImage* destination, QPoint position, QColor col
 		///
 		/// Break if the new control point is off the edge of the canvas.
 		///
-		if( x < 0 || x >= destination->width() || y < 0 || y >= destination->height() )
+		if( x < 0 || x >= destination.Width() || y < 0 || y >= destination.Height() )
 		{ 
 			break;
 		}
@@ -341,10 +383,10 @@ DrawBrushStroke(QImage* source, QImage* destination, QPoint position, QColor col
 		/// Calculate the color difference between the reference image and the canvas and
 		/// the reference image and the stroke at the new control point.
 		///
-		QColor reference_color = QColor( source->pixel((int)x, (int)y) );
-		QColor canvas_color = QColor( destination->pixel((int)x, (int)y) );
-		double canvas_color_error = ImageProcessing::ColorDistance( reference_color, canvas_color );
-		double stroke_color_error = ImageProcessing::ColorDistance( reference_color, color );
+		QRgb reference_color = source.Row((int)y)[(int)x];
+		QRgb canvas_color = destination.Row((int)y)[(int)x];
+		int canvas_color_error = ImageProcessing::ColorDistance( reference_color, canvas_color );
+		int stroke_color_error = ImageProcessing::ColorDistance( reference_color, color );
 
 		///
 		/// Break if the canvas is a better approximation of the reference image at this point
@@ -358,6 +400,6 @@ DrawBrushStroke(QImage* source, QImage* destination, QPoint position, QColor col
 		///
 		/// Draw a circle at the control point.
 		///
-		Drawing::DrawCircle( destination, QPoint(x, y), color, radius, z_depth, depth_buffer );
+		strokes.DrawCircle( QPoint(x, y), color, radius, z_depth, sequence );
 	}
 }
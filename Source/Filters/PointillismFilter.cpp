@@ -1,19 +1,68 @@
 #include "PointillismFilter.h"
 #include "HelperFunctions/ImageProcessing.h"
-#include "HelperFunctions/Drawing.h"
+#include "HelperFunctions/AtomicCanvas.h"
+#include "HelperFunctions/DeferredCanvas.h"
+#include "HelperFunctions/ImageView.h"
+#include "HelperFunctions/Parallel.h"
+#include "HelperFunctions/PoissonCache.h"
+#include "HelperFunctions/Random.h"
 
-void Pointillize( QImage * img, QImage * canvas, int radius, double strength );
-void BaseLayer( QImage* img, QImage* canvas, int radius, double strength );
-void MainLayer( QImage* img, QImage * canvas, int radius, double strength );
-void EdgeLayer( QImage* img, QImage * canvas, int radius, double hue_distortion, double strength );
+///
+/// The hue, saturation and value of every pixel of the reference image, and the position
+/// in the palette of the closest hue, converted once for all the layers.
+///
+struct HsvPlanes
+{
+	short* hue;
+	uchar* saturation;
+	uchar* value;
+	uchar* palette_position;
+};
 
-void DrawRandomCircle( QImage * img, QPoint pos, QColor color, int radius, int z, uchar* depth_buffer );
-int GetPaletteHuePosition( int hue );
-int GetRandomNeighbour( int pos );
-int ChangeSaturation( int sat, double val, double t, double scale );
-int ChangeHue(double v);
+static const int PALETTE_SIZE = 12;
+
+///
+/// Tables for the color palette, so choosing the palette hue of a point is a lookup rather
+/// than a search of the palette. Going round the color wheel, the closest palette hue
+/// changes at each of the hue thresholds in turn.
+///
+struct PaletteTables
+{
+	PaletteTables();
 
-int chevreul[12] = 	{5, 20, 35, 45, 58, 80, 140, 170, 215, 244, 265, 285};
+	short hue_thresholds[PALETTE_SIZE];
+	int neighbours[PALETTE_SIZE][4];
+};
+
+///
+/// The lowest and highest saturation of a point for each brightness, for a given strength.
+///
+struct SaturationLimits
+{
+	int minimum[256];
+	int maximum[256];
+};
+
+void Pointillize( QImage * img, QImage * canvas, int radius, double strength, quint64 seed, ScratchArena& scratch );
+void BaseLayer( QImage* img, QImage* canvas, int radius, double strength, quint64 seed, const HsvPlanes& hsv, const ImageView<uchar, 1>& depth_buffer );
+void MainLayer( QImage* img, QImage * canvas, int radius, double strength, quint64 seed, const HsvPlanes& hsv, const ImageView<uchar, 1>& depth_buffer, ScratchArena& scratch );
+void EdgeLayer( QImage* img, QImage * canvas, int radius, double hue_distortion, double strength, quint64 seed, const HsvPlanes& hsv, const ImageView<uchar, 1>& depth_buffer, ScratchArena& scratch );
+
+int GetRandomRadius( int radius, Random& random );
+int FindPaletteHuePosition( int hue );
+int GetRandomNeighbour( int pos, Random& random );
+SaturationLimits GetSaturationLimits( double scale );
+int ChangeSaturation( int sat, int v, double t, const SaturationLimits& limits, Random& random );
+int ChangeHue( double v, Random& random );
+
+int chevreul[PALETTE_SIZE] = 	{5, 20, 35, 45, 58, 80, 140, 170, 215, 244, 265, 285};
+
+static const PaletteTables palette_tables;
+
+// Each layer draws its random numbers from its own stream, keyed by point or pixel index
+static const quint64 BASE_LAYER_RANDOM_STREAM = 1;
+static const quint64 MAIN_LAYER_RANDOM_STREAM = 2;
+static const quint64 EDGE_LAYER_RANDOM_STREAM = 3;
 
 PointillismFilter::PointillismFilter()
 {
@@ -34,12 +83,12 @@ PointillismFilter::RunFilter( QImage* source )
 ///
 {
 	QImage* canvas = new QImage(source->size(), QImage::Format_ARGB32);
-	Pointillize( source, canvas, 5, 1.0 );
+	Pointillize( source, canvas, 5, 1.0, mSeed, mScratch );
 	return canvas;
 }
 
 void 
-Pointillize(QImage * img, QImage * canvas, int radius, double strength)
+Pointillize(QImage * img, QImage * canvas, int radius, double strength, quint64 seed, ScratchArena& scratch)
 /// 
 /// Changes a given image to a pointillistic painting style.
 /// Uses poisson disks for point placement. 
@@ -57,6 +106,12 @@ Pointillize(QImage * img, QImage * canvas, int radius, double strength)
 /// @param strength
 ///  The strength of the pointillistic filter, where 1.0 is very strong and 0.0 is very weak.
 ///
+/// @param seed
+///  The seed of the random numbers used by every layer.
+///
+/// @param scratch
+///  Holds the temporary planes of the layers.
+///
 /// @return
 ///  Nothing.
 ///
@@ -64,14 +119,25 @@ Pointillize(QImage * img, QImage * canvas, int radius, double strength)
 	*canvas = img->copy();
 	if( strength > 0.0 ) 
 	{
-		BaseLayer( img, canvas, radius*3, strength );
-		MainLayer( img, canvas, radius, strength );
-		EdgeLayer( img, canvas, radius, 0.2, strength);
+		// Every layer picks its colors from the HSV colors of the reference image
+		HsvPlanes hsv;
+		hsv.hue = scratch.Allocate<short>( img->width()*img->height() );
+		hsv.saturation = scratch.Allocate<uchar>( img->width()*img->height() );
+		hsv.value = scratch.Allocate<uchar>( img->width()*img->height() );
+		ImageProcessing::ConvertToHsv( img->constBits(), hsv.hue, hsv.saturation, hsv.value, img->width(), img->height() );
+		hsv.palette_position = scratch.Allocate<uchar>( img->width()*img->height() );
+		ImageProcessing::QuantizeHue( hsv.hue, palette_tables.hue_thresholds, PALETTE_SIZE, hsv.palette_position, img->width(), img->height() );
+
+		// The layers take turns with the depth buffer, each clearing it first
+		ImageView<uchar, 1> depth_buffer = ImageView<uchar, 1>::Allocate( scratch, img->width(), img->height() );
+		BaseLayer( img, canvas, radius*3, strength, seed, hsv, depth_buffer );
+		MainLayer( img, canvas, radius, strength, seed, hsv, depth_buffer, scratch );
+		EdgeLayer( img, canvas, radius, 0.2, strength, seed, hsv, depth_buffer, scratch );
 	}
 }
 
 void 
-BaseLayer( QImage* img, QImage* canvas, int radius, double strength)
+BaseLayer( QImage* img, QImage* canvas, int radius, double strength, quint64 seed, const HsvPlanes& hsv, const ImageView<uchar, 1>& depth_buffer )
 ///
 /// Covers the canvas in large points. Hues are taken from the palette
 ///  but no color distortion is added at this point.
@@ -89,6 +155,15 @@ BaseLayer( QImage* img, QImage* canvas, int radius, double strength)
 /// @param strength
 ///  The strength of the pointillistic filter, where 1.0 is very strong and 0.0 is very weak.
 ///
+/// @param seed
+///  The seed of the random numbers.
+///
+/// @param hsv
+///  The HSV colors of the reference image.
+///
+/// @param depth_buffer
+///  The depth buffer of the canvas, cleared by the layer.
+///
 /// @return
 ///  Nothing.
 ///
@@ -102,41 +177,38 @@ BaseLayer( QImage* img, QImage* canvas, int radius, double strength)
 	}
 
 	// Clear the depth buffer ready for drawing
-	uchar* depth_buffer = new uchar[img->width()*img->height()];
-	for( int i = 0; i < img->width()*img->height(); i++ )
-	{
-		depth_buffer[i] = 0;
-	}
+	depth_buffer.Clear();
 
-	// Get a poisson disk sampling of the area, and repaint the sampled areas with a brush of small radius
+	// Get a poisson disk sampling of the area, and repaint the sampled areas with a brush of small radius.
+	// The sampling only depends on the spacing, so it comes from a cached tile rather than a fresh run
 	int spacing = radius*2;
-	std::vector<QPoint> poisson = ImageProcessing::GetPoissonDisks(canvas->width(), canvas->height(), spacing);
+	std::vector<QPoint> poisson = PoissonCache::GetPoissonDisks( canvas->width(), canvas->height(), spacing, seed );
+	ImageView<QRgb, 1> canvas_pixels( canvas );
+	DeferredCanvas strokes( canvas_pixels, depth_buffer );
 
 	while(!poisson.empty()) {
 		QPoint pos = poisson.back();
 		poisson.pop_back();
+		Random random( seed, BASE_LAYER_RANDOM_STREAM, poisson.size() );
 
 		// Get the hue at this point and find the closest hue in the color palette
-		QColor hsv = QColor(img->pixel(pos)).toHsv();
-		int hue = hsv.hue();
-		int sat = hsv.saturation();
-		int val = hsv.value();
-
-		hue = chevreul[ GetPaletteHuePosition( hue ) ];
+		const int index = pos.y()*img->width() + pos.x();
+		int hue = chevreul[ hsv.palette_position[index] ];
+		int sat = hsv.saturation[index];
+		int val = hsv.value[index];
 
 		// Paint a point of the chosen hue at a random depth value
-		hsv.setHsv(hue, sat, val);
-		int z = rand()%256;
-		DrawRandomCircle(canvas, pos, hsv.toRgb(), radius, z, depth_buffer);
+		int z = random.Below( 256 );
+		strokes.DrawCircle(pos, ImageProcessing::HsvToRgb(hue, sat, val), GetRandomRadius(radius, random), z);
 	}
 	poisson.clear();
-	delete [] depth_buffer;
+	strokes.Flush();
 }
 
 
 
 void 
-MainLayer( QImage* img, QImage* canvas, int radius, double strength )
+MainLayer( QImage* img, QImage* canvas, int radius, double strength, quint64 seed, const HsvPlanes& hsv, const ImageView<uchar, 1>& depth_buffer, ScratchArena& scratch )
 ///
 /// Paint the main pointillism layer, adding smaller details and more color distortion.
 /// Points are painted where the color error between the canvas and the original image
@@ -156,6 +228,18 @@ MainLayer( QImage* img, QImage* canvas, int radius, double strength )
 /// @param strength
 ///  The strength of the pointillistic filter, where 1.0 is very strong and 0.0 is very weak.
 ///
+/// @param seed
+///  The seed of the random numbers.
+///
+/// @param hsv
+///  The HSV colors of the reference image.
+///
+/// @param depth_buffer
+///  The depth buffer of the canvas, cleared by the layer.
+///
+/// @param scratch
+///  Holds the temporary planes of the layer, which are released at the end of it.
+///
 /// @return
 ///  Nothing.
 ///
@@ -169,100 +253,119 @@ MainLayer( QImage* img, QImage* canvas, int radius, double strength )
 		if(radius < 1) radius = 1;
 	}
 
+	ScratchArena::Marker layer_start = scratch.Mark();
+
 	// Get gray scale of original image
-	uchar* gray = new uchar[img->width()*img->height()];
-	ImageProcessing::ConvertToOneChannel( img->bits(), gray, img->width(), img->height() );
+	uchar* gray = scratch.Allocate<uchar>( img->width()*img->height() );
+	ImageProcessing::ConvertToOneChannel( *img, gray );
 
 	// Blur the grayscale image
-	uchar* smoothed_gray = new uchar[img->width()*img->height()];
+	uchar* smoothed_gray = scratch.Allocate<uchar>( img->width()*img->height() );
 	int kernel = radius;
 	if(kernel%2 == 0) kernel++;
 	if(kernel < 3) kernel = 3;
 	ImageProcessing::GaussianBlur( gray, smoothed_gray, img->width(), img->height(), 1, kernel );
-	delete [] gray;
 
 	// Clear the depth buffer ready for painting
-	uchar* depth_buffer = new uchar[img->width()*img->height()];
-	for( int i = 0; i < img->width()*img->height(); i++ )
+	depth_buffer.Clear();
+
+	const SaturationLimits saturation_limits = GetSaturationLimits( strength );
+
+	// Find the error at every pixel, the difference between the intensity of the canvas
+	// (its HSV value, which is the largest of red, green and blue) and the blurred image,
+	// once for the whole layer. Sum it in a table so the error of a region takes four lookups
+	const int width = img->width();
+	const int height = img->height();
+	ImageView<QRgb, 1> canvas_pixels( canvas );
+	uchar* error = scratch.Allocate<uchar>( width*height );
+	Parallel::For( height, [&]( int first_row, int last_row )
 	{
-		depth_buffer[i] = 0;
-	}
+		for( int j = first_row; j < last_row; j++ )
+		{
+			const QRgb* canvas_row = canvas_pixels.Row( j );
+			for( int i = 0; i < width; i++ )
+			{
+				QRgb color = canvas_row[i];
+				int intensity = qMax( qRed( color ), qMax( qGreen( color ), qBlue( color ) ) );
+				error[j*width + i] = abs(intensity - smoothed_gray[j*width + i]);
+			}
+		}
+	} );
+	qint64* error_table = scratch.Allocate<qint64>( (width + 1)*(height + 1) );
+	ImageProcessing::SummedAreaTable( error, error_table, width, height );
+
+	// Find the maximum error in the neighbourhood of each grid point
+	const int columns = width > radius/2 ? ( width - radius/2 + radius - 1 )/radius : 0;
+	const int rows = height > radius/2 ? ( height - radius/2 + radius - 1 )/radius : 0;
+	uchar* max_errors = scratch.Allocate<uchar>( columns*rows );
+	int* max_error_positions = scratch.Allocate<int>( columns*rows );
+	ImageProcessing::RegionMaxima( error, width, height, 2*(radius/2) + 1, 2*(radius/2) + 1, 0, 0, radius, radius, columns, rows, max_errors, max_error_positions );
+
+	// The grid points don't depend on each other, so they are painted in parallel on a canvas
+	// that decides the point on top the same way whatever order they are painted in
+	AtomicCanvas strokes( canvas_pixels, depth_buffer, scratch );
 
 	// At each grid point, find maximum error based on difference
 	// between intensity at canvas and intensity of blurred image
 	// Paint stroke at this location
-	for( int y = (int)radius/2; y < img->height(); y += radius ) 
+	Parallel::For( rows, [&]( int first_row, int last_row )
 	{
-		for( int x = (int)radius/2; x < img->width(); x += radius ) 
+		for( int row = first_row; row < last_row; row++ ) 
 		{
-			int total_error = 0;
-			int max_error = 0;
-			QPoint max_error_at = QPoint(0, 0);
-
-			// Get error of each pixel in the neighbourhood
-			int min_x = x - radius/2;
-			int min_y = y - radius/2;
-			int max_x = x + radius/2;
-			int max_y = y + radius/2;
-
-			if(min_x < 0) min_x = 0;
-			if(min_y < 0) min_y = 0;
-			if(max_x >= img->width()) max_x = img->width() - 1;
-			if(max_y >= img->height()) max_y = img->height() - 1;
-
-			for( int j = min_y; j <= max_y; j++ ) 
+			for( int column = 0; column < columns; column++ ) 
 			{
-				for( int i = min_x; i <= max_x; i++ ) 
+				int x = radius/2 + column*radius;
+				int y = radius/2 + row*radius;
+
+				// Get error of the neighbourhood
+				int min_x = x - radius/2;
+				int min_y = y - radius/2;
+				int max_x = x + radius/2;
+				int max_y = y + radius/2;
+
+				if(min_x < 0) min_x = 0;
+				if(min_y < 0) min_y = 0;
+				if(max_x >= width) max_x = width - 1;
+				if(max_y >= height) max_y = height - 1;
+
+				qint64 total_error = ImageProcessing::RegionSum( error_table, width, min_x, min_y, max_x + 1, max_y + 1 );
+				int max_error_index = max_error_positions[row*columns + column];
+				QPoint max_error_at = QPoint( max_error_index%width, max_error_index/width );
+
+				// If the total error is above a threshold
+				// Paint a stroke at the area of max error
+				if( total_error > 10*strength ) 
 				{
-					
-					// Get error at this pixel
-					int intensity = QColor(canvas->pixel( i, j )).toHsv().value();
-					int error = abs(intensity - smoothed_gray[j*img->width() + i]);
-
-					// Update error stats
-					total_error += error;
-					if( error > max_error ) 
+					int hue;
+					int sat = hsv.saturation[y*width + x];
+					int v = hsv.value[y*width + x];
+					Random random( seed, MAIN_LAYER_RANDOM_STREAM, y*img->width() + x );
+
+					// Find closest hue in palette
+					int new_pos = hsv.palette_position[y*width + x];
+					if( random.Below( 100 )/100.0 < strength ) 
 					{
-						max_error = error;
-						max_error_at = QPoint( i, j );
+						hue = GetRandomNeighbour(new_pos, random);
+					} 
+					else 
+					{
+						hue = chevreul[new_pos];
 					}
-				}
-			}
-
-			// If the total error is above a threshold
-			// Paint a stroke at the area of max error
-			if( total_error > 10*strength ) 
-			{
-				QColor hsv = QColor(img->pixel( x, y )).toHsv();
-				int hue = hsv.hue();
-				int sat = hsv.saturation();
-				int v = hsv.value();
-
-				// Find closest hue in palette, make a method that does this
-				int new_pos = GetPaletteHuePosition( hsv.hue() );
-				if( (rand()%100)/100.0 < strength ) 
-				{
-					hue = GetRandomNeighbour(new_pos);
-				} 
-				else 
-				{
-					hue = chevreul[new_pos];
-				}
 				
-				sat = ChangeSaturation(sat, v, 0.35*strength, strength);
-				hsv.setHsv( hue, sat, v );
+					sat = ChangeSaturation(sat, v, 0.35*strength, saturation_limits, random);
 
-				int z = rand()%256;
-				DrawRandomCircle(canvas, max_error_at, hsv.toRgb(), radius, z, depth_buffer);
+					int z = random.Below( 256 );
+					strokes.DrawCircle(max_error_at, ImageProcessing::HsvToRgb( hue, sat, v ), GetRandomRadius(radius, random), z, row*columns + column);
+				}
 			}
 		}
-	}
-	delete [] smoothed_gray;
-	delete [] depth_buffer;
+	} );
+	strokes.Resolve();
+	scratch.Release( layer_start );
 }
 
 void 
-EdgeLayer(QImage* img, QImage* canvas, int radius, double hue_distortion, double strength)
+EdgeLayer(QImage* img, QImage* canvas, int radius, double hue_distortion, double strength, quint64 seed, const HsvPlanes& hsv, const ImageView<uchar, 1>& depth_buffer, ScratchArena& scratch)
 ///
 /// This final layer repaints over areas determined to be edges in order to bring smaller details
 /// that have been covered by points back into the picture. The same color distortions are used
@@ -283,6 +386,18 @@ EdgeLayer(QImage* img, QImage* canvas, int radius, double hue_distortion, double
 /// @param strength
 ///  The strength of the pointillistic filter, where 1.0 is very strong and 0.0 is very weak.
 ///
+/// @param seed
+///  The seed of the random numbers.
+///
+/// @param hsv
+///  The HSV colors of the reference image.
+///
+/// @param depth_buffer
+///  The depth buffer of the canvas, cleared by the layer.
+///
+/// @param scratch
+///  Holds the temporary planes of the layer, which are released at the end of it.
+///
 /// @return
 ///  Nothing.
 ///
@@ -296,166 +411,158 @@ EdgeLayer(QImage* img, QImage* canvas, int radius, double hue_distortion, double
 		if( radius < 1 ) radius = 1;
 	}
 	
-	uchar* edges = new uchar[img->width()*img->height()];
-	ImageProcessing::CannyEdgeDetection( img->bits(), edges, img->width(), img->height(), 4 );
+	ScratchArena::Marker layer_start = scratch.Mark();
 
-	uchar* gray = new uchar[img->width()*img->height()];
-	ImageProcessing::ConvertToOneChannel( img->bits(), gray, img->width(), img->height());
+	uchar* edges = scratch.Allocate<uchar>( img->width()*img->height() );
+	ImageProcessing::CannyEdgeDetection( img->constBits(), edges, img->width(), img->height(), 4 );
 
-	uchar* smoothed_gray = new uchar[img->width()*img->height()];
+	uchar* gray = scratch.Allocate<uchar>( img->width()*img->height() );
+	ImageProcessing::ConvertToOneChannel( *img, gray );
+
+	uchar* smoothed_gray = scratch.Allocate<uchar>( img->width()*img->height() );
 	int kernel = radius;
 	if(kernel%2 == 0) kernel++;
 	if(kernel < 3) kernel = 3;
 	ImageProcessing::GaussianBlur( gray, smoothed_gray, img->width(), img->height(), 1, kernel );
-	delete [] gray;
 
 	// Clear the depth buffer ready for painting
-	uchar* depth_buffer = new uchar[img->width()*img->height()];
-	for( int i = 0; i < img->width()*img->height(); i++ )
-	{
-		depth_buffer[i] = 0;
-	}
+	depth_buffer.Clear();
+
+	const SaturationLimits saturation_limits = GetSaturationLimits( strength );
+
+	ImageView<QRgb, 1> canvas_pixels( canvas );
+	AtomicCanvas strokes( canvas_pixels, depth_buffer, scratch );
 
 	// If there is an edge, find the greatest error in the edge's neighbourhood
 	// and at a new stroke at this point.
-	for( int y = 0; y < img->height(); y++ ) 
+	Parallel::For( img->height(), [&]( int first_row, int last_row )
 	{
-		for( int x = 0; x < img->width(); x++ ) 
+		for( int y = first_row; y < last_row; y++ ) 
 		{
-			if( edges[y*img->width() + x] > 0 ) 
+			for( int x = 0; x < img->width(); x++ ) 
 			{
+				if( edges[y*img->width() + x] > 0 ) 
+				{
 
-				// Find the brightest and and darkest spots in the neighbourhood
-				int brightest = 0;
-				int darkest = 255;
-				QPoint brightest_pos = QPoint(0, 0);
-				QPoint darkest_pos = QPoint(0, 0);
-				for( int j = y - radius; j <= y + radius; j++ ) {
-					for( int i = x - radius; i <= x + radius; i++ ) {
-						if( i >= 0 && j >= 0 && i < img->width() && j < img->height() ) {
-							int intensity = smoothed_gray[j*img->width() + i];
-							if(intensity > brightest) {
-								brightest_pos = QPoint(i, j);
-								brightest = intensity;
-							}
-							if(intensity < darkest) {
-								darkest_pos = QPoint(i, j);
-								darkest = intensity;
+					// Find the brightest and and darkest spots in the neighbourhood
+					int brightest = 0;
+					int darkest = 255;
+					QPoint brightest_pos = QPoint(0, 0);
+					QPoint darkest_pos = QPoint(0, 0);
+					for( int j = y - radius; j <= y + radius; j++ ) {
+						for( int i = x - radius; i <= x + radius; i++ ) {
+							if( i >= 0 && j >= 0 && i < img->width() && j < img->height() ) {
+								int intensity = smoothed_gray[j*img->width() + i];
+								if(intensity > brightest) {
+									brightest_pos = QPoint(i, j);
+									brightest = intensity;
+								}
+								if(intensity < darkest) {
+									darkest_pos = QPoint(i, j);
+									darkest = intensity;
+								}
 							}
 						}
 					}
-				}
 
-				// For each position in the neighbourhood, find if most spots
-				// are closer to the brightest or darkest
-				int dark = 0;
-				int bright = 0;
-				for( int j = y - radius; j <= y + radius; j++ ) 
-				{
-					for( int i = x - radius; i <= x + radius; i++ ) 
+					// For each position in the neighbourhood, find if most spots
+					// are closer to the brightest or darkest
+					int dark = 0;
+					int bright = 0;
+					for( int j = y - radius; j <= y + radius; j++ ) 
 					{
-						if( i >= 0 && j >= 0 && i < img->width() && j < img->height() ) {
-							int intensity = smoothed_gray[j*img->width() + i];
-							int bright_diff = brightest - intensity;
-							int dark_diff = intensity - darkest;
-							if(bright_diff < dark_diff) 
-							{
-								bright++;
-							} 
-							else 
-							{
-								dark++;
+						for( int i = x - radius; i <= x + radius; i++ ) 
+						{
+							if( i >= 0 && j >= 0 && i < img->width() && j < img->height() ) {
+								int intensity = smoothed_gray[j*img->width() + i];
+								int bright_diff = brightest - intensity;
+								int dark_diff = intensity - darkest;
+								if(bright_diff < dark_diff) 
+								{
+									bright++;
+								} 
+								else 
+								{
+									dark++;
+								}
 							}
 						}
 					}
-				}
 
-				// Paint at the side that needs defining
-				QPoint new_point;
-				if(bright < dark && bright != 0) 
-				{
-					new_point = brightest_pos;
-				} 
-				else if(dark != 0) 
-				{
-					new_point = darkest_pos;
-				} 
-				else 
-				{
-					new_point = QPoint(x, y);
-				}
+					// Paint at the side that needs defining
+					QPoint new_point;
+					if(bright < dark && bright != 0) 
+					{
+						new_point = brightest_pos;
+					} 
+					else if(dark != 0) 
+					{
+						new_point = darkest_pos;
+					} 
+					else 
+					{
+						new_point = QPoint(x, y);
+					}
 
-				// Paint circle at this position
-				QColor hsv = QColor(img->pixel( new_point )).toHsv();
-				int hue = hsv.hue();
-				int val = hsv.value();
-				int sat = hsv.saturation();
+					// Paint circle at this position
+					const int index = new_point.y()*img->width() + new_point.x();
+					int hue;
+					int val = hsv.value[index];
+					int sat = hsv.saturation[index];
 
-				// Find closest hue in palette
-				int new_pos = GetPaletteHuePosition( hsv.hue() );
+					// Find closest hue in palette
+					int new_pos = hsv.palette_position[index];
+					Random random( seed, EDGE_LAYER_RANDOM_STREAM, y*img->width() + x );
 
-				if( ( rand()%100)/100.0 < strength ) 
-				{
-					hue = GetRandomNeighbour( new_pos );
-				} 
-				else 
-				{
-					hue = chevreul[new_pos];
-				}
+					if( random.Below( 100 )/100.0 < strength ) 
+					{
+						hue = GetRandomNeighbour( new_pos, random );
+					} 
+					else 
+					{
+						hue = chevreul[new_pos];
+					}
 
-				// Hue distortion
-				double r = ( rand()%100 )/100.0;
-				if( ( r < hue_distortion && new_pos != 8 ) || r < hue_distortion/3 ) 
-				{
-					int n = ChangeHue(smoothed_gray[new_point.y()*img->width() + new_point.x()]/256.0)*2;
-					if( n > -1 ) 
+					// Hue distortion
+					double r = random.Below( 100 )/100.0;
+					if( ( r < hue_distortion && new_pos != 8 ) || r < hue_distortion/3 ) 
 					{
-						new_pos = n;
-						if( sat < 70 && val < 0.3 ) sat = 70;
+						int n = ChangeHue(smoothed_gray[new_point.y()*img->width() + new_point.x()]/256.0, random)*2;
+						if( n > -1 ) 
+						{
+							new_pos = n;
+							if( sat < 70 && val < 0.3 ) sat = 70;
+						}
+						hue = chevreul[new_pos];
 					}
-					hue = chevreul[new_pos];
+					sat = ChangeSaturation( sat, val, 0.35*strength, saturation_limits, random );
+					int z = random.Below( 256 );
+					strokes.DrawCircle( new_point, ImageProcessing::HsvToRgb( hue, sat, val ), GetRandomRadius( radius - 1, random ), z, y*img->width() + x );
 				}
-				sat = ChangeSaturation( sat, val, 0.35*strength, strength );
-				int z = rand()%256;
-				hsv.setHsv( hue, sat, val );
-				DrawRandomCircle( canvas, new_point, hsv.toRgb(), radius - 1, z, depth_buffer );
 			}
 		}
-	}
+	} );
+	strokes.Resolve();
 
-	delete [] smoothed_gray;
-	delete [] edges;
-	delete [] depth_buffer;
+	scratch.Release( layer_start );
 }
 
-void 
-DrawRandomCircle( QImage * img, QPoint pos, QColor color, int radius, int z, uchar* depth_buffer )
-///
-/// Draws a circle of random size.
-///
-/// @param img
-///  The image to draw the circle to.
-///
-/// @param pos
-///  The position of the center of the circle.
+int 
+GetRandomRadius( int radius, Random& random )
 ///
-/// @param color
-///  The color of the circle.
+/// Varies the radius of a point at random.
 ///
 /// @param radius
-///  The rough radius of the circle. Will either be increased by 1, decreased by 1, or left the same.
+///  The rough radius of the point.
 ///
-/// @param z
-///  The depth of the circle in the depth_buffer
-///
-/// @param depth_buffer
-///  The depth_buffer of the image.
+/// @param random
+///  The random numbers for this point.
 ///
 /// @return
-///  Nothing.
+///  The radius, either increased by 1, decreased by 1, or left the same.
 /// 
 {
-	int prob = rand()%4;
+	int prob = random.Below( 4 );
 	if( prob < 1 ) 
 	{
 		radius++;
@@ -464,13 +571,13 @@ DrawRandomCircle( QImage * img, QPoint pos, QColor color, int radius, int z, uch
 	{
 		radius--;
 	}
-	Drawing::DrawCircle( img, pos, color, radius, z, depth_buffer );
+	return radius;
 }
 
 int 
-GetPaletteHuePosition( int hue )
+FindPaletteHuePosition( int hue )
 ///
-/// Returns the position in the color palette of the hue closest to a given hue.
+/// Searches the color palette for the hue closest to a given hue. Used to build the palette tables.
 ///
 /// @param hue
 ///  We want to find the hue in the palette that is closest to this hue.
@@ -481,7 +588,7 @@ GetPaletteHuePosition( int hue )
 {
 	int new_pos = 0;
 	int min_dist = 360;
-	for( int j = 0; j < 12; j++ ) 
+	for( int j = 0; j < PALETTE_SIZE; j++ ) 
 	{
 		int dist1 = abs( hue - chevreul[j] );
 		int dist2 = abs( chevreul[j] - hue + 360 );
@@ -500,101 +607,153 @@ GetPaletteHuePosition( int hue )
 	return new_pos;
 }
 
+PaletteTables::PaletteTables()
+///
+/// Constructor. Builds the tables from the palette.
+///
+{
+	// The hues where the closest palette hue changes. Going round the wheel from gray,
+	// the positions change in order and end back at the first
+	int thresholds = 0;
+	int previous = FindPaletteHuePosition( -1 );
+	for( int hue = 0; hue < 360; hue++ ) 
+	{
+		int position = FindPaletteHuePosition( hue );
+		if( position != previous ) 
+		{
+			Q_ASSERT( thresholds < PALETTE_SIZE && position == ( thresholds + 1 )%PALETTE_SIZE );
+			hue_thresholds[thresholds++] = hue;
+			previous = position;
+		}
+	}
+	Q_ASSERT( thresholds == PALETTE_SIZE );
+
+	// The neighbouring hue for each of the four random draws. One in four moves down the
+	// wheel and one in four moves up it, except for the blues which never move up
+	for( int pos = 0; pos < PALETTE_SIZE; pos++ ) 
+	{
+		bool blue = pos == 8 || pos == 9;
+		for( int prob = 0; prob < 4; prob++ ) 
+		{
+			int neighbour = pos;
+			if( prob < 1 ) 
+			{
+				neighbour--;
+			} 
+			else if( !blue && prob > 2 )
+			{
+				neighbour++;
+			}
+			neighbours[pos][prob] = chevreul[( neighbour + PALETTE_SIZE )%PALETTE_SIZE];
+		}
+	}
+}
+
 int 
-GetRandomNeighbour(int pos) 
+GetRandomNeighbour(int pos, Random& random) 
 ///
 /// Find a random neighbor close to a given position in the chevreul color wheel.
 ///
 /// @param pos
 ///  The position in the color wheel to look for a neighbor close to.
 ///
+/// @param random
+///  The random numbers for this point.
+///
 /// @return
 ///  The resulting random near hue that was found.
 ///
 {
-	bool blue = pos == 8 || pos == 9;
-	int prob = rand()%4;
-	if( prob < 1 ) 
-	{
-		pos--;
-	} 
-	else if( (blue && prob > 4) || (!blue && prob > 2 ) )
-	{
-		pos++;
-	}
-
-	if(pos < 0) pos = 12 + pos;
-	return chevreul[pos];
+	return palette_tables.neighbours[pos][random.Below( 4 )];
 }
 
-// Changes the saturation depending on the saturation and brightness of the pixel
-int 
-ChangeSaturation(int sat, double v, double t, double scale)
-///
-/// Distorts a given saturation value depending on the saturation and brightness
-/// and brightness of the pixel.
-///
-/// @param sat
-///  The saturation of the pixel.
+SaturationLimits
+GetSaturationLimits( double scale )
 ///
-/// @param v
-///  The brightness of the pixel.
-///
-/// @param t
-///  @todo: what is this function actually doing?
+/// Works out how far the saturation of a point is pushed for each brightness. Dark points
+/// get at least a minimum saturation, which is higher the darker they are, and only the
+/// brightest points have their saturation capped.
 ///
 /// @param scale
-///
+///  Scales the minimum saturations, from 0.0 for none to 1.0 for the strongest.
 ///
 /// @return
-///  The distorted saturation value.
+///  The limits for every brightness.
 ///
 {
-	double prob = (rand()%100)/100.0;
-	if( prob < t ) 
+	SaturationLimits limits;
+	int thresholds [4] = {(int)(220*scale), (int)(150*scale), (int)(80*scale), (int)(30*scale)};
+	for( int value = 0; value < 256; value++ ) 
 	{
-		// Increase relative to how low luminance is
-		// Only decrease saturation if luminance greater than 0.9
-		int thresholds [4] = {(int)(220*scale), (int)(150*scale), (int)(80*scale), (int)(30*scale)};
+		double v = value;
+		int min_sat = 0;
+		int max_sat = 255;
 		if( v < 0.2 ) 
 		{
-			int change = thresholds[0];
-			if( sat < change) sat = change;
+			min_sat = thresholds[0];
 		} 
 		else if( v < 0.25 ) 
 		{
-			int min_sat = thresholds[1];
 			double increase = (0.25 - v)*10.0;
-			min_sat += (int)((thresholds[0] - thresholds[1])*increase);
-			if(sat < min_sat) sat = min_sat;
+			min_sat = thresholds[1] + (int)((thresholds[0] - thresholds[1])*increase);
 		} 
 		else if( v < 0.4 ) 
 		{
-			int min_sat = thresholds[2];
 			double increase = (0.4 - v)*10.0/1.5;
-			min_sat += (int)((thresholds[1] - thresholds[2])*increase);
-			if( sat < min_sat ) sat = min_sat;
+			min_sat = thresholds[2] + (int)((thresholds[1] - thresholds[2])*increase);
 		} 
 		else if( v < 0.9 ) 
 		{
-			int min_sat = thresholds[3];
 			double increase = (0.9 - v)*10.0/5.0;
-			min_sat += (int)((thresholds[2] - thresholds[3])*increase);
-			if( sat < min_sat ) sat = min_sat;
+			min_sat = thresholds[3] + (int)((thresholds[2] - thresholds[3])*increase);
 		} 
 		else 
 		{
-			int max_sat = 30;
 			double decrease = (1.0 - v)*10.0;
-			max_sat -= 30*decrease;
-			if(sat > max_sat) sat = max_sat;
-		}	
+			max_sat = qMin( 255.0, 30 - 30*decrease );
+		}
+		limits.minimum[value] = min_sat;
+		limits.maximum[value] = max_sat;
+	}
+	return limits;
+}
+
+int 
+ChangeSaturation( int sat, int v, double t, const SaturationLimits& limits, Random& random )
+///
+/// Distorts a given saturation value depending on the saturation and brightness
+/// of the pixel.
+///
+/// @param sat
+///  The saturation of the pixel.
+///
+/// @param v
+///  The brightness of the pixel, from 0 to 255.
+///
+/// @param t
+///  The probability that the saturation is changed.
+///
+/// @param limits
+///  The saturation limits for each brightness, from GetSaturationLimits.
+///
+/// @param random
+///  The random numbers for this point.
+///
+/// @return
+///  The distorted saturation value.
+///
+{
+	double prob = random.Below( 100 )/100.0;
+	if( prob < t ) 
+	{
+		if( sat < limits.minimum[v] ) sat = limits.minimum[v];
+		if( sat > limits.maximum[v] ) sat = limits.maximum[v];
 	}
 	return sat;
 }
 
 int 
-ChangeHue(double v)
+ChangeHue(double v, Random& random)
 ///
 /// Returns a random hue where the probability of certain colors is relative
 /// to a brightness value.
@@ -602,6 +761,9 @@ ChangeHue(double v)
 /// @param brightness
 ///  The brightness to determine the probability of each hue from.
 ///
+/// @param random
+///  The random numbers for this point.
+///
 /// @return
 ///  The chosen hue position in the chevreul color palette.
 ///
@@ -632,13 +794,13 @@ ChangeHue(double v)
 		double decrease = (0.6 - v)/0.1*0.5;
 		yellow_prob = 0.6 - decrease;
 	}
-	double random = (rand()%100)/100.0;
-	if( random < blue_prob) 
+	double r = random.Below( 100 )/100.0;
+	if( r < blue_prob) 
 	{
 		// blue
 		return 4;
 	} 
-	else if( random > 1.0 - yellow_prob ) 
+	else if( r > 1.0 - yellow_prob ) 
 	{
 		// yellow
 		return 2;
@@ -0,0 +1,140 @@
+#include "AtomicCanvas.h"
+#include "Drawing.h"
+#include "Parallel.h"
+
+#include <new>
+#include <vector>
+
+///
+/// The sequence field of pixels no circle has been drawn on. It is above the field of every
+/// circle, so a circle only wins a pixel from the canvas by being deeper than the depth buffer.
+///
+static const quint64 UNTOUCHED = 0xffffffff;
+
+static const int DEPTH_SHIFT = 56;
+static const int SEQUENCE_SHIFT = 24;
+static const quint64 COLOR_MASK = 0xffffff;
+
+AtomicCanvas::AtomicCanvas( const ImageView<QRgb, 1>& canvas, const ImageView<uchar, 1>& depth_buffer, ScratchArena& scratch )
+///
+/// Constructor. Packs the canvas and depth buffer into words.
+///
+/// @param canvas
+///  The canvas the circles are drawn on to when resolved.
+///
+/// @param depth_buffer
+///  The depth buffer of the canvas. The same size as the canvas.
+///
+/// @param scratch
+///  Holds the words, which live until they are released from the arena.
+///
+: mCanvas( canvas ),
+  mDepthBuffer( depth_buffer ),
+  mPixels( scratch.Allocate< QAtomicInteger<quint64> >( (size_t)canvas.Width()*canvas.Height() ) )
+{
+	const int width = mCanvas.Width();
+	Parallel::For( mCanvas.Height(), [&]( int first_row, int last_row )
+	{
+		for( int y = first_row; y < last_row; y++ )
+		{
+			const QRgb* canvas_row = mCanvas.Row( y );
+			const uchar* depth_row = mDepthBuffer.Row( y );
+			QAtomicInteger<quint64>* row = mPixels + (size_t)y*width;
+			for( int x = 0; x < width; x++ )
+			{
+				quint64 word = ( (quint64)depth_row[x] << DEPTH_SHIFT ) | ( UNTOUCHED << SEQUENCE_SHIFT ) | ( canvas_row[x] & COLOR_MASK );
+				new( &row[x] ) QAtomicInteger<quint64>( word );
+			}
+		}
+	} );
+}
+
+void
+AtomicCanvas::DrawCircle( QPoint position, QRgb color, int radius, int z_depth, quint32 sequence )
+///
+/// Draws a circle, with the same pixels as Drawing::DrawCircle. Safe to call from many
+/// threads at once.
+///
+/// @param position
+///  The center point of the circle to be drawn.
+///
+/// @param color
+///  The color of the circle to be drawn. Its alpha is ignored, circles are always opaque.
+///
+/// @param radius
+///  The radius of the circle to be drawn. Nothing is drawn if it is negative.
+///
+/// @param z_depth
+///  The depth of the circle being drawn within the depth buffer, from 0 to 255.
+///
+/// @param sequence
+///  Where the circle comes in the order of drawing, below 2^32 - 1. Of circles at the same
+///  depth, the one with the lowest sequence number ends up on top. Circles with the same
+///  color and depth, such as the circles of one brush stroke, can share a number.
+///
+/// @return
+///  Nothing.
+///
+{
+	if( radius < 0 )
+	{
+		return;
+	}
+
+	std::vector<int> found_half_widths;
+	const std::vector<int>& half_widths = Drawing::CircleSpans( radius, found_half_widths );
+
+	const quint64 word = ( (quint64)z_depth << DEPTH_SHIFT ) | ( ( UNTOUCHED - 1 - sequence ) << SEQUENCE_SHIFT ) | ( color & COLOR_MASK );
+	const int width = mCanvas.Width();
+	const int reach = ( (int)half_widths.size() - 1 )/2;
+	const int first_row = qMax( position.y() - reach, 0 );
+	const int last_row = qMin( position.y() + reach, mCanvas.Height() - 1 );
+	for( int y = first_row; y <= last_row; y++ )
+	{
+		const int half_width = half_widths[y - position.y() + reach];
+		if( half_width < 0 ) continue;
+
+		const int x_left = qMax( position.x() - half_width, 0 );
+		const int x_right = qMin( position.x() + half_width, width - 1 );
+		QAtomicInteger<quint64>* row = mPixels + (size_t)y*width;
+		for( int x = x_left; x <= x_right; x++ )
+		{
+			// Atomic maximum: only try to swap while the circle is still on top
+			quint64 current = row[x].loadAcquire();
+			while( word > current && !row[x].testAndSetRelaxed( current, word, current ) )
+			{
+			}
+		}
+	}
+}
+
+void
+AtomicCanvas::Resolve()
+///
+/// Unpacks the words back into the canvas and depth buffer, once every circle is drawn.
+/// Pixels no circle was drawn on are left alone.
+///
+/// @return
+///  Nothing.
+///
+{
+	const int width = mCanvas.Width();
+	Parallel::For( mCanvas.Height(), [&]( int first_row, int last_row )
+	{
+		for( int y = first_row; y < last_row; y++ )
+		{
+			QRgb* canvas_row = mCanvas.Row( y );
+			uchar* depth_row = mDepthBuffer.Row( y );
+			const QAtomicInteger<quint64>* row = mPixels + (size_t)y*width;
+			for( int x = 0; x < width; x++ )
+			{
+				quint64 word = row[x].loadAcquire();
+				if( ( ( word >> SEQUENCE_SHIFT ) & UNTOUCHED ) != UNTOUCHED )
+				{
+					canvas_row[x] = 0xff000000 | (QRgb)( word & COLOR_MASK );
+					depth_row[x] = word >> DEPTH_SHIFT;
+				}
+			}
+		}
+	} );
+}
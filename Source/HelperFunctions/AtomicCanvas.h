@@ -0,0 +1,36 @@
+#ifndef _ATOMIC_CANVAS_H_
+#define _ATOMIC_CANVAS_H_
+
+#include <QtWidgets>
+
+#include "ImageView.h"
+#include "ScratchArena.h"
+
+///
+/// A canvas that many threads can draw circles on at once, without locks. Each pixel is a
+/// 64 bit word holding the depth of the circle on top in the highest 8 bits, then its
+/// sequence number inverted in the next 32 bits, then its color in the lowest 24 bits, and
+/// drawing a pixel is an atomic maximum of the word. The deepest circle always wins, and of
+/// circles at the same depth the one with the lowest sequence number wins, just as the
+/// circle drawn first wins when drawing in order. So once every circle is drawn, whatever
+/// order the threads drew them in, the words hold what drawing the circles one at a time in
+/// sequence order with Drawing::DrawCircle would have.
+///
+/// The words start out with the canvas and depth buffer as they were, and the canvas and
+/// depth buffer aren't changed until Resolve, so they can be read while circles are drawn.
+///
+class AtomicCanvas
+{
+	public:
+		AtomicCanvas( const ImageView<QRgb, 1>& canvas, const ImageView<uchar, 1>& depth_buffer, ScratchArena& scratch );
+
+		void DrawCircle( QPoint position, QRgb color, int radius, int z_depth, quint32 sequence );
+		void Resolve();
+
+	private:
+		ImageView<QRgb, 1> mCanvas;
+		ImageView<uchar, 1> mDepthBuffer;
+		QAtomicInteger<quint64>* mPixels;
+};
+
+#endif
@@ -0,0 +1,541 @@
+#include "Convolution.h"
+#include "CpuDispatch.h"
+#include <math.h>
+#include <string.h>
+
+#ifdef SIMD_X86
+#include <immintrin.h>
+#endif
+
+///
+/// The amount of cache a vertical pass aims to keep busy with one strip of rows.
+///
+static const int VERTICAL_BLOCK_BYTES = 128*1024;
+
+///
+/// Strips are a whole number of cache lines wide.
+///
+static const int VERTICAL_STRIP_ALIGNMENT = 64;
+
+static inline uchar
+ClampFixedPoint( int total, int shift )
+///
+/// Converts a fixed-point accumulator back to a pixel value. Matches the clamping
+/// and truncation of the double precision path.
+///
+{
+	if( total < 0 ) return 0;
+	total >>= shift;
+	return total > 255 ? 255 : (uchar)total;
+}
+
+static inline int
+PairWeight( short first, short second )
+///
+/// Packs two neighbouring taps into one 32 bit word so they can be applied
+/// with a single multiply-add on interleaved 16 bit pixel values.
+///
+{
+	return (int)( ( (unsigned int)(unsigned short)second << 16 ) | (unsigned short)first );
+}
+
+bool
+Convolution::QuantizeKernel( const double* kernel, int kernel_size, short* fixed_kernel, int& shift )
+///
+/// Converts a double precision kernel to 16 bit fixed-point weights. The largest shift
+/// is chosen for which every weight fits in a short and the accumulated rounding error
+/// stays below one pixel level, so results are within 1 of the double path.
+///
+/// @param kernel
+///  The double precision 1D kernel.
+///
+/// @param kernel_size
+///  The size of the given kernel.
+///
+/// @param fixed_kernel
+///  Stores the quantized weights (must hold kernel_size values).
+///
+/// @param shift
+///  Stores the number of fractional bits used by the quantized weights.
+///
+/// @return
+///  False if the kernel can't be represented accurately enough, in which case the
+///  caller should fall back to the double precision path.
+///
+{
+	double max_weight = 0.0;
+	double total_weight = 0.0;
+	for( int k = 0; k < kernel_size; k++ )
+	{
+		double weight = fabs( kernel[k] );
+		if( weight > max_weight ) max_weight = weight;
+		total_weight += weight;
+	}
+
+	for( shift = 15; shift >= 8; shift-- )
+	{
+		double scale = (double)( 1 << shift );
+
+		// Each weight is off by at most half a step, which must not add up to a full level
+		if( kernel_size*255.0 >= 2.0*scale ) return false;
+		if( max_weight*scale + 0.5 > 32767.0 ) continue;
+		if( total_weight*scale*255.0 >= 1073741824.0 ) continue;
+
+		for( int k = 0; k < kernel_size; k++ )
+		{
+			fixed_kernel[k] = (short)floor( kernel[k]*scale + 0.5 );
+		}
+		return true;
+	}
+	return false;
+}
+
+///
+/// Span kernels are instantiated for 1 to MAX_UNROLLED_PAIRS tap pairs (kernels of size 1 to 15),
+/// which lets the compiler unroll the tap loop and keep every weight in a register.
+///
+static const int MAX_UNROLLED_PAIRS = 8;
+
+template <int PAIRS> static inline void
+ConvolveSpanTail( const uchar* const* taps, const int* pair_weights, int pairs, int shift, uchar* destination, int begin, int count )
+///
+/// Scalar version of the span convolution, used for whatever is left over after the vector loops.
+/// PAIRS is the number of tap pairs, or 0 to use the pairs argument.
+///
+{
+	const int n = PAIRS ? PAIRS : pairs;
+	for( int i = begin; i < count; i++ )
+	{
+		int total = 0;
+		for( int k = 0; k < n; k++ )
+		{
+			total += taps[2*k][i]*(short)( pair_weights[k] & 0xffff ) + taps[2*k + 1][i]*(short)( pair_weights[k] >> 16 );
+		}
+		destination[i] = ClampFixedPoint( total, shift );
+	}
+}
+
+template <int PAIRS> struct SpanScalar
+{
+	static void Run( const uchar* const* taps, const int* pair_weights, int pairs, int shift, uchar* destination, int count )
+	{
+		ConvolveSpanTail<PAIRS>( taps, pair_weights, pairs, shift, destination, 0, count );
+	}
+};
+
+#ifdef SIMD_X86
+template <int PAIRS> struct SpanSse2
+{
+	SIMD_TARGET( "sse2" ) static void Run( const uchar* const* taps, const int* pair_weights, int pairs, int shift, uchar* destination, int count )
+	{
+		const int n = PAIRS ? PAIRS : pairs;
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i sse_shift = _mm_cvtsi32_si128( shift );
+		int i = 0;
+		for( ; i + 8 <= count; i += 8 )
+		{
+			__m128i total_lo = _mm_setzero_si128();
+			__m128i total_hi = _mm_setzero_si128();
+			for( int k = 0; k < n; k++ )
+			{
+				__m128i a = _mm_unpacklo_epi8( _mm_loadl_epi64( (const __m128i*)( taps[2*k] + i ) ), zero );
+				__m128i b = _mm_unpacklo_epi8( _mm_loadl_epi64( (const __m128i*)( taps[2*k + 1] + i ) ), zero );
+				__m128i weight = _mm_set1_epi32( pair_weights[k] );
+				total_lo = _mm_add_epi32( total_lo, _mm_madd_epi16( _mm_unpacklo_epi16( a, b ), weight ) );
+				total_hi = _mm_add_epi32( total_hi, _mm_madd_epi16( _mm_unpackhi_epi16( a, b ), weight ) );
+			}
+			total_lo = _mm_sra_epi32( total_lo, sse_shift );
+			total_hi = _mm_sra_epi32( total_hi, sse_shift );
+
+			__m128i words = _mm_packs_epi32( total_lo, total_hi );
+			_mm_storel_epi64( (__m128i*)( destination + i ), _mm_packus_epi16( words, words ) );
+		}
+		ConvolveSpanTail<PAIRS>( taps, pair_weights, pairs, shift, destination, i, count );
+	}
+};
+
+template <int PAIRS> struct SpanAvx2
+{
+	SIMD_TARGET( "avx2" ) static void Run( const uchar* const* taps, const int* pair_weights, int pairs, int shift, uchar* destination, int count )
+	{
+		const int n = PAIRS ? PAIRS : pairs;
+		const __m128i avx_shift = _mm_cvtsi32_si128( shift );
+		int i = 0;
+		for( ; i + 16 <= count; i += 16 )
+		{
+			__m256i total_lo = _mm256_setzero_si256();
+			__m256i total_hi = _mm256_setzero_si256();
+			for( int k = 0; k < n; k++ )
+			{
+				__m256i a = _mm256_cvtepu8_epi16( _mm_loadu_si128( (const __m128i*)( taps[2*k] + i ) ) );
+				__m256i b = _mm256_cvtepu8_epi16( _mm_loadu_si128( (const __m128i*)( taps[2*k + 1] + i ) ) );
+				__m256i weight = _mm256_set1_epi32( pair_weights[k] );
+				total_lo = _mm256_add_epi32( total_lo, _mm256_madd_epi16( _mm256_unpacklo_epi16( a, b ), weight ) );
+				total_hi = _mm256_add_epi32( total_hi, _mm256_madd_epi16( _mm256_unpackhi_epi16( a, b ), weight ) );
+			}
+			total_lo = _mm256_sra_epi32( total_lo, avx_shift );
+			total_hi = _mm256_sra_epi32( total_hi, avx_shift );
+
+			// Unpacking works within 128 bit lanes, packing puts the values back in order per lane
+			__m256i words = _mm256_packs_epi32( total_lo, total_hi );
+			__m256i bytes = _mm256_permute4x64_epi64( _mm256_packus_epi16( words, words ), 0x08 );
+			_mm_storeu_si128( (__m128i*)( destination + i ), _mm256_castsi256_si128( bytes ) );
+		}
+		ConvolveSpanTail<PAIRS>( taps, pair_weights, pairs, shift, destination, i, count );
+	}
+};
+
+template <int PAIRS> struct SpanAvx512
+{
+	SIMD_TARGET( "avx512f,avx512bw" ) static void Run( const uchar* const* taps, const int* pair_weights, int pairs, int shift, uchar* destination, int count )
+	{
+		const int n = PAIRS ? PAIRS : pairs;
+		const __m128i avx_shift = _mm_cvtsi32_si128( shift );
+		const __m512i low_halves = _mm512_set_epi64( 7, 5, 3, 1, 6, 4, 2, 0 );
+		int i = 0;
+		for( ; i + 32 <= count; i += 32 )
+		{
+			__m512i total_lo = _mm512_setzero_si512();
+			__m512i total_hi = _mm512_setzero_si512();
+			for( int k = 0; k < n; k++ )
+			{
+				__m512i a = _mm512_cvtepu8_epi16( _mm256_loadu_si256( (const __m256i*)( taps[2*k] + i ) ) );
+				__m512i b = _mm512_cvtepu8_epi16( _mm256_loadu_si256( (const __m256i*)( taps[2*k + 1] + i ) ) );
+				__m512i weight = _mm512_set1_epi32( pair_weights[k] );
+				total_lo = _mm512_add_epi32( total_lo, _mm512_madd_epi16( _mm512_unpacklo_epi16( a, b ), weight ) );
+				total_hi = _mm512_add_epi32( total_hi, _mm512_madd_epi16( _mm512_unpackhi_epi16( a, b ), weight ) );
+			}
+			total_lo = _mm512_sra_epi32( total_lo, avx_shift );
+			total_hi = _mm512_sra_epi32( total_hi, avx_shift );
+
+			// As with AVX2, each 128 bit lane ends up holding its 8 results twice
+			__m512i words = _mm512_packs_epi32( total_lo, total_hi );
+			__m512i bytes = _mm512_permutexvar_epi64( low_halves, _mm512_packus_epi16( words, words ) );
+			_mm256_storeu_si256( (__m256i*)( destination + i ), _mm512_castsi512_si256( bytes ) );
+		}
+		ConvolveSpanTail<PAIRS>( taps, pair_weights, pairs, shift, destination, i, count );
+	}
+};
+#endif
+
+template <template <int> class Span> static inline void
+ConvolveSpanUnrolled( const uchar* const* taps, const int* pair_weights, int pairs, int shift, uchar* destination, int count )
+///
+/// Runs the instantiation of a span kernel that is unrolled for the given number of
+/// tap pairs, or the generic loop if the kernel is too big to have one.
+///
+{
+	switch( pairs )
+	{
+		case 1: Span<1>::Run( taps, pair_weights, pairs, shift, destination, count ); break;
+		case 2: Span<2>::Run( taps, pair_weights, pairs, shift, destination, count ); break;
+		case 3: Span<3>::Run( taps, pair_weights, pairs, shift, destination, count ); break;
+		case 4: Span<4>::Run( taps, pair_weights, pairs, shift, destination, count ); break;
+		case 5: Span<5>::Run( taps, pair_weights, pairs, shift, destination, count ); break;
+		case 6: Span<6>::Run( taps, pair_weights, pairs, shift, destination, count ); break;
+		case 7: Span<7>::Run( taps, pair_weights, pairs, shift, destination, count ); break;
+		case MAX_UNROLLED_PAIRS: Span<MAX_UNROLLED_PAIRS>::Run( taps, pair_weights, pairs, shift, destination, count ); break;
+		default: Span<0>::Run( taps, pair_weights, pairs, shift, destination, count ); break;
+	}
+}
+
+void
+Convolution::ConvolveSpanScalar( const uchar* const* taps, const int* pair_weights, int pairs, int shift, uchar* destination, int count )
+///
+/// The branch free inner loop of the engine. Computes destination[i] as the weighted sum
+/// of taps[k][i] for a span of bytes. Taps are consumed two at a time so each 16 bit
+/// multiply-add applies a pair of weights. This is the reference implementation, the
+/// vector versions below give exactly the same results.
+///
+/// @param taps
+///  A pointer for each tap (2*pairs of them) to the source bytes lined up with destination.
+///
+/// @param pair_weights
+///  The fixed-point weights packed in pairs.
+///
+/// @param pairs
+///  The number of tap pairs.
+///
+/// @param shift
+///  The number of fractional bits in the weights.
+///
+/// @param destination
+///  Where the result is to be stored.
+///
+/// @param count
+///  The number of bytes to process.
+///
+/// @return
+///  Nothing.
+///
+{
+	ConvolveSpanUnrolled<SpanScalar>( taps, pair_weights, pairs, shift, destination, count );
+}
+
+#ifdef SIMD_X86
+void
+Convolution::ConvolveSpanSse2( const uchar* const* taps, const int* pair_weights, int pairs, int shift, uchar* destination, int count )
+///
+/// SSE2 version of ConvolveSpanScalar, 8 bytes at a time.
+///
+{
+	ConvolveSpanUnrolled<SpanSse2>( taps, pair_weights, pairs, shift, destination, count );
+}
+
+void
+Convolution::ConvolveSpanAvx2( const uchar* const* taps, const int* pair_weights, int pairs, int shift, uchar* destination, int count )
+///
+/// AVX2 version of ConvolveSpanScalar, 16 bytes at a time.
+///
+{
+	ConvolveSpanUnrolled<SpanAvx2>( taps, pair_weights, pairs, shift, destination, count );
+}
+
+void
+Convolution::ConvolveSpanAvx512( const uchar* const* taps, const int* pair_weights, int pairs, int shift, uchar* destination, int count )
+///
+/// AVX-512 version of ConvolveSpanScalar, 32 bytes at a time.
+///
+{
+	ConvolveSpanUnrolled<SpanAvx512>( taps, pair_weights, pairs, shift, destination, count );
+}
+#endif
+
+template <int CHANNELS> static void
+HorizontalEdges( const uchar* source_row, uchar* destination_row, int width, int channels, const short* fixed_kernel, int kernel_size, int shift, int interior_begin, int interior_end )
+///
+/// Convolves the pixels of a row where the kernel hangs over the left or right edge, clamping
+/// to the edge pixels. CHANNELS is the number of channels, or 0 to use the channels argument.
+///
+{
+	const int n = CHANNELS ? CHANNELS : channels;
+	const int half = kernel_size/2;
+	for( int i = 0; i < width; i++ )
+	{
+		if( i == interior_begin ) i = interior_end;
+		if( i >= width ) break;
+
+		for( int c = 0; c < n; c++ )
+		{
+			int total = 0;
+			for( int kx = 0; kx < kernel_size; kx++ )
+			{
+				int x_pos = i + kx - half;
+				if( x_pos < 0 ) x_pos = 0;
+				if( x_pos >= width ) x_pos = width - 1;
+
+				total += source_row[x_pos*n + c]*fixed_kernel[kx];
+			}
+			destination_row[i*n + c] = ClampFixedPoint( total, shift );
+		}
+	}
+}
+
+void
+Convolution::HorizontalPass( const uchar* source, uchar* destination, int width, int height, int channels, const short* fixed_kernel, int kernel_size, int shift )
+///
+/// Performs a horizontal convolution with a quantized 1D kernel. Pixels closer than
+/// half a kernel to the left or right edge are clamped in a scalar prologue and epilogue
+/// so the interior can run through the span kernel without any edge checks.
+///
+/// @param source
+///  The source image data.
+///
+/// @param destination
+///  The image data where the result is to be stored (must be the same dimensions as source,
+///  may be the same as source).
+///
+/// @param width
+///  The width of the image.
+///
+/// @param height
+///  The height of the image.
+///
+/// @param channels
+///  The number of color channels in the image.
+///
+/// @param fixed_kernel
+///  The kernel as returned by QuantizeKernel.
+///
+/// @param kernel_size
+///  The size of the given kernel.
+///
+/// @param shift
+///  The number of fractional bits in the kernel weights.
+///
+/// @return
+///  Nothing.
+///
+{
+	const int half = kernel_size/2;
+	const int pairs = ( kernel_size + 1 )/2;
+	const int row_size = width*channels;
+
+	int* pair_weights = new int[pairs];
+	for( int k = 0; k < pairs; k++ )
+	{
+		pair_weights[k] = PairWeight( fixed_kernel[2*k], 2*k + 1 < kernel_size ? fixed_kernel[2*k + 1] : 0 );
+	}
+	const uchar** taps = new const uchar*[2*pairs];
+
+	// In place, each row is read from a copy so the edges can be written before the interior is done
+	uchar* row_copy = source == destination ? new uchar[row_size] : NULL;
+
+	int interior_begin = half;
+	int interior_end = width - half;
+	if( interior_end < interior_begin ) interior_end = interior_begin = width;
+
+	// Gray and ARGB images get edge loops unrolled for their channel count
+	void (*edges)( const uchar*, uchar*, int, int, const short*, int, int, int, int ) = HorizontalEdges<0>;
+	if( channels == 1 ) edges = HorizontalEdges<1>;
+	if( channels == 4 ) edges = HorizontalEdges<4>;
+
+	for( int j = 0; j < height; j++ )
+	{
+		const uchar* source_row = source + j*row_size;
+		uchar* destination_row = destination + j*row_size;
+		if( row_copy )
+		{
+			memcpy( row_copy, source_row, row_size );
+			source_row = row_copy;
+		}
+
+		// Prologue and epilogue, where the kernel hangs over the edge of the image
+		edges( source_row, destination_row, width, channels, fixed_kernel, kernel_size, shift, interior_begin, interior_end );
+
+		// Interior, every tap is a fixed offset into the row
+		if( interior_end > interior_begin )
+		{
+			for( int k = 0; k < 2*pairs; k++ )
+			{
+				taps[k] = source_row + ( k < kernel_size ? k : kernel_size - 1 )*channels;
+			}
+			CpuDispatch::Kernels().ConvolveSpan( taps, pair_weights, pairs, shift, destination_row + interior_begin*channels, ( interior_end - interior_begin )*channels );
+		}
+	}
+
+	delete [] row_copy;
+	delete [] taps;
+	delete [] pair_weights;
+}
+
+void
+Convolution::VerticalPass( const uchar* source, uchar* destination, int width, int height, int channels, const short* fixed_kernel, int kernel_size, int shift, int first_column, int last_column )
+///
+/// Performs a vertical convolution with a quantized 1D kernel. The columns are split into
+/// strips narrow enough for a strip of kernel_size rows to stay in cache. Within a strip,
+/// rows are copied into a ring buffer as they come into the kernel's reach, and the taps
+/// point at those copies. A row can therefore be overwritten as soon as its result is
+/// written, so the pass is safe in place (source == destination) and only needs
+/// kernel_size strip rows of scratch memory.
+///
+/// @param source
+///  The source image data.
+///
+/// @param destination
+///  The image data where the result is to be stored (must be the same dimensions as source,
+///  may be the same as source).
+///
+/// @param width
+///  The width of the image.
+///
+/// @param height
+///  The height of the image.
+///
+/// @param channels
+///  The number of color channels in the image.
+///
+/// @param fixed_kernel
+///  The kernel as returned by QuantizeKernel.
+///
+/// @param kernel_size
+///  The size of the given kernel.
+///
+/// @param shift
+///  The number of fractional bits in the kernel weights.
+///
+/// @param first_column
+///  The first column to convolve. 0 by default.
+///
+/// @param last_column
+///  One past the last column to convolve. -1 (the default) means the width of the image.
+///
+/// @return
+///  Nothing.
+///
+{
+	const int half = kernel_size/2;
+	const int reach = kernel_size - 1 - half;
+	const int pairs = ( kernel_size + 1 )/2;
+	const int row_size = width*channels;
+	if( last_column < 0 ) last_column = width;
+	if( last_column <= first_column || height <= 0 ) return;
+
+	const int range_begin = first_column*channels;
+	const int range_end = last_column*channels;
+	const int strip_size = StripSize( kernel_size, range_end - range_begin );
+
+	int* pair_weights = new int[pairs];
+	for( int k = 0; k < pairs; k++ )
+	{
+		pair_weights[k] = PairWeight( fixed_kernel[2*k], 2*k + 1 < kernel_size ? fixed_kernel[2*k + 1] : 0 );
+	}
+	const uchar** taps = new const uchar*[2*pairs];
+	uchar* ring = new uchar[kernel_size*strip_size];
+
+	for( int strip_begin = range_begin; strip_begin < range_end; strip_begin += strip_size )
+	{
+		int count = range_end - strip_begin < strip_size ? range_end - strip_begin : strip_size;
+
+		// The rows the kernel reaches below the first row are needed before anything is written
+		int loaded = 0;
+		for( ; loaded <= reach && loaded < height; loaded++ )
+		{
+			memcpy( ring + ( loaded%kernel_size )*strip_size, source + loaded*row_size + strip_begin, count );
+		}
+
+		for( int j = 0; j < height; j++ )
+		{
+			if( loaded == j + reach && loaded < height )
+			{
+				memcpy( ring + ( loaded%kernel_size )*strip_size, source + loaded*row_size + strip_begin, count );
+				loaded++;
+			}
+
+			for( int k = 0; k < 2*pairs; k++ )
+			{
+				int y_pos = j + ( k < kernel_size ? k : kernel_size - 1 ) - half;
+				if( y_pos < 0 ) y_pos = 0;
+				if( y_pos >= height ) y_pos = height - 1;
+				taps[k] = ring + ( y_pos%kernel_size )*strip_size;
+			}
+			CpuDispatch::Kernels().ConvolveSpan( taps, pair_weights, pairs, shift, destination + j*row_size + strip_begin, count );
+		}
+	}
+
+	delete [] ring;
+	delete [] taps;
+	delete [] pair_weights;
+}
+
+int
+Convolution::StripSize( int kernel_size, int row_bytes )
+///
+/// Works out how many bytes of each row a vertical pass should handle at a time so
+/// that the rows under the kernel fit in cache together.
+///
+/// @param kernel_size
+///  The size of the kernel.
+///
+/// @param row_bytes
+///  The number of bytes per row that need convolving.
+///
+/// @return
+///  The strip size in bytes.
+///
+{
+	int strip_size = VERTICAL_BLOCK_BYTES/( kernel_size + 1 );
+	strip_size -= strip_size%VERTICAL_STRIP_ALIGNMENT;
+	if( strip_size < VERTICAL_STRIP_ALIGNMENT ) strip_size = VERTICAL_STRIP_ALIGNMENT;
+	return strip_size < row_bytes ? strip_size : row_bytes;
+}
@@ -0,0 +1,30 @@
+#ifndef _CONVOLUTION_H_
+#define _CONVOLUTION_H_
+
+#include <QtWidgets>
+
+///
+/// Fixed-point separable convolution engine used by ImageProcessing::HorizontalConvo
+/// and ImageProcessing::VerticalConvo. Kernels are quantized to 16 bit weights and the
+/// interior of each row is processed by a vector span kernel over the raw interleaved
+/// bytes, so every channel of a pixel is filtered in the same vector. The span kernel is
+/// picked at runtime through CpuDispatch.
+///
+class Convolution
+{
+	public:
+		static bool QuantizeKernel( const double* kernel, int kernel_size, short* fixed_kernel, int& shift );
+
+		static void HorizontalPass( const uchar* source, uchar* destination, int width, int height, int channels, const short* fixed_kernel, int kernel_size, int shift );
+		static void VerticalPass( const uchar* source, uchar* destination, int width, int height, int channels, const short* fixed_kernel, int kernel_size, int shift, int first_column = 0, int last_column = -1 );
+
+		static void ConvolveSpanScalar( const uchar* const* taps, const int* pair_weights, int pairs, int shift, uchar* destination, int count );
+		static void ConvolveSpanSse2( const uchar* const* taps, const int* pair_weights, int pairs, int shift, uchar* destination, int count );
+		static void ConvolveSpanAvx2( const uchar* const* taps, const int* pair_weights, int pairs, int shift, uchar* destination, int count );
+		static void ConvolveSpanAvx512( const uchar* const* taps, const int* pair_weights, int pairs, int shift, uchar* destination, int count );
+
+	private:
+		static int StripSize( int kernel_size, int row_bytes );
+};
+
+#endif
@@ -0,0 +1,212 @@
+///
+/// Detects the vector instruction sets supported by the processor and binds the kernel
+/// table to the best implementation of each kernel.
+///
+
+#include "CpuDispatch.h"
+#include "Convolution.h"
+#include "PixelKernels.h"
+
+#include <string.h>
+
+#if defined(SIMD_X86) && defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(SIMD_X86)
+#include <cpuid.h>
+#endif
+
+///
+/// Set this environment variable to scalar, sse2, sse4.1, avx2 or avx512 to force a level.
+/// Levels above what the processor supports are ignored.
+///
+static const char* SIMD_LEVEL_VARIABLE = "IMAGE_FILTER_SIMD";
+
+#ifdef SIMD_X86
+static void
+Cpuid( int leaf, int subleaf, unsigned int registers[4] )
+///
+/// Runs the cpuid instruction, storing eax, ebx, ecx and edx.
+///
+{
+#ifdef _MSC_VER
+	int values[4];
+	__cpuidex( values, leaf, subleaf );
+	for( int i = 0; i < 4; i++ )
+	{
+		registers[i] = (unsigned int)values[i];
+	}
+#else
+	__cpuid_count( leaf, subleaf, registers[0], registers[1], registers[2], registers[3] );
+#endif
+}
+
+static unsigned long long
+EnabledStateComponents()
+///
+/// Reads which register states the operating system saves on a context switch.
+///
+{
+#ifdef _MSC_VER
+	return _xgetbv( 0 );
+#else
+	unsigned int eax, edx;
+	__asm__ __volatile__( "xgetbv" : "=a"( eax ), "=d"( edx ) : "c"( 0 ) );
+	return ( (unsigned long long)edx << 32 ) | eax;
+#endif
+}
+#endif
+
+CpuDispatch::Level
+CpuDispatch::DetectLevel()
+///
+/// Finds the best instruction set level supported by both the processor and the operating system.
+///
+/// @return
+///  The detected level.
+///
+{
+#ifdef SIMD_X86
+	unsigned int registers[4];
+	Cpuid( 0, 0, registers );
+	unsigned int max_leaf = registers[0];
+
+	Cpuid( 1, 0, registers );
+	if( !( registers[3] & ( 1u << 26 ) ) ) return LEVEL_SCALAR;
+	if( !( registers[2] & ( 1u << 19 ) ) ) return LEVEL_SSE2;
+
+	// AVX state has to be enabled by the operating system as well
+	bool os_avx = ( registers[2] & ( 1u << 27 ) ) && ( registers[2] & ( 1u << 28 ) );
+	if( !os_avx || max_leaf < 7 ) return LEVEL_SSE41;
+	unsigned long long state = EnabledStateComponents();
+	if( ( state & 0x6 ) != 0x6 ) return LEVEL_SSE41;
+
+	Cpuid( 7, 0, registers );
+	if( !( registers[1] & ( 1u << 5 ) ) ) return LEVEL_SSE41;
+
+	// AVX-512 foundation and byte/word instructions, with the opmask and upper registers enabled
+	bool avx512 = ( registers[1] & ( 1u << 16 ) ) && ( registers[1] & ( 1u << 30 ) );
+	if( !avx512 || ( state & 0xe6 ) != 0xe6 ) return LEVEL_AVX2;
+	return LEVEL_AVX512;
+#else
+	return LEVEL_SCALAR;
+#endif
+}
+
+CpuDispatch::Level
+CpuDispatch::ActiveLevel()
+///
+/// The level the kernels are bound to. This is the detected level unless the
+/// IMAGE_FILTER_SIMD environment variable asks for a lower one.
+///
+/// @return
+///  The active level.
+///
+{
+	Level level = DetectLevel();
+
+	QByteArray forced = qgetenv( SIMD_LEVEL_VARIABLE ).toLower();
+	if( !forced.isEmpty() )
+	{
+		for( int i = LEVEL_SCALAR; i <= LEVEL_AVX512; i++ )
+		{
+			if( forced == LevelName( (Level)i ) && i < level )
+			{
+				level = (Level)i;
+			}
+		}
+	}
+	return level;
+}
+
+const char*
+CpuDispatch::LevelName( Level level )
+///
+/// @return
+///  The name of a level, as used by the IMAGE_FILTER_SIMD environment variable.
+///
+{
+	switch( level )
+	{
+		case LEVEL_SSE2: return "sse2";
+		case LEVEL_SSE41: return "sse4.1";
+		case LEVEL_AVX2: return "avx2";
+		case LEVEL_AVX512: return "avx512";
+		default: return "scalar";
+	}
+}
+
+KernelTable
+CpuDispatch::KernelsForLevel( Level level )
+///
+/// Builds the kernel table for a given level. Each kernel uses the best implementation
+/// at or below the level. The scalar implementations are the reference for the others.
+///
+/// @param level
+///  The instruction set level to bind to. Must be supported by the processor.
+///
+/// @return
+///  The kernel table.
+///
+{
+	KernelTable kernels;
+	kernels.ConvolveSpan = Convolution::ConvolveSpanScalar;
+	kernels.ConvertToGray = PixelKernels::ConvertToGrayScalar;
+	kernels.ConvertToLuma = PixelKernels::ConvertToLumaScalar;
+	kernels.ConvertFromGray = PixelKernels::ConvertFromGrayScalar;
+	kernels.ConvertToPlanes = PixelKernels::ConvertToPlanesScalar;
+	kernels.ConvertFromPlanes = PixelKernels::ConvertFromPlanesScalar;
+	kernels.ConvertToHsv = PixelKernels::ConvertToHsvScalar;
+	kernels.QuantizeHue = PixelKernels::QuantizeHueScalar;
+	kernels.DrawSpan = PixelKernels::DrawSpanScalar;
+	kernels.AddSaturate = PixelKernels::AddSaturateScalar;
+	kernels.AddDouble = PixelKernels::AddDoubleScalar;
+	kernels.WarpBilinear = PixelKernels::WarpBilinearScalar;
+	kernels.GaussianNoise = PixelKernels::GaussianNoiseScalar;
+
+#ifdef SIMD_X86
+	if( level >= LEVEL_SSE2 )
+	{
+		kernels.ConvolveSpan = Convolution::ConvolveSpanSse2;
+		kernels.ConvertFromGray = PixelKernels::ConvertFromGraySse2;
+		kernels.ConvertToPlanes = PixelKernels::ConvertToPlanesSse2;
+		kernels.ConvertFromPlanes = PixelKernels::ConvertFromPlanesSse2;
+		kernels.QuantizeHue = PixelKernels::QuantizeHueSse2;
+		kernels.DrawSpan = PixelKernels::DrawSpanSse2;
+		kernels.AddSaturate = PixelKernels::AddSaturateSse2;
+		kernels.AddDouble = PixelKernels::AddDoubleSse2;
+	}
+	if( level >= LEVEL_SSE41 )
+	{
+		kernels.ConvertToGray = PixelKernels::ConvertToGraySse41;
+		kernels.ConvertToLuma = PixelKernels::ConvertToLumaSse41;
+		kernels.ConvertToHsv = PixelKernels::ConvertToHsvSse41;
+		kernels.WarpBilinear = PixelKernels::WarpBilinearSse41;
+		kernels.GaussianNoise = PixelKernels::GaussianNoiseSse41;
+	}
+	if( level >= LEVEL_AVX2 )
+	{
+		kernels.ConvolveSpan = Convolution::ConvolveSpanAvx2;
+		kernels.ConvertToGray = PixelKernels::ConvertToGrayAvx2;
+		kernels.ConvertToPlanes = PixelKernels::ConvertToPlanesAvx2;
+		kernels.AddSaturate = PixelKernels::AddSaturateAvx2;
+		kernels.AddDouble = PixelKernels::AddDoubleAvx2;
+		kernels.GaussianNoise = PixelKernels::GaussianNoiseAvx2;
+	}
+	if( level >= LEVEL_AVX512 )
+	{
+		kernels.ConvolveSpan = Convolution::ConvolveSpanAvx512;
+	}
+#endif
+	return kernels;
+}
+
+const KernelTable&
+CpuDispatch::Kernels()
+///
+/// @return
+///  The kernel table for the active level. It is bound once, the first time it's needed.
+///
+{
+	static const KernelTable kernels = KernelsForLevel( ActiveLevel() );
+	return kernels;
+}
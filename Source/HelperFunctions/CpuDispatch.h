@@ -0,0 +1,51 @@
+#ifndef _CPU_DISPATCH_H_
+#define _CPU_DISPATCH_H_
+
+#include <QtWidgets>
+
+///
+/// Vector kernels are compiled for their instruction set with a target attribute rather
+/// than with build flags, so one binary carries every variant and picks one at runtime.
+///
+#if ( defined(__GNUC__) || defined(__clang__) ) && ( defined(__x86_64__) || defined(__i386__) )
+#define SIMD_X86
+#define SIMD_TARGET( isa ) __attribute__(( target( isa ) ))
+#elif defined(_MSC_VER) && ( defined(_M_X64) || defined(_M_IX86) )
+#define SIMD_X86
+#define SIMD_TARGET( isa )
+#endif
+
+///
+/// The kernels that have a separate implementation per instruction set.
+///
+struct KernelTable
+{
+	void (*ConvolveSpan)( const uchar* const* taps, const int* pair_weights, int pairs, int shift, uchar* destination, int count );
+	void (*ConvertToGray)( const uchar* source, uchar* destination, int count, int channels, int alpha_channel );
+	void (*ConvertToLuma)( const uchar* source, uchar* destination, int count );
+	void (*ConvertFromGray)( const uchar* source, uchar* destination, int count, int channels, int alpha_channel );
+	void (*ConvertToPlanes)( const uchar* source, float* red, float* green, float* blue, int count, float scale );
+	void (*ConvertFromPlanes)( const float* red, const float* green, const float* blue, uchar* destination, int count, float scale );
+	void (*ConvertToHsv)( const uchar* source, short* hue, uchar* saturation, uchar* value, int count );
+	void (*QuantizeHue)( const short* hue, const short* thresholds, int levels, uchar* destination, int count );
+	void (*DrawSpan)( QRgb* pixels, uchar* depth, int count, QRgb color, int z_depth );
+	void (*AddSaturate)( const uchar* first, const uchar* second, uchar* result, int count );
+	void (*AddDouble)( const double* first, const double* second, double* result, int count );
+	void (*WarpBilinear)( const uchar* image, uchar* canvas, const double* v_x, const double* v_y, int y, int width, int height, int channels, double step_size );
+	void (*GaussianNoise)( quint64 key, quint32 first, float* destination, int count );
+};
+
+class CpuDispatch
+{
+	public:
+		enum Level { LEVEL_SCALAR = 0, LEVEL_SSE2, LEVEL_SSE41, LEVEL_AVX2, LEVEL_AVX512 };
+
+		static Level DetectLevel();
+		static Level ActiveLevel();
+		static const char* LevelName( Level level );
+
+		static const KernelTable& Kernels();
+		static KernelTable KernelsForLevel( Level level );
+};
+
+#endif
@@ -0,0 +1,151 @@
+#include "DeferredCanvas.h"
+#include "Drawing.h"
+#include "Parallel.h"
+
+#include <stdlib.h>
+
+///
+/// The width and height of the tiles, in pixels. Small enough that there are plenty of
+/// tiles to share between threads, and that a tile of the canvas and depth buffer stays in
+/// the cache while its circles are drawn, without too many circles crossing tile edges.
+///
+static const int TILE_SIZE = 64;
+
+DeferredCanvas::DeferredCanvas( const ImageView<QRgb, 1>& canvas, const ImageView<uchar, 1>& depth_buffer )
+///
+/// Constructor.
+///
+/// @param canvas
+///  The canvas the circles are drawn on to when flushed.
+///
+/// @param depth_buffer
+///  The depth buffer of the canvas. The same size as the canvas.
+///
+: mCanvas( canvas ),
+  mDepthBuffer( depth_buffer ),
+  mColumns( ( canvas.Width() + TILE_SIZE - 1 )/TILE_SIZE ),
+  mRows( ( canvas.Height() + TILE_SIZE - 1 )/TILE_SIZE )
+{
+}
+
+void
+DeferredCanvas::DrawCircle( QPoint position, QRgb color, int radius, int z_depth )
+///
+/// Records a circle to be drawn at the next flush, with the same arguments as
+/// Drawing::DrawCircle.
+///
+/// @param position
+///  The center point of the circle to be drawn.
+///
+/// @param color
+///  The color of the circle to be drawn.
+///
+/// @param radius
+///  The radius of the circle to be drawn.
+///
+/// @param z_depth
+///  The depth of the circle being drawn within the depth buffer, from 0 to 255.
+///
+/// @return
+///  Nothing.
+///
+{
+	Circle circle = { position.x(), position.y(), radius, z_depth, color };
+	mCircles.push_back( circle );
+}
+
+bool
+DeferredCanvas::TileRange( const Circle& circle, int& first_column, int& last_column, int& first_row, int& last_row ) const
+///
+/// Finds the tiles a circle could touch. The midpoint circle algorithm can reach one pixel
+/// past the radius, so the box is one pixel wider on each side.
+///
+/// @return
+///  False if the circle is empty or entirely off the canvas.
+///
+{
+	if( circle.radius < 0 ) return false;
+
+	const int reach = circle.radius + 1;
+	const int left = qMax( circle.x - reach, 0 );
+	const int right = qMin( circle.x + reach, mCanvas.Width() - 1 );
+	const int top = qMax( circle.y - reach, 0 );
+	const int bottom = qMin( circle.y + reach, mCanvas.Height() - 1 );
+	if( left > right || top > bottom ) return false;
+
+	first_column = left/TILE_SIZE;
+	last_column = right/TILE_SIZE;
+	first_row = top/TILE_SIZE;
+	last_row = bottom/TILE_SIZE;
+	return true;
+}
+
+void
+DeferredCanvas::Flush()
+///
+/// Draws every recorded circle, then forgets them.
+///
+/// @return
+///  Nothing.
+///
+{
+	const int tiles = mColumns*mRows;
+	if( mCircles.empty() || tiles == 0 )
+	{
+		mCircles.clear();
+		return;
+	}
+
+	// Count the circles of each tile, then list them tile by tile in the order they were recorded
+	mTileStarts.assign( tiles + 1, 0 );
+	for( size_t i = 0; i < mCircles.size(); i++ )
+	{
+		int first_column, last_column, first_row, last_row;
+		if( !TileRange( mCircles[i], first_column, last_column, first_row, last_row ) ) continue;
+		for( int row = first_row; row <= last_row; row++ )
+		{
+			for( int column = first_column; column <= last_column; column++ )
+			{
+				mTileStarts[row*mColumns + column + 1]++;
+			}
+		}
+	}
+	for( int tile = 0; tile < tiles; tile++ )
+	{
+		mTileStarts[tile + 1] += mTileStarts[tile];
+	}
+
+	mTileCircles.resize( mTileStarts[tiles] );
+	std::vector<int> next( mTileStarts.begin(), mTileStarts.end() - 1 );
+	for( size_t i = 0; i < mCircles.size(); i++ )
+	{
+		int first_column, last_column, first_row, last_row;
+		if( !TileRange( mCircles[i], first_column, last_column, first_row, last_row ) ) continue;
+		for( int row = first_row; row <= last_row; row++ )
+		{
+			for( int column = first_column; column <= last_column; column++ )
+			{
+				mTileCircles[next[row*mColumns + column]++] = (int)i;
+			}
+		}
+	}
+
+	// Draw each tile through views of just that tile, so no circle spills into its neighbours.
+	// Tiles with more circles take longer, so they are handed out one at a time
+	Parallel::ForEach( tiles, [&]( int tile )
+	{
+		const int left = ( tile%mColumns )*TILE_SIZE;
+		const int top = ( tile/mColumns )*TILE_SIZE;
+		const int width = qMin( TILE_SIZE, mCanvas.Width() - left );
+		const int height = qMin( TILE_SIZE, mCanvas.Height() - top );
+		ImageView<QRgb, 1> canvas( mCanvas.Pixel( left, top ), width, height, mCanvas.Stride() );
+		ImageView<uchar, 1> depth_buffer( mDepthBuffer.Pixel( left, top ), width, height, mDepthBuffer.Stride() );
+		for( int i = mTileStarts[tile]; i < mTileStarts[tile + 1]; i++ )
+		{
+			const Circle& circle = mCircles[mTileCircles[i]];
+			Drawing::DrawCircle( canvas, QPoint( circle.x - left, circle.y - top ), circle.color, circle.radius, circle.z_depth, depth_buffer );
+		}
+	} );
+
+	mCircles.clear();
+}
@@ -0,0 +1,53 @@
+#ifndef _DEFERRED_CANVAS_H_
+#define _DEFERRED_CANVAS_H_
+
+#include <QtWidgets>
+#include <vector>
+
+#include "ImageView.h"
+
+///
+/// Records circles instead of drawing them, and draws them all at once in parallel when
+/// flushed. The canvas is split into square tiles, each circle is added to the list of
+/// every tile it touches, and the tiles are drawn on separate threads, each only drawing
+/// inside its own tile of the canvas and depth buffer.
+///
+/// The depth buffer decides which circle ends up on top, so circles don't have to be drawn
+/// in the order they were recorded; each tile still draws its circles in that order so that
+/// circles of the same depth overlap exactly as they would have. The result is the same as
+/// drawing each circle with Drawing::DrawCircle when it is recorded, as long as nothing
+/// reads the canvas or depth buffer before the circles are flushed.
+///
+class DeferredCanvas
+{
+	public:
+		DeferredCanvas( const ImageView<QRgb, 1>& canvas, const ImageView<uchar, 1>& depth_buffer );
+
+		void DrawCircle( QPoint position, QRgb color, int radius, int z_depth );
+		void Flush();
+
+	private:
+		///
+		/// A circle waiting to be drawn.
+		///
+		struct Circle
+		{
+			int x;
+			int y;
+			int radius;
+			int z_depth;
+			QRgb color;
+		};
+
+		bool TileRange( const Circle& circle, int& first_column, int& last_column, int& first_row, int& last_row ) const;
+
+		ImageView<QRgb, 1> mCanvas;
+		ImageView<uchar, 1> mDepthBuffer;
+		int mColumns;
+		int mRows;
+		std::vector<Circle> mCircles;
+		std::vector<int> mTileStarts;
+		std::vector<int> mTileCircles;
+};
+
+#endif
@@ -1,67 +1,129 @@
 #include "Drawing.h"
+#include "CpuDispatch.h"
+#include "PixelKernels.h"
+
+#include <stdlib.h>
+#include <vector>
 
-void 
-Drawing::DrawHorizontalLine(QImage* canvas, int x_left, int x_right, int y, QColor color, int z_depth, uchar* depth_buffer) 
 ///
-/// Draws a horizontal line on the canvas. Also stores the points on the line in the given depth buffer.
+/// Circles up to this radius have their spans worked out once, when the program starts.
+/// Larger circles work theirs out each time they are drawn.
 ///
-/// @param canvas
-///  The image to paint the horizontal line onto.
+static const int MAX_TABLE_RADIUS = 128;
+
 ///
-/// @param x_left
-///  The left most x point of the line.
+/// Runs of fewer pixels than this are drawn by the scalar DrawSpan kernel, called directly
+/// rather than through the dispatch table.
 ///
-/// @param x_right
-///  The right most x point of the line.
+static const int SHORT_SPAN = 16;
+
+static void FindCircleSpans( int radius, std::vector<int>& half_widths );
+
 ///
-/// @param y
-///  The vertical position of the line.
+/// The half width of each row of the circles of every radius up to MAX_TABLE_RADIUS.
 ///
-/// @param color
-///  The color of the line.
+struct CircleSpanTables
+{
+	CircleSpanTables();
+
+	std::vector<int> half_widths[MAX_TABLE_RADIUS + 1];
+};
+
+static const CircleSpanTables circle_span_tables;
+
+CircleSpanTables::CircleSpanTables()
 ///
-/// @param z_depth
-///  The depth of the line in relation to any other lines that are drawn.
+/// Constructor. Works out the spans of every circle in the table.
 ///
-/// @param depth_buffer
-///  The depth buffer to determine which point on the line should be drawn.
+{
+	for( int radius = 0; radius <= MAX_TABLE_RADIUS; radius++ ) 
+	{
+		FindCircleSpans( radius, half_widths[radius] );
+	}
+}
+
+static void
+FindCircleSpans( int radius, std::vector<int>& half_widths )
+///
+/// Works out which pixels of each row a circle covers, using the midpoint circle algorithm.
+/// The algorithm steps round one eighth of the circle and mirrors each step into four
+/// horizontal lines, so it reaches most rows several times; each row keeps the widest line.
+///
+/// @param radius
+///  The radius of the circle.
+///
+/// @param half_widths
+///  Stores the half width of the line on each row, for the rows from radius + 1 above the
+///  center to radius + 1 below it. Rows the circle doesn't reach are -1.
 ///
 /// @return
-///  Nothing
+///  Nothing.
 ///
 {
-	
-	if(y >= 0 && y < canvas->height()) 
+	const int reach = abs( radius ) + 1;
+	half_widths.assign( 2*reach + 1, -1 );
+
+	int x = -1;
+	int y = radius;
+	int d = 1 - radius;
+	int delta_e = -1;
+	int delta_se = (-radius << 1) + 3;
+
+	while (y > x) 
 	{
-		if(x_left > x_right) 
+		delta_e += 2;
+		x++;
+
+		if (d < 0) 
 		{
-			int temp = x_left;
-			x_left = x_right;
-			x_right = temp;
-		}
-		
-		while(x_left <= x_right) 
+			d += delta_e;
+			delta_se += 2;
+		} 
+		else 
 		{
-			if(x_left >= canvas->width())
-			{
-				break;
-			}
-			
-			if(x_left >= 0 && z_depth > depth_buffer[y*canvas->width() + x_left]) 
-			{
-				canvas->setPixel(QPoint(x_left, y), qRgb(color.red(), color.green(), color.blue()));
-				depth_buffer[y*canvas->width() + x_left] = z_depth;
-			}
-			
-			++x_left;
+			d += delta_se;
+			delta_se += 4;
+			y--;
 		}
+
+		int* row = &half_widths[reach];
+		row[y] = qMax( row[y], abs( x ) );
+		row[x] = qMax( row[x], abs( y ) );
+		row[-x] = qMax( row[-x], abs( y ) );
+		row[-y] = qMax( row[-y], abs( x ) );
 	}
 }
 
+const std::vector<int>&
+Drawing::CircleSpans( int radius, std::vector<int>& found_half_widths )
+///
+/// Gets the half width of each row of a circle drawn by DrawCircle.
+///
+/// @param radius
+///  The radius of the circle. Must not be negative.
+///
+/// @param found_half_widths
+///  Stores the half widths of circles too big for the tables.
+///
+/// @return
+///  The half width of the line on each row, for the rows from radius + 1 above the center
+///  to radius + 1 below it, or -1 for rows the circle doesn't reach. Either a table that
+///  lasts as long as the program, or found_half_widths.
+///
+{
+	if( radius <= MAX_TABLE_RADIUS ) 
+	{
+		return circle_span_tables.half_widths[radius];
+	}
+	FindCircleSpans( radius, found_half_widths );
+	return found_half_widths;
+}
+
 void 
-Drawing::DrawCircle(QImage* canvas, QPoint position, QColor color, int radius, int z_depth, uchar* depth_buffer) 
+Drawing::DrawCircle(const ImageView<QRgb, 1>& canvas, QPoint position, QRgb color, int radius, int z_depth, const ImageView<uchar, 1>& depth_buffer) 
 ///
-/// Draw a circle of a given color and radius on the given canvas.
+/// Draw a circle of a given color and radius on the given canvas. Each row of the circle
+/// is drawn once, as one run, from the spans of the midpoint circle algorithm.
 ///
 /// @param canvas
 ///  The canvas to draw the circle on to.
@@ -70,13 +132,13 @@ Drawing::DrawCircle(QImage* canvas, QPoint position, QColor color, int radius, i
 ///  The center point of the circle to be drawn.
 ///
 /// @param color
-///  The color of the circle to be drawn.
+///  The color of the circle to be drawn. Its alpha is ignored, circles are always opaque.
 ///
 /// @param radius
-///  The radius of the circle to be drawn.
+///  The radius of the circle to be drawn. Nothing is drawn if it is negative.
 ///
 /// @param z_depth
-///  The depth of the circle being drawn within the depth buffer.
+///  The depth of the circle being drawn within the depth buffer, from 0 to 255.
 ///
 /// @param depth_buffer
 ///  The depth buffer to determine which pixels should be drawn.
@@ -85,32 +147,40 @@ Drawing::DrawCircle(QImage* canvas, QPoint position, QColor color, int radius, i
 ///  Nothing
 ///
 {
-	int x = -1;
-	int y = radius;
-	int d = 1 - radius;
-	int delta_e = -1;
-	int delta_se = (-radius << 1) + 3;
+	if( radius < 0 ) 
+	{
+		return;
+	}
 
-	while (y > x) 
+	std::vector<int> found_half_widths;
+	const std::vector<int>* half_widths = &CircleSpans( radius, found_half_widths );
+
+	const QRgb rgb = color | 0xff000000;
+	const int reach = ( (int)half_widths->size() - 1 )/2;
+	const int first_row = qMax( position.y() - reach, 0 );
+	const int last_row = qMin( position.y() + reach, canvas.Height() - 1 );
+	const KernelTable& kernels = CpuDispatch::Kernels();
+	for( int y = first_row; y <= last_row; y++ ) 
 	{
-		delta_e += 2;
-		x++;
+		const int half_width = (*half_widths)[y - position.y() + reach];
+		const int x_left = qMax( position.x() - half_width, 0 );
+		const int x_right = qMin( position.x() + half_width, canvas.Width() - 1 );
+		const int count = x_right - x_left + 1;
+		if( half_width < 0 || count <= 0 ) 
+		{
+			continue;
+		}
 
-		if (d < 0) 
+		// Runs shorter than a vector gain nothing from it, so they skip the dispatch
+		QRgb* canvas_row = canvas.Row(y) + x_left;
+		uchar* depth_row = depth_buffer.Row(y) + x_left;
+		if( count < SHORT_SPAN ) 
 		{
-			d += delta_e;
-			delta_se += 2;
+			PixelKernels::DrawSpanScalar( canvas_row, depth_row, count, rgb, z_depth );
 		} 
 		else 
 		{
-			d += delta_se;
-			delta_se += 4;
-			y--;
+			kernels.DrawSpan( canvas_row, depth_row, count, rgb, z_depth );
 		}
-
-		DrawHorizontalLine(canvas, position.x() + x, position.x() - x, position.y() + y, color, z_depth, depth_buffer);
-		DrawHorizontalLine(canvas, position.x() + y, position.x() - y, position.y() + x, color, z_depth, depth_buffer);
-		DrawHorizontalLine(canvas, position.x() + y, position.x() - y, position.y() - x, color, z_depth, depth_buffer);
-		DrawHorizontalLine(canvas, position.x() + x, position.x() - x, position.y() - y, color, z_depth, depth_buffer);
 	}
-}
\ No newline at end of file
+}
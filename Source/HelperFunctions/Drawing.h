@@ -2,12 +2,15 @@
 #define _DRAWING_H_
 
 #include <QtWidgets>
+#include <vector>
+
+#include "ImageView.h"
 
 class Drawing
 {
 	public:
-		static void DrawHorizontalLine(QImage* canvas, int x_left, int x_right, int y, QColor color, int z_depth, uchar* depth_buffer);
-		static void DrawCircle(QImage* canvas, QPoint position, QColor color, int radius, int z_depth, uchar* depth_buffer);
+		static void DrawCircle(const ImageView<QRgb, 1>& canvas, QPoint position, QRgb color, int radius, int z_depth, const ImageView<uchar, 1>& depth_buffer);
+		static const std::vector<int>& CircleSpans(int radius, std::vector<int>& found_half_widths);
 };
 
 #endif
\ No newline at end of file
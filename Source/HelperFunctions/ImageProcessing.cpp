@@ -1,8 +1,23 @@
 #include "ImageProcessing.h"
+#include "Convolution.h"
+#include "CpuDispatch.h"
+#include "Parallel.h"
+#include "Random.h"
 #include <float.h>
+#include <string.h>
 
 #define PI 3.14159265
 
+// Images smaller than this trace their edges on one thread, see CannyEdgeDetection
+static const int PARALLEL_HYSTERESIS_MIN_PIXELS = 1000000;
+
+// Poisson disk sampling, see GetToroidalPoissonDisks
+static const int POISSON_CANDIDATES = 30;
+static const int POISSON_ANGLES = 360;
+static const int POISSON_TILE_SIZE = 128;
+static const int POISSON_TILE_SEEDS = 30;
+static const quint64 POISSON_RANDOM_STREAM = 1;
+
 double 
 ImageProcessing::ColorDistance( QColor color1, QColor color2)
 ///
@@ -26,139 +41,322 @@ ImageProcessing::ColorDistance( QColor color1, QColor color2)
 						(color1.blue() - color2.blue())*(color1.blue() - color2.blue())	);
 }
 
-std::vector<QPoint> 
-ImageProcessing::GetPoissonDisks(int width, int height, int min_dist) 
+int
+ImageProcessing::ColorDistance( QRgb color1, QRgb color2 )
 ///
-/// Takes a poisson sampling (a set of randomized points over an area that
-/// are a given minimum distance appart) of a given width and height.
+/// Same as above, for packed colors, without going through QColor.
 ///
-/// @param width
-///  The width of the poisson sampling area.
+{
+	int red = qRed( color1 ) - qRed( color2 );
+	int green = qGreen( color1 ) - qGreen( color2 );
+	int blue = qBlue( color1 ) - qBlue( color2 );
+	return red*red + green*green + blue*blue;
+}
+
 ///
-/// @param height
-///  The height of the poisson sampling area.
+/// The acceleration grid shared by the Poisson disk samplers. The area wraps around at the
+/// edges, like a torus.
 ///
-/// @param min_dist
-///  The minimum distance between sampled points.
+struct PoissonGrid
+{
+	int width;
+	int height;
+	int min_dist;
+	int cell_size;
+	int grid_width;
+	int grid_height;
+	int reach;
+
+	// Each cell stores its point, or (-1, -1) if it is empty
+	std::vector<QPoint> cells;
+
+	// Offsets covering the annulus between min_dist and 2*min_dist
+	std::vector<QPoint> annulus;
+};
+
+static void
+InitPoissonGrid( PoissonGrid& grid, int width, int height, int min_dist )
 ///
-/// @return
-///  A vector of points where each point is part of the sample.
+/// Sets up an empty grid and the table of candidate offsets for a sampling. The grid only
+/// wraps around correctly if its width and height are multiples of the cell size.
 ///
 {
+	grid.width = width;
+	grid.height = height;
+	grid.min_dist = min_dist;
 
-	const double root2 = 1.414214;
-	const int k = 30;
+	// Cells are small enough that each one can hold at most one point
+	grid.cell_size = (int)( min_dist/sqrt( 2.0 ) );
+	if( grid.cell_size < 1 ) grid.cell_size = 1;
+	grid.grid_width = ( width + grid.cell_size - 1 )/grid.cell_size;
+	grid.grid_height = ( height + grid.cell_size - 1 )/grid.cell_size;
 
-	// Initialize data structures
-	int cell_size = (int)(min_dist/root2);
-	if(cell_size < 1) cell_size = 1;
+	// Points closer than min_dist can be this many cells away
+	grid.reach = ( min_dist + grid.cell_size - 1 )/grid.cell_size;
 
-	int grid_width = (int)width/cell_size;
-	int grid_height = (int)height/cell_size;
+	grid.cells.assign( grid.grid_width*grid.grid_height, QPoint( -1, -1 ) );
 
-	if( width%grid_width != 0 ) grid_width++;
-	if( height%grid_height != 0 ) grid_height++;
+	// Candidates are picked from a table of offsets at every whole number radius and angle
+	grid.annulus.clear();
+	grid.annulus.reserve( min_dist*POISSON_ANGLES );
+	for( int radius = min_dist; radius < 2*min_dist; radius++ )
+	{
+		for( int a = 0; a < POISSON_ANGLES; a++ )
+		{
+			double angle = a*2.0*PI/POISSON_ANGLES;
+			grid.annulus.push_back( QPoint( (int)floor( radius*cos( angle ) ), (int)floor( radius*sin( angle ) ) ) );
+		}
+	}
+}
 
-	std::vector<QPoint> grid;
-	grid.resize(grid_width*grid_height);
-	for( size_t i = 0; i < grid.size(); i++)
+static bool
+IsPoissonPointFree( const PoissonGrid& grid, int x, int y )
+///
+/// Neighbouring cells and distances are taken across the edges of the grid.
+///
+/// @return
+///  True if there is no point in the grid closer than min_dist to (x, y).
+///
+{
+	int grid_x = x/grid.cell_size;
+	int grid_y = y/grid.cell_size;
+	for( int j = grid_y - grid.reach; j <= grid_y + grid.reach; j++ ) 
 	{
-		grid[i] = QPoint(-1, -1);
-	} 
+		int cell_y = ( j + grid.grid_height )%grid.grid_height;
+		for( int i = grid_x - grid.reach; i <= grid_x + grid.reach; i++ ) 
+		{
+			int cell_x = ( i + grid.grid_width )%grid.grid_width;
+			const QPoint& point = grid.cells[cell_y*grid.grid_width + cell_x];
+			if( point.x() < 0 ) continue;
+
+			int d_x = abs( x - point.x() );
+			int d_y = abs( y - point.y() );
+			if( d_x > grid.width/2 ) d_x = grid.width - d_x;
+			if( d_y > grid.height/2 ) d_y = grid.height - d_y;
+			if( d_x*d_x + d_y*d_y < grid.min_dist*grid.min_dist ) return false;
+		}
+	}
+	return true;
+}
 
+static void
+SamplePoissonRegion( PoissonGrid& grid, int left, int top, int right, int bottom, int seeds, Random& random, std::vector<QPoint>& output )
+///
+/// Runs Bridson's algorithm inside a rectangle of the grid. Each of a number of random
+/// seed points that isn't too close to an existing point starts a new round of growth.
+/// Only cells inside the rectangle are written, and only cells within min_dist of it are read.
+///
+/// @param grid
+///  The grid to sample into.
+///
+/// @param left, top, right, bottom
+///  The rectangle, from left and top up to but not including right and bottom.
+///
+/// @param seeds
+///  The number of random seed points to try.
+///
+/// @param random
+///  The random number generator for this rectangle.
+///
+/// @param output
+///  Where the new points are added.
+///
+/// @return
+///  Nothing.
+///
+{
 	std::vector<QPoint> processing;
-	std::vector<QPoint> output;
-	processing.reserve(grid_width*grid_height);
-	output.reserve(grid_width*grid_height);
-	
-	// Find random start point
-	// Add to the output list, processing list, and grid
-	QPoint start = QPoint(rand()%width, rand()%height);
-	grid[start.y()/cell_size*grid_width + start.x()/cell_size] = start;
-	processing.push_back(start);
-	output.push_back(start);
-
-	// Poisson sampling loop
-	while( !processing.empty() ) 
-	{
-		// Choose a random point from the processing list
-		int get_at = rand()%processing.size();
-		QPoint next_point = processing[get_at];
-		for( size_t i = get_at; i < processing.size() - 1; i++ )
-		{
-			processing[i] = processing[i + 1];
-		} 
-		processing.pop_back();
-
-		// For this point, generate k points around this point
-		for( int i = 0; i < k; i++ ) 
-		{
-			// Generate a new point randomly chosen
-			// with a random angle between 0 and 2*PI
-			// and a random radius between minDist and 2*minDist
-			int radius = rand()%min_dist + min_dist;
-			int temp = rand()%360;
-			double angle = temp/360.0*2*PI;
-		
-			int new_x = (int)(next_point.x() + radius * cos(angle));
-			int new_y = (int)(next_point.y() + radius * sin(angle));
-
-			// Check that point is not too close to an existing point
-			// and that the point is within the image boundaries
-			bool valid = true;
-			if( new_x < 0 || new_y < 0 || new_x >= width || new_y >= height ) 
-			{
-				valid = false;
-			} 
-			else 
+	for( int seed = 0; seed < seeds; seed++ )
+	{
+		QPoint start = QPoint( left + random.Below( right - left ), top + random.Below( bottom - top ) );
+		if( !IsPoissonPointFree( grid, start.x(), start.y() ) ) continue;
+
+		grid.cells[start.y()/grid.cell_size*grid.grid_width + start.x()/grid.cell_size] = start;
+		processing.push_back( start );
+		output.push_back( start );
+
+		while( !processing.empty() ) 
+		{
+			// Take a random point from the processing list, moving the last one into its place
+			int get_at = random.Below( processing.size() );
+			QPoint next_point = processing[get_at];
+			processing[get_at] = processing.back();
+			processing.pop_back();
+
+			// For this point, generate candidates in the annulus between min_dist and 2*min_dist
+			for( int i = 0; i < POISSON_CANDIDATES; i++ ) 
 			{
-				int grid_x = new_x/cell_size;
-				int grid_y = new_y/cell_size;
+				const QPoint& offset = grid.annulus[random.Below( grid.annulus.size() )];
+				int new_x = ( next_point.x() + offset.x() + grid.width )%grid.width;
+				int new_y = ( next_point.y() + offset.y() + grid.height )%grid.height;
+				if( new_x < left || new_y < top || new_x >= right || new_y >= bottom ) continue;
 
-				// Get surrounding cells
-				for( int y = -2; y < 3; y++ ) 
+				if( IsPoissonPointFree( grid, new_x, new_y ) ) 
 				{
-					for( int x = -2; x < 3; x++ ) 
-					{
-						// Check valid grid point
-						if( x >= 0 && x < grid_width && y >= 0 && y < grid_height ) 
-						{ 
-							// Calculate point
-							QPoint temp = grid[grid_y*grid_width + grid_x];
-							int temp_x = temp.x() + x;
-							int temp_y = temp.y() + y;
-							if(!(temp_x == new_x && temp_y == new_y) ) {
-								// Get the distance between this point and the point in the cell
-								int dist_sqrd = (new_x - temp_x)*(new_x - temp_x) + (new_y - temp_y)*(new_y - temp_y);
-								if( dist_sqrd < min_dist*min_dist )
-								{
-									valid = false;
-								} 
-							}
-						}
-					}
+					grid.cells[new_y/grid.cell_size*grid.grid_width + new_x/grid.cell_size] = QPoint( new_x, new_y );
+					processing.push_back( QPoint( new_x, new_y ) );
+					output.push_back( QPoint( new_x, new_y ) );
 				}
 			}
+		}
+	}
+}
+
+static void
+SamplePoissonTiles( PoissonGrid& grid, int tiles_x, int tiles_y, quint64 seed, std::vector<QPoint>& output )
+///
+/// Runs Bridson's algorithm on several threads. The grid is split along cell boundaries
+/// into tiles that are coloured in a 2x2 pattern. Tiles of one colour are a whole tile
+/// apart, so they are sampled at the same time, and the four colours are sampled one
+/// after the other. Each tile checks its candidates against the points of the tiles
+/// sampled before it, so the minimum distance holds across the seams.
+///
+/// @param grid
+///  The grid to sample into. Its tiles must be at least 2*min_dist wide, and there must
+///  be an even number of them across and down, so that tiles of one colour are also apart
+///  across the edges.
+///
+/// @param tiles_x, tiles_y
+///  The number of tiles across and down.
+///
+/// @param seed
+///  The seed of the random numbers. Each tile has its own generator keyed by its index,
+///  so the same seed gives the same sampling whatever the number of threads.
+///
+/// @param output
+///  Where the new points are added.
+///
+/// @return
+///  Nothing.
+///
+{
+	std::vector< std::vector<QPoint> > tile_points( tiles_x*tiles_y );
 
-			// If point is valid, add it as a new point
-			if( valid ) 
+	for( int phase = 0; phase < 4; phase++ )
+	{
+		std::vector<int> tiles;
+		for( int ty = phase/2; ty < tiles_y; ty += 2 )
+		{
+			for( int tx = phase%2; tx < tiles_x; tx += 2 )
 			{
-				grid[new_y/cell_size*grid_width + new_x/cell_size] = QPoint( new_x, new_y );
-				output.push_back( QPoint( new_x, new_y ) );
-				processing.push_back( QPoint(new_x, new_y) );
+				tiles.push_back( ty*tiles_x + tx );
 			}
 		}
+
+		Parallel::ForEach( tiles.size(), [&]( int task )
+		{
+			int tile = tiles[task];
+			int tx = tile%tiles_x;
+			int ty = tile/tiles_x;
+			int left = tx*grid.grid_width/tiles_x*grid.cell_size;
+			int top = ty*grid.grid_height/tiles_y*grid.cell_size;
+			int right = qMin( ( tx + 1 )*grid.grid_width/tiles_x*grid.cell_size, grid.width );
+			int bottom = qMin( ( ty + 1 )*grid.grid_height/tiles_y*grid.cell_size, grid.height );
+			Random random( seed, POISSON_RANDOM_STREAM, tile );
+			SamplePoissonRegion( grid, left, top, right, bottom, POISSON_TILE_SEEDS, random, tile_points[tile] );
+		} );
+	}
+
+	for( size_t t = 0; t < tile_points.size(); t++ )
+	{
+		output.insert( output.end(), tile_points[t].begin(), tile_points[t].end() );
 	}
+}
+
+static void
+InitToroidalPoissonGrid( PoissonGrid& grid, int& size, int min_dist )
+///
+/// Sets up a wrapping grid for a square, rounding the size up to a whole number of grid
+/// cells, and at least 4*min_dist.
+///
+{
+	if( size < 4*min_dist ) size = 4*min_dist;
+	InitPoissonGrid( grid, size, size, min_dist );
+	size = grid.grid_width*grid.cell_size;
+	InitPoissonGrid( grid, size, size, min_dist );
+}
+
+std::vector<QPoint> 
+ImageProcessing::GetToroidalPoissonDisks(int& size, int min_dist, quint64 seed) 
+///
+/// Takes a poisson sampling of a square that wraps around at the edges, so copies of
+/// it can be laid side by side and the minimum distance still holds across the seams.
+///
+/// @param size
+///  The requested width and height of the square. It is rounded up to a whole number
+///  of grid cells, and at least 4*min_dist, and the size used is stored back.
+///
+/// @param min_dist
+///  The minimum distance between sampled points.
+///
+/// @param seed
+///  The seed of the random numbers. The same seed gives the same sampling.
+///
+/// @return
+///  A vector of points where each point is part of the sample.
+///
+{
+	if( min_dist < 1 ) min_dist = 1;
+
+	PoissonGrid grid;
+	InitToroidalPoissonGrid( grid, size, min_dist );
+
+	std::vector<QPoint> output;
+	output.reserve( grid.grid_width*grid.grid_height );
+	Random random( seed, POISSON_RANDOM_STREAM, 0 );
+	SamplePoissonRegion( grid, 0, 0, size, size, POISSON_TILE_SEEDS, random, output );
+	return output;
+}
+
+std::vector<QPoint> 
+ImageProcessing::GetToroidalPoissonDisksTiled(int& size, int min_dist, quint64 seed) 
+///
+/// Takes a poisson sampling like GetToroidalPoissonDisks, but on several threads. The
+/// square is split into an even number of tiles across and down, each at least 2*min_dist
+/// wide, which are sampled in four phases (see SamplePoissonTiles). Squares too small to
+/// split that way are sampled on one thread.
+///
+/// @param size
+///  The requested width and height of the square. It is rounded up to a whole number
+///  of grid cells, and at least 4*min_dist, and the size used is stored back.
+///
+/// @param min_dist
+///  The minimum distance between sampled points.
+///
+/// @param seed
+///  The seed of the random numbers. The same seed gives the same sampling whatever the
+///  number of threads, but not the same sampling as GetToroidalPoissonDisks.
+///
+/// @return
+///  A vector of points where each point is part of the sample.
+///
+{
+	if( min_dist < 1 ) min_dist = 1;
+
+	PoissonGrid grid;
+	InitToroidalPoissonGrid( grid, size, min_dist );
 
-	processing.clear();
-	grid.clear();
-	std::vector<QPoint>().swap( processing );
-	std::vector<QPoint>().swap( grid );
+	int tile_size = 2*min_dist > POISSON_TILE_SIZE ? 2*min_dist : POISSON_TILE_SIZE;
+	int tile_cells = ( tile_size + grid.cell_size - 1 )/grid.cell_size;
+	int tiles = grid.grid_width/tile_cells;
+	tiles -= tiles%2;
+
+	std::vector<QPoint> output;
+	output.reserve( grid.grid_width*grid.grid_height );
+	if( tiles < 2 )
+	{
+		Random random( seed, POISSON_RANDOM_STREAM, 0 );
+		SamplePoissonRegion( grid, 0, 0, size, size, POISSON_TILE_SEEDS, random, output );
+	}
+	else
+	{
+		SamplePoissonTiles( grid, tiles, tiles, seed, output );
+	}
 	return output;
 }
 
 void
-ImageProcessing::HorizontalConvo( uchar* source, uchar* destination, int width, int height, int channels, double* kernel, int kernel_size )
+ImageProcessing::HorizontalConvo( const uchar* source, uchar* destination, int width, int height, int channels, double* kernel, int kernel_size )
 ///
 /// Performs a horizontal convolution using a given 1D kernel.
 ///
@@ -166,7 +364,8 @@ ImageProcessing::HorizontalConvo( uchar* source, uchar* destination, int width,
 ///  The source image data.
 ///
 /// @param destination
-///  The image data where the result is to be stored (must be the same dimensions as source).
+///  The image data where the result is to be stored (must be the same dimensions as source,
+///  may be the same as source).
 ///
 /// @param width
 ///  The width of the image.
@@ -187,31 +386,53 @@ ImageProcessing::HorizontalConvo( uchar* source, uchar* destination, int width,
 ///  Nothing.
 ///
 {
-	for( int j = 0; j < height; j++ )
+	// Use the fixed-point engine whenever the kernel can be quantized accurately
+	short* fixed_kernel = new short[kernel_size];
+	int shift = 0;
+	bool quantized = Convolution::QuantizeKernel( kernel, kernel_size, fixed_kernel, shift );
+	const int row_size = width*channels;
+
+	// Rows don't depend on each other, so bands of rows run on separate threads
+	Parallel::For( height, [&]( int first_row, int last_row )
 	{
-		for( int i = 0; i < width; i++ )
+		if( quantized )
 		{
-			for( int c = 0; c < channels; c++ )
+			Convolution::HorizontalPass( source + first_row*row_size, destination + first_row*row_size, width, last_row - first_row, channels, fixed_kernel, kernel_size, shift );
+			return;
+		}
+
+		// Read each row from a copy so the convolution can be done in place
+		uchar* row = new uchar[row_size];
+		for( int j = first_row; j < last_row; j++ )
+		{
+			memcpy( row, source + j*row_size, row_size );
+			for( int i = 0; i < width; i++ )
 			{
-				double total = 0.0;
-				for( int kx = 0; kx < kernel_size; kx++ )
+				for( int c = 0; c < channels; c++ )
 				{
-                    int x_pos = i + kx - kernel_size/2;
-                    if( x_pos < 0 ) x_pos = 0;
-                    if( x_pos >= width ) x_pos = width - 1;
+					double total = 0.0;
+					for( int kx = 0; kx < kernel_size; kx++ )
+					{
+						int x_pos = i + kx - kernel_size/2;
+						if( x_pos < 0 ) x_pos = 0;
+						if( x_pos >= width ) x_pos = width - 1;
 
-                    total += source[j*width*channels + x_pos*channels + c]*kernel[kx];
+						total += row[x_pos*channels + c]*kernel[kx];
+					}
+					if( total > 255 ) total = 255;
+					if( total < 0 ) total = 0;
+					destination[(j)*width*channels + (i)*channels + c] = (uchar)total;
 				}
-                if( total > 255 ) total = 255;
-                if( total < 0 ) total = 0;
-				destination[(j)*width*channels + (i)*channels + c] = (uchar)total;
 			}
 		}
-	}
+		delete [] row;
+	} );
+
+	delete [] fixed_kernel;
 }
 
 void
-ImageProcessing::VerticalConvo( uchar* source, uchar* destination, int width, int height, int channels, double* kernel, int kernel_size )
+ImageProcessing::VerticalConvo( const uchar* source, uchar* destination, int width, int height, int channels, double* kernel, int kernel_size )
 ///
 /// Performs a vertical convolution using a given 1D kernel.
 ///
@@ -219,7 +440,8 @@ ImageProcessing::VerticalConvo( uchar* source, uchar* destination, int width, in
 ///  The source image data.
 ///
 /// @param destination
-///  The image data where the result is to be stored (must be the same dimensions as source).
+///  The image data where the result is to be stored (must be the same dimensions as source,
+///  may be the same as source).
 ///
 /// @param width
 ///  The width of the image.
@@ -240,31 +462,66 @@ ImageProcessing::VerticalConvo( uchar* source, uchar* destination, int width, in
 ///  Nothing.
 ///
 {
-	for( int j = 0; j < height; j++ )
+	// Use the fixed-point engine whenever the kernel can be quantized accurately
+	short* fixed_kernel = new short[kernel_size];
+	int shift = 0;
+	bool quantized = Convolution::QuantizeKernel( kernel, kernel_size, fixed_kernel, shift );
+
+	// Split into strips of columns rather than rows, as each column only depends on itself
+	Parallel::For( width, [&]( int first_column, int last_column )
 	{
-		for( int i = 0; i < width; i++ )
+		if( quantized )
 		{
-			for( int c = 0; c < channels; c++ )
+			Convolution::VerticalPass( source, destination, width, height, channels, fixed_kernel, kernel_size, shift, first_column, last_column );
+			return;
+		}
+
+		// Keep copies of the source rows under the kernel, so the strip can be convolved in place
+		const int half = kernel_size/2;
+		const int reach = kernel_size - 1 - half;
+		const int strip_begin = first_column*channels;
+		const int strip_size = ( last_column - first_column )*channels;
+		uchar* ring = new uchar[kernel_size*strip_size];
+
+		int loaded = 0;
+		for( ; loaded <= reach && loaded < height; loaded++ )
+		{
+			memcpy( ring + ( loaded%kernel_size )*strip_size, source + loaded*width*channels + strip_begin, strip_size );
+		}
+
+		for( int j = 0; j < height; j++ )
+		{
+			if( loaded == j + reach && loaded < height )
+			{
+				memcpy( ring + ( loaded%kernel_size )*strip_size, source + loaded*width*channels + strip_begin, strip_size );
+				loaded++;
+			}
+
+			for( int x = 0; x < strip_size; x++ )
 			{
 				double total = 0.0;
 				for( int ky = 0; ky < kernel_size; ky++ )
 				{
-                    int y_pos = j + ky - kernel_size/2;
-                    if( y_pos < 0 ) y_pos = 0;
-                    if( y_pos >= height ) y_pos = height - 1;
+					int y_pos = j + ky - half;
+					if( y_pos < 0 ) y_pos = 0;
+					if( y_pos >= height ) y_pos = height - 1;
 
-                    total += source[y_pos*width*channels + i*channels + c]*kernel[ky];
+					total += ring[( y_pos%kernel_size )*strip_size + x]*kernel[ky];
 				}
-                if( total > 255 ) total = 255;
-                if( total < 0 ) total = 0;
-				destination[(j)*width*channels + (i)*channels + c] = (uchar)total;
+				if( total > 255 ) total = 255;
+				if( total < 0 ) total = 0;
+				destination[j*width*channels + strip_begin + x] = (uchar)total;
 			}
 		}
-	}
+
+		delete [] ring;
+	} );
+
+	delete [] fixed_kernel;
 }
 
 void
-ImageProcessing::TwoDConvo( uchar* source, uchar* destination, int width, int height, int channels, double* kernel, int kernel_size )
+ImageProcessing::TwoDConvo( const uchar* source, uchar* destination, int width, int height, int channels, double* kernel, int kernel_size )
 ///
 /// Performs a 2D convolution using a given 2D kernel.
 ///
@@ -293,40 +550,57 @@ ImageProcessing::TwoDConvo( uchar* source, uchar* destination, int width, int he
 ///  Nothing.
 ///
 {
-	for( int j = 0; j < height; j++ )
+	// An in place convolution reads rows it has already written, so it has to stay serial
+	int grain = source == destination ? height : 0;
+
+	Parallel::For( height, [&]( int first_row, int last_row )
 	{
-		for( int i = 0; i < width; i++ )
+		for( int j = first_row; j < last_row; j++ )
 		{
-			for( int c = 0; c < channels; c++ )
+			for( int i = 0; i < width; i++ )
 			{
-				double total = 0.0;
-				for( int ky = 0; ky < kernel_size; ky++ )
+				for( int c = 0; c < channels; c++ )
 				{
-					for( int kx = 0; kx < kernel_size; kx++ )
+					double total = 0.0;
+					for( int ky = 0; ky < kernel_size; ky++ )
 					{
-                    	int y_pos = j + ky - kernel_size/2;
-                    	if( y_pos < 0 ) y_pos = 0;
-                    	if( y_pos >= height ) y_pos = height - 1;
+						for( int kx = 0; kx < kernel_size; kx++ )
+						{
+							int y_pos = j + ky - kernel_size/2;
+							if( y_pos < 0 ) y_pos = 0;
+							if( y_pos >= height ) y_pos = height - 1;
 
-                    	int x_pos = i + kx - kernel_size/2;
-                    	if( x_pos < 0 ) x_pos = 0;
-                    	if( x_pos >= width ) x_pos = width - 1;
+							int x_pos = i + kx - kernel_size/2;
+							if( x_pos < 0 ) x_pos = 0;
+							if( x_pos >= width ) x_pos = width - 1;
 
-                    	total += source[y_pos*width*channels + x_pos*channels + c]*kernel[ky*kernel_size + kx];
+							total += source[y_pos*width*channels + x_pos*channels + c]*kernel[ky*kernel_size + kx];
+						}
 					}
+					if( total > 255 ) total = 255;
+					if( total < 0 ) total = 0;
+					destination[(j)*width*channels + (i)*channels + c] = (uchar)total;
 				}
-                if( total > 255 ) total = 255;
-                if( total < 0 ) total = 0;
-				destination[(j)*width*channels + (i)*channels + c] = (uchar)total;
 			}
 		}
-	}
+	}, grain );
 }
 
-void 
-ImageProcessing::BoxBlur( uchar* source, uchar* destination, int width, int height, int channels, int kernel_size )
+static inline uchar
+DivideRunningSum( unsigned int total, quint64 reciprocal )
+///
+/// Divides a running sum by the window size using a precomputed 32 bit reciprocal.
+///
+{
+	return (uchar)( ( total*reciprocal ) >> 32 );
+}
+
+static void
+RunningSumHorizontal( const uchar* source, uchar* destination, int width, int height, int channels, int kernel_size, bool round )
 ///
-/// Blurs a given image using a simple box blur.
+/// Box filters each row with a running sum, so the cost per pixel does not depend on
+/// the kernel size. Edges are clamped. Each row is copied before it is filtered so the
+/// source and destination may be the same image.
 ///
 /// @param source
 ///  The source image data.
@@ -344,31 +618,69 @@ ImageProcessing::BoxBlur( uchar* source, uchar* destination, int width, int heig
 ///  The number of color channels.
 ///
 /// @param kernel_size
-///  The size of the blur kernel to be used. 5 by default.
+///  The width of the box.
+///
+/// @param round
+///  Rounds to the nearest value if true, otherwise truncates like the convolution path.
 ///
 /// @return
-///  Nothing
+///  Nothing.
 ///
 {
-	double* kernel = new double[kernel_size];
-	for( int k = 0; k < kernel_size; k++ )
+	const int left = kernel_size/2;
+	const int right = kernel_size - 1 - left;
+	const int row_size = width*channels;
+	const unsigned int bias = round ? kernel_size/2 : 0;
+	const quint64 reciprocal = ( ( (quint64)1 << 32 ) + kernel_size - 1 )/kernel_size;
+
+	uchar* row = new uchar[row_size];
+	unsigned int* totals = new unsigned int[channels];
+	for( int j = 0; j < height; j++ )
 	{
-		kernel[k] = 1.0/kernel_size;
-	}
+		memcpy( row, source + j*row_size, row_size );
+		uchar* destination_row = destination + j*row_size;
 
-	ImageProcessing::HorizontalConvo(source, destination, width, height, channels, kernel, kernel_size);
-	ImageProcessing::VerticalConvo(destination, destination, width, height, channels, kernel, kernel_size);
+		for( int c = 0; c < channels; c++ )
+		{
+			unsigned int total = bias;
+			for( int k = -left; k <= right; k++ )
+			{
+				int x_pos = k < 0 ? 0 : ( k >= width ? width - 1 : k );
+				total += row[x_pos*channels + c];
+			}
+			totals[c] = total;
+			destination_row[c] = DivideRunningSum( total, reciprocal );
+		}
 
-	delete [] kernel;
+		for( int i = 1; i < width; i++ )
+		{
+			int x_in = i + right;
+			int x_out = i - left - 1;
+			if( x_in >= width ) x_in = width - 1;
+			if( x_out < 0 ) x_out = 0;
+
+			for( int c = 0; c < channels; c++ )
+			{
+				totals[c] += row[x_in*channels + c];
+				totals[c] -= row[x_out*channels + c];
+				destination_row[i*channels + c] = DivideRunningSum( totals[c], reciprocal );
+			}
+		}
+	}
+	delete [] totals;
+	delete [] row;
 }
 
-void 
-ImageProcessing::GaussianBlur( uchar* source, uchar* destination, int width, int height, int channels, int kernel_size, double sigma )
+static void
+RunningSumVertical( uchar* source, uchar* destination, int width, int height, int channels, int kernel_size, bool round )
 ///
-/// Blurs an image using convolution with a gaussian kernel.
+/// Box filters each column with running column sums that are updated a whole row at a time,
+/// so the image is read in memory order. Edges are clamped. The rows that are still needed
+/// after being overwritten are kept in a small ring buffer, so the source and destination
+/// may be the same image.
 ///
 /// @param source
-///  The image to be blurred.
+///  The source image data.
 ///
 /// @param destination
 ///  The destination image data.
@@ -380,55 +692,86 @@ ImageProcessing::GaussianBlur( uchar* source, uchar* destination, int width, int
 ///  The height of the image.
 ///
 /// @param channels
-///  The number of color channels that the image contains.
+///  The number of color channels.
 ///
 /// @param kernel_size
-///  The size of the gaussian kernel to be used for blurring. 5 by default.
+///  The height of the box.
 ///
-/// @param sigma
-///  The sigma parameter. Effects how blurry the image is. 1.5 by default.
+/// @param round
+///  Rounds to the nearest value if true, otherwise truncates like the convolution path.
 ///
 /// @return
 ///  Nothing.
 ///
 {
-	// Create a gaussian kernel of size=kernel_size and strength=sigma
-	double* kernel = new double[kernel_size];
+	const int top = kernel_size/2;
+	const int bottom = kernel_size - 1 - top;
+	const int row_size = width*channels;
+	const unsigned int bias = round ? kernel_size/2 : 0;
+	const quint64 reciprocal = ( ( (quint64)1 << 32 ) + kernel_size - 1 )/kernel_size;
 
-	double sum = 0.0;
-	double s_const = 1.0/(2*PI*sigma*sigma);
-	for( int i = 0; i < kernel_size; i++ )
+	// Original copies of the first row and of the last top + 1 rows written
+	uchar* first_row = new uchar[row_size];
+	uchar* ring = new uchar[( top + 1 )*row_size];
+	memcpy( first_row, source, row_size );
+
+	unsigned int* totals = new unsigned int[row_size];
+	for( int c = 0; c < row_size; c++ )
 	{
-		int dist = i - kernel_size/2;
-		double neg_dist = -1.0*dist*dist;
-		kernel[i] = s_const*exp( neg_dist/(2*sigma*sigma) );
-		sum += kernel[i];
+		totals[c] = bias;
 	}
-
-	for( int i = 0; i < kernel_size; i++ )
+	for( int k = -top; k <= bottom; k++ )
 	{
-		kernel[i] /= sum;
+		int y_pos = k < 0 ? 0 : ( k >= height ? height - 1 : k );
+		const uchar* row = source + y_pos*row_size;
+		for( int c = 0; c < row_size; c++ )
+		{
+			totals[c] += row[c];
+		}
 	}
 
-	ImageProcessing::HorizontalConvo(source, destination, width, height, channels, kernel, kernel_size);
-	ImageProcessing::VerticalConvo(destination, destination, width, height, channels, kernel, kernel_size);
-	delete [] kernel;
+	for( int j = 0; j < height; j++ )
+	{
+		if( j > 0 )
+		{
+			int y_in = j + bottom;
+			int y_out = j - top - 1;
+			if( y_in >= height ) y_in = height - 1;
+
+			const uchar* row_in = source + y_in*row_size;
+			const uchar* row_out = y_out <= 0 ? first_row : ring + ( y_out % ( top + 1 ) )*row_size;
+			for( int c = 0; c < row_size; c++ )
+			{
+				totals[c] += row_in[c];
+				totals[c] -= row_out[c];
+			}
+		}
+
+		// Keep this row before it is overwritten, rows above it are still to leave the window
+		memcpy( ring + ( j % ( top + 1 ) )*row_size, source + j*row_size, row_size );
+
+		uchar* destination_row = destination + j*row_size;
+		for( int c = 0; c < row_size; c++ )
+		{
+			destination_row[c] = DivideRunningSum( totals[c], reciprocal );
+		}
+	}
+	delete [] totals;
+	delete [] ring;
+	delete [] first_row;
 }
 
 void 
-ImageProcessing::SobelEdgeDetection( uchar* source, uchar* gradient_magnitude, int width, int height, int channels )
+ImageProcessing::BoxBlur( const uchar* source, uchar* destination, int width, int height, int channels, int kernel_size )
 ///
-/// Performs the sobel operator on a given image, which gives an approximation of the image
-/// gradients which is useful for edge detection.
+/// Blurs a given image using a simple box blur. Uses running sums so the cost per pixel
+/// is the same whatever the kernel size. Edges are clamped.
 ///
 /// @param source
-///  The source image.
-///
-/// @param gradient_magnitude
-///  A one channel image that stores the gradient strength returned by the sobel operator at each point.
+///  The source image data.
 ///
-/// @param gradient_direction
-///  A one channel image that stores the gradient direction returned by the sobel operator at each point.
+/// @param destination
+///  The destination image data. May be the same as the source.
 ///
 /// @param width
 ///  The width of the image.
@@ -437,42 +780,105 @@ ImageProcessing::SobelEdgeDetection( uchar* source, uchar* gradient_magnitude, i
 ///  The height of the image.
 ///
 /// @param channels
-///  The number of channels in the source image.
+///  The number of color channels.
+///
+/// @param kernel_size
+///  The size of the blur kernel to be used. 5 by default.
 ///
 /// @return
-///  Nothing.
+///  Nothing
+///
 {
-	ImageProcessing::ConvertToOneChannel( source, gradient_magnitude, width, height, channels);
-
-	uchar* gx = new uchar[width*height];
-	uchar* gy = new uchar[width*height];
-	double sobel_x[9] = {-1.0, 0.0, 1.0, -2.0, 0.0, 2.0, -1.0, 0.0, 1.0};
-	double sobel_y[9] = {1.0, 2.0, 1.0, 0.0, 0.0, 0.0, -1.0, -2.0, -1.0};
-
-	ImageProcessing::TwoDConvo(gradient_magnitude, gx, width, height, 1, sobel_x, 3);
-	ImageProcessing::TwoDConvo(gradient_magnitude, gy, width, height, 1, sobel_y, 3);
-
-	// Added together the gradient images in the x and y direction
-	ImageProcessing::AddImages(gx, gy, gradient_magnitude, width, height, 1);
-
-	delete [] gx;
-	delete [] gy;
+	if( kernel_size < 1 ) kernel_size = 1;
+	RunningSumHorizontal( source, destination, width, height, channels, kernel_size, false );
+	RunningSumVertical( destination, destination, width, height, channels, kernel_size, false );
 }
 
 void 
-ImageProcessing::SobelEdgeDetection( uchar* source, uchar* gradient_magnitude, uchar* gradient_direction, int width, int height, int channels )
+ImageProcessing::BoxBlurCascade( const uchar* source, uchar* destination, int width, int height, int channels, double sigma, int passes )
 ///
-/// Performs the sobel operator on a given image, which gives an approximation of the image
-/// gradients which is useful for edge detection.
+/// Approximates a gaussian blur by applying several box blurs in a row. The box sizes are
+/// chosen so that the variance of the cascade matches the given sigma (see Kovesi, "Fast
+/// Almost-Gaussian Filtering"). Each pass costs the same whatever the sigma.
 ///
 /// @param source
-///  The source image.
+///  The source image data.
 ///
-/// @param gradient_magnitude
-///  A one channel image that stores the gradient strength returned by the sobel operator at each point.
+/// @param destination
+///  The destination image data. May be the same as the source.
 ///
-/// @param gradient_direction
-///  A one channel image that stores the gradient direction returned by the sobel operator at each point.
+/// @param width
+///  The width of the image.
+///
+/// @param height
+///  The height of the image.
+///
+/// @param channels
+///  The number of color channels.
+///
+/// @param sigma
+///  The sigma of the gaussian to approximate. 1.5 by default.
+///
+/// @param passes
+///  The number of box blurs to apply. More passes give a closer approximation. 3 by default.
+///
+/// @return
+///  Nothing
+///
+{
+	if( passes < 1 ) passes = 1;
+
+	// Find the odd box sizes either side of the ideal one, and how many of each are needed
+	double ideal_size = sqrt( 12.0*sigma*sigma/passes + 1.0 );
+	int lower_size = (int)floor( ideal_size );
+	if( lower_size%2 == 0 ) lower_size--;
+	if( lower_size < 1 ) lower_size = 1;
+	int upper_size = lower_size + 2;
+	int lower_count = (int)floor( ( 12.0*sigma*sigma - passes*lower_size*lower_size - 4.0*passes*lower_size - 3.0*passes )/( -4.0*lower_size - 4.0 ) + 0.5 );
+
+	const uchar* pass_source = source;
+	for( int pass = 0; pass < passes; pass++ )
+	{
+		int box_size = pass < lower_count ? lower_size : upper_size;
+		RunningSumHorizontal( pass_source, destination, width, height, channels, box_size, true );
+		RunningSumVertical( destination, destination, width, height, channels, box_size, true );
+		pass_source = destination;
+	}
+}
+
+int
+ImageProcessing::GaussianKernelSize( int kernel_size, double sigma )
+///
+/// Taps further than 4 sigma from the center are too small to change the result, so
+/// GaussianBlur drops them. Blurs with the same sigma whose kernels are both at least this
+/// wide give the same image.
+///
+/// @param kernel_size
+///  The size of the gaussian kernel asked for.
+///
+/// @param sigma
+///  The sigma parameter. 1.5 by default.
+///
+/// @return
+///  The size of the kernel GaussianBlur actually uses.
+///
+{
+	int full_kernel_size = 2*(int)ceil( 4.0*sigma ) + 1;
+	return kernel_size > full_kernel_size ? full_kernel_size : kernel_size;
+}
+
+void 
+ImageProcessing::GaussianBlur( const uchar* source, uchar* destination, int width, int height, int channels, int kernel_size, double sigma )
+///
+/// Blurs an image using convolution with a gaussian kernel.
+///
+/// Taps further than 4 sigma from the center are dropped as they can't change the result.
+///
+/// @param source
+///  The image to be blurred.
+///
+/// @param destination
+///  The destination image data.
 ///
 /// @param width
 ///  The width of the image.
@@ -481,46 +887,202 @@ ImageProcessing::SobelEdgeDetection( uchar* source, uchar* gradient_magnitude, u
 ///  The height of the image.
 ///
 /// @param channels
-///  The number of channels in the source image.
+///  The number of color channels that the image contains.
+///
+/// @param kernel_size
+///  The size of the gaussian kernel to be used for blurring. 5 by default.
+///
+/// @param sigma
+///  The sigma parameter. Effects how blurry the image is. 1.5 by default.
 ///
 /// @return
 ///  Nothing.
+///
 {
-	ImageProcessing::ConvertToOneChannel( source, gradient_magnitude, width, height, channels);
+	kernel_size = GaussianKernelSize( kernel_size, sigma );
+
+	// Create a gaussian kernel of size=kernel_size and strength=sigma
+	double* kernel = new double[kernel_size];
+
+	double sum = 0.0;
+	double s_const = 1.0/(2*PI*sigma*sigma);
+	for( int i = 0; i < kernel_size; i++ )
+	{
+		int dist = i - kernel_size/2;
+		double neg_dist = -1.0*dist*dist;
+		kernel[i] = s_const*exp( neg_dist/(2*sigma*sigma) );
+		sum += kernel[i];
+	}
 
-	uchar* gx = new uchar[width*height];
-	uchar* gy = new uchar[width*height];
-	double sobel_x[9] = {-1.0, 0.0, 1.0, -2.0, 0.0, 2.0, -1.0, 0.0, 1.0};
-	double sobel_y[9] = {1.0, 2.0, 1.0, 0.0, 0.0, 0.0, -1.0, -2.0, -1.0};
+	for( int i = 0; i < kernel_size; i++ )
+	{
+		kernel[i] /= sum;
+	}
 
-	ImageProcessing::TwoDConvo(gradient_magnitude, gx, width, height, 1, sobel_x, 3);
-	ImageProcessing::TwoDConvo(gradient_magnitude, gy, width, height, 1, sobel_y, 3);
+	ImageProcessing::HorizontalConvo(source, destination, width, height, channels, kernel, kernel_size);
+	ImageProcessing::VerticalConvo(destination, destination, width, height, channels, kernel, kernel_size);
+	delete [] kernel;
+}
+
+static inline void
+SobelAt( const uchar* up, const uchar* middle, const uchar* down, int left, int center, int right, uchar* gradient_magnitude, uchar* gradient_direction, short* gradient_x, short* gradient_y, bool l2_magnitude, int pixel )
+///
+/// Applies both sobel kernels at one pixel and writes every requested output. The
+/// direction is quantized without any trigonometry by comparing |gy| against |gx|
+/// scaled by tan(22.5) and tan(67.5) in 7 bit fixed-point, then using the signs to pick
+/// between the two diagonals. Angles are measured with y pointing up the image.
+///
+{
+	int gx = ( up[right] + 2*middle[right] + down[right] ) - ( up[left] + 2*middle[left] + down[left] );
+	int gy = ( up[left] + 2*up[center] + up[right] ) - ( down[left] + 2*down[center] + down[right] );
+	int abs_x = gx < 0 ? -gx : gx;
+	int abs_y = gy < 0 ? -gy : gy;
 
-	// Added together the gradient images in the x and y direction
-	ImageProcessing::AddImages(gx, gy, gradient_magnitude, width, height, 1);
+	if( gradient_x ) gradient_x[pixel] = (short)gx;
+	if( gradient_y ) gradient_y[pixel] = (short)gy;
+	if( gradient_magnitude )
+	{
+		int magnitude = l2_magnitude ? (int)( sqrtf( (float)( gx*gx + gy*gy ) ) + 0.5f ) : abs_x + abs_y;
+		gradient_magnitude[pixel] = magnitude > 255 ? 255 : (uchar)magnitude;
+	}
+	if( gradient_direction )
+	{
+		if( abs_y*128 <= abs_x*53 )
+		{
+			gradient_direction[pixel] = 0;
+		}
+		else if( abs_y*128 >= abs_x*309 )
+		{
+			gradient_direction[pixel] = 90;
+		}
+		else
+		{
+			gradient_direction[pixel] = ( gx > 0 ) == ( gy > 0 ) ? 45 : 135;
+		}
+	}
+}
 
+void
+ImageProcessing::SobelGradients( const uchar* gray, short* gradient_x, short* gradient_y, uchar* gradient_magnitude, uchar* gradient_direction, int width, int height, bool l2_magnitude )
+///
+/// Applies the sobel operator to a one channel image in a single pass, producing any
+/// combination of the signed gradients, the gradient magnitude and the quantized gradient
+/// direction. Edges are clamped.
+///
+/// @param gray
+///  The one channel source image.
+///
+/// @param gradient_x
+///  Stores the signed gradient in the x direction (right minus left). May be NULL.
+///
+/// @param gradient_y
+///  Stores the signed gradient in the y direction (top minus bottom). May be NULL.
+///
+/// @param gradient_magnitude
+///  Stores the gradient strength, clipped at 255. May be NULL.
+///
+/// @param gradient_direction
+///  Stores the gradient direction rounded to 0, 45, 90 or 135 degrees, with y pointing
+///  up the image. May be NULL.
+///
+/// @param width
+///  The width of the image.
+///
+/// @param height
+///  The height of the image.
+///
+/// @param l2_magnitude
+///  Use the euclidean length of the gradient for the magnitude instead of |gx| + |gy|. False by default.
+///
+/// @return
+///  Nothing.
+///
+{
 	for( int j = 0; j < height; j++ )
 	{
-		for( int i = 0; i < width; i++ )
+		const uchar* up = gray + ( j > 0 ? j - 1 : 0 )*width;
+		const uchar* middle = gray + j*width;
+		const uchar* down = gray + ( j < height - 1 ? j + 1 : height - 1 )*width;
+		int row = j*width;
+
+		// The left and right edges are clamped, the interior needs no checks
+		SobelAt( up, middle, down, 0, 0, width > 1 ? 1 : 0, gradient_magnitude, gradient_direction, gradient_x, gradient_y, l2_magnitude, row );
+		for( int i = 1; i < width - 1; i++ )
 		{
-			if( gx[j*width + i] != 0)
-			{
-				int direction = atan(gy[j*width + i]/gx[j*width + i]) * 180 / PI;
-				gradient_direction[j*width + i] = direction;
-			}
-			else if( gy[j*width + i] == 0)
-			{
-				gradient_direction[j*width + i] = 0;
-			}
-			else
-			{
-				gradient_direction[j*width + i] = 90;
-			}
+			SobelAt( up, middle, down, i - 1, i, i + 1, gradient_magnitude, gradient_direction, gradient_x, gradient_y, l2_magnitude, row + i );
+		}
+		if( width > 1 )
+		{
+			SobelAt( up, middle, down, width - 2, width - 1, width - 1, gradient_magnitude, gradient_direction, gradient_x, gradient_y, l2_magnitude, row + width - 1 );
 		}
 	}
+}
+
+void 
+ImageProcessing::SobelEdgeDetection( const uchar* source, uchar* gradient_magnitude, int width, int height, int channels )
+///
+/// Performs the sobel operator on a given image, which gives an approximation of the image
+/// gradients which is useful for edge detection.
+///
+/// @param source
+///  The source image.
+///
+/// @param gradient_magnitude
+///  A one channel image that stores the gradient strength returned by the sobel operator at each point.
+///
+/// @param width
+///  The width of the image.
+///
+/// @param height
+///  The height of the image.
+///
+/// @param channels
+///  The number of channels in the source image.
+///
+/// @return
+///  Nothing.
+{
+	ImageProcessing::SobelEdgeDetection( source, gradient_magnitude, NULL, width, height, channels );
+}
+
+void 
+ImageProcessing::SobelEdgeDetection( const uchar* source, uchar* gradient_magnitude, uchar* gradient_direction, int width, int height, int channels )
+///
+/// Performs the sobel operator on a given image, which gives an approximation of the image
+/// gradients which is useful for edge detection.
+///
+/// @param source
+///  The source image.
+///
+/// @param gradient_magnitude
+///  A one channel image that stores the gradient strength returned by the sobel operator at each point.
+///
+/// @param gradient_direction
+///  A one channel image that stores the gradient direction returned by the sobel operator at each point,
+///  rounded to 0, 45, 90 or 135 degrees. May be NULL.
+///
+/// @param width
+///  The width of the image.
+///
+/// @param height
+///  The height of the image.
+///
+/// @param channels
+///  The number of channels in the source image.
+///
+/// @return
+///  Nothing.
+{
+	if( channels == 1 )
+	{
+		ImageProcessing::SobelGradients( source, NULL, NULL, gradient_magnitude, gradient_direction, width, height );
+		return;
+	}
 
-	delete [] gx;
-	delete [] gy;
+	uchar* gray = new uchar[width*height];
+	ImageProcessing::ConvertToOneChannel( source, gray, width, height, channels );
+	ImageProcessing::SobelGradients( gray, NULL, NULL, gradient_magnitude, gradient_direction, width, height );
+	delete [] gray;
 }
 
 void 
@@ -532,7 +1094,7 @@ NonmaximumSupression( uchar* gradient_magnitude, uchar* gradient_direction, ucha
 ///  The intensity of the gradient at each point in the image.
 ///
 /// @param gradient_direction
-///  The direction of the gradient at each point in the image.
+///  The direction of the gradient at each point in the image, as 0, 45, 90 or 135 degrees.
 ///
 /// @param edges
 ///  An empty image that stores the resulting edge information.
@@ -547,55 +1109,82 @@ NonmaximumSupression( uchar* gradient_magnitude, uchar* gradient_direction, ucha
 ///  Nothing.
 /// 
 {
-	for( int j = 0; j < height; j++ )
+	Parallel::For( height, [&]( int first_row, int last_row )
 	{
-		for( int i = 0; i < width; i++ )
+		for( int j = first_row; j < last_row; j++ )
 		{
-			// Set gradient strength to zero if edges are not the maximum in their search direction.
-			int search_direction = gradient_direction[j*width + i];
-			if( search_direction > 180 ) search_direction = search_direction % 180;
-			int x_pos = 0;
-			int y_pos = 0;
-			if( search_direction > 22.5 && search_direction <= 67.5 )
-			{
-				// 45 degrees, north-west/south-east
-				x_pos = 1;
-				y_pos = 1;
-			}
-			else if( search_direction > 67.5 && search_direction <= 112.5 )
-			{
-				// 90 degrees, east/west
-				x_pos = 0;
-				y_pos = 1;
-			}
-			else if( search_direction > 112.5 && search_direction <= 157.5)
-			{
-				// 135 degrees, north-east/south-west
-				x_pos = -1;
-				y_pos = 1;
-			}
-			else
-			{
-				// 0 degrees, north/south
-				x_pos = 1;
-				y_pos = 0;
-			}
-			edges[j*width + i] = gradient_magnitude[j*width + i];
-			if( j - y_pos >= 0 && i - x_pos >= 0 && j - y_pos < height && i - x_pos < width && !(x_pos == 0 && y_pos == 0) )
+			for( int i = 0; i < width; i++ )
 			{
-				if( gradient_magnitude[(j - y_pos)*width + i - x_pos] > gradient_magnitude[j*width + i])
+				// Set gradient strength to zero if edges are not the maximum in their search direction.
+				int x_pos = 0;
+				int y_pos = 0;
+				switch( gradient_direction[j*width + i] )
 				{
-					edges[j*width + i] =  0;
+					case 45:
+						// north-east/south-west
+						x_pos = 1;
+						y_pos = -1;
+						break;
+					case 90:
+						// north/south
+						x_pos = 0;
+						y_pos = 1;
+						break;
+					case 135:
+						// north-west/south-east
+						x_pos = 1;
+						y_pos = 1;
+						break;
+					default:
+						// east/west
+						x_pos = 1;
+						y_pos = 0;
+						break;
 				}
-			}
-			if( j + y_pos >= 0 && i + x_pos >= 0 && j + y_pos < height && i + x_pos < width && !(x_pos == 0 && y_pos == 0) )
-			{
-				if( gradient_magnitude[(j + y_pos)*width + i + x_pos] > gradient_magnitude[j*width + i])
+				edges[j*width + i] = gradient_magnitude[j*width + i];
+				if( j - y_pos >= 0 && i - x_pos >= 0 && j - y_pos < height && i - x_pos < width )
 				{
-					edges[j*width + i] = 0;
+					if( gradient_magnitude[(j - y_pos)*width + i - x_pos] > gradient_magnitude[j*width + i])
+					{
+						edges[j*width + i] =  0;
+					}
+				}
+				if( j + y_pos >= 0 && i + x_pos >= 0 && j + y_pos < height && i + x_pos < width )
+				{
+					if( gradient_magnitude[(j + y_pos)*width + i + x_pos] > gradient_magnitude[j*width + i])
+					{
+						edges[j*width + i] = 0;
+					}
 				}
 			}
 		}
+	} );
+}
+
+static void
+ClassifyEdges( uchar* edges, int width, int height, int max_threshold, int min_threshold )
+///
+/// Marks each pixel as a definite edge (255), a possible edge (100) or not an edge (0)
+/// depending on the hysteresis thresholds.
+///
+{
+	for( int i = 0; i < width*height; i++ )
+	{
+		if( edges[i] >= max_threshold )
+		{
+			// Set pixels that definitely edges to 255
+			edges[i] = 255;
+		} 
+		else if( edges[i] >= min_threshold )
+		{
+			// Set pixels that might be edges to 100
+			edges[i] = 100;
+		}
+		else
+		{
+			// Set pixels that are not edges to 0
+			edges[i] = 0;
+		}
 	}
 }
 
@@ -605,6 +1194,10 @@ Hysteresis( uchar* edges, int width, int height, int max_threshold, int min_thre
 /// Traces connected edges to minimize noise. An edge begins if it strength is greater than
 /// or equal to the maximum threshold and continues until it drops below the minimum threshold.
 ///
+/// Every definite edge is put on a stack, and edges are followed from the stack into any
+/// undecided neighbours, so each pixel is visited a fixed number of times. Undecided pixels
+/// on the border of the image are never traced into.
+///
 /// @param edges
 ///  The gradient magnitude at each point in the image.
 ///
@@ -623,77 +1216,376 @@ Hysteresis( uchar* edges, int width, int height, int max_threshold, int min_thre
 /// @return
 ///  Nothing.
 {
-	for( int j = 0; j < height; j++ )
+	ClassifyEdges( edges, width, height, max_threshold, min_threshold );
+
+	std::vector<int> stack;
+	for( int i = 0; i < width*height; i++ )
 	{
-		for( int i = 0; i < width; i++ )
+		if( edges[i] == 255 )
 		{
-			if( edges[j*width + i] >= max_threshold )
-			{
-				// Set pixels that definitely edges to 255
-				edges[j*width + i] = 255;
-			} 
-			else if( edges[j*width + i] >= min_threshold )
-			{
-				// Set pixels that might be edges to 100
-				edges[j*width + i] = 100;
-			}
-			else
+			stack.push_back( i );
+		}
+	}
+
+	// If a pixel is undecided, set it to be an edge if it has any neighbours that are edges
+	while( !stack.empty() )
+	{
+		int pixel = stack.back();
+		stack.pop_back();
+		int x = pixel%width;
+		int y = pixel/width;
+
+		for( int j = y - 1; j <= y + 1; j++ )
+		{
+			for( int i = x - 1; i <= x + 1; i++ )
 			{
-				// Set pixels that are not edges to 0
-				edges[j*width + i] = 0;
+				if( i >= 1 && j >= 1 && i < width - 1 && j < height - 1 && edges[j*width + i] == 100 )
+				{
+					edges[j*width + i] = 255;
+					stack.push_back( j*width + i );
+				}
 			}
+		}
+	}
 
+	// We have found all the edges, so set any remaining undecided pixels to 0
+	for( int i = 0; i < width*height; i++ )
+	{
+		if( edges[i] == 100 )
+		{
+			edges[i] = 0;
 		}
 	}
+}
+
+static inline bool
+IsHysteresisNode( const uchar* edges, int width, int height, int i, int j )
+///
+/// Whether a classified pixel can be part of a traced edge. Undecided pixels on
+/// the border are excluded, as in the sequential tracing.
+///
+{
+	uchar value = edges[j*width + i];
+	return value == 255 || ( value == 100 && i >= 1 && j >= 1 && i < width - 1 && j < height - 1 );
+}
+
+static inline int
+FindEdgeRoot( int* parent, int pixel )
+///
+/// Finds the root of an edge component, halving the path on the way.
+///
+{
+	while( parent[pixel] != pixel )
+	{
+		parent[pixel] = parent[parent[pixel]];
+		pixel = parent[pixel];
+	}
+	return pixel;
+}
+
+static inline void
+UniteEdges( int* parent, uchar* definite, int first, int second )
+///
+/// Joins two edge components. The root with the lower index is kept, and it
+/// remembers if either component contained a definite edge.
+///
+{
+	first = FindEdgeRoot( parent, first );
+	second = FindEdgeRoot( parent, second );
+	if( first == second ) return;
+	if( first > second )
+	{
+		int temp = first;
+		first = second;
+		second = temp;
+	}
+	parent[second] = first;
+	definite[first] |= definite[second];
+}
 
-	// Perform hysteresis on the image until the whole image is traversed with no new edges
-	bool done = false;
-	while( !done )
+static void
+LabelHysteresisBand( uchar* edges, int* parent, uchar* definite, int width, int height, int first_row, int last_row )
+///
+/// Labels the connected edge components within one band of rows.
+///
+{
+	for( int j = first_row; j < last_row; j++ )
 	{
-		done = true;
-		for( int j = 1; j < height - 1; j++ )
+		for( int i = 0; i < width; i++ )
 		{
-			for( int i = 1; i < width - 1; i++ )
+			int pixel = j*width + i;
+			if( !IsHysteresisNode( edges, width, height, i, j ) ) continue;
+
+			parent[pixel] = pixel;
+			definite[pixel] = edges[pixel] == 255;
+
+			// Join with the neighbours that have already been labelled in this band
+			if( i > 0 && IsHysteresisNode( edges, width, height, i - 1, j ) ) UniteEdges( parent, definite, pixel, pixel - 1 );
+			if( j > first_row )
 			{
-				if( edges[j*width + i] > 0 && edges[j*width + i] < 255 )
+				for( int x = i - 1; x <= i + 1; x++ )
 				{
-					// If a pixel is undecided, set it to be an edge if it has any neighbours that are edges
-					if( edges[(j-1)*width + (i-1)] == 255 || edges[(j-1)*width + i] == 255 || edges[(j-1)*width + (i+1)] == 255 ||
-						edges[j*width + (i-1)] == 255 || edges[j*width + (i+1)] == 255 ||
-						edges[(j+1)*width + (i-1)] == 255 || edges[(j+1)*width + i] == 255 || edges[(j+1)*width + (i+1)] == 255 )
+					if( x >= 0 && x < width && IsHysteresisNode( edges, width, height, x, j - 1 ) )
 					{
-						edges[j*width + i] = 255;
-						done = false;
+						UniteEdges( parent, definite, pixel, ( j - 1 )*width + x );
 					}
-						
 				}
 			}
 		}
 	}
+}
 
-	// We have found all the edges, so set any remaining undecided pixels to 0
-	for( int j = 0; j < height; j ++ )
+static void
+ResolveHysteresisBand( uchar* edges, const int* parent, const uchar* definite, int width, int height, int first_row, int last_row )
+///
+/// Sets every pixel of a band of rows to 255 if its edge component contains
+/// a definite edge, and to 0 otherwise.
+///
+{
+	for( int j = first_row; j < last_row; j++ )
+	{
+		for( int i = 0; i < width; i++ )
+		{
+			int pixel = j*width + i;
+			if( !IsHysteresisNode( edges, width, height, i, j ) )
+			{
+				edges[pixel] = 0;
+				continue;
+			}
+
+			// Other bands are being resolved at the same time, so don't compress paths here
+			int root = pixel;
+			while( parent[root] != root )
+			{
+				root = parent[root];
+			}
+			edges[pixel] = definite[root] ? 255 : 0;
+		}
+	}
+}
+
+void 
+ParallelHysteresis( uchar* edges, int width, int height, int max_threshold, int min_threshold )
+///
+/// Gives the same result as Hysteresis, but labels the connected edges of bands of rows
+/// on separate threads with a union-find. The labels are then merged across the seams
+/// between bands, and each band is resolved in parallel.
+///
+/// @param edges
+///  The gradient magnitude at each point in the image.
+///
+/// @param width
+///  The width of the image.
+///
+/// @param height
+///  The height of the image.
+///
+/// @param max_threshold
+///  The maximum threshold. Edge tracing begins if an edge is at least this intensity.
+///
+/// @param min_threshold
+///  The minimum threshold. Edge tracing ends if an edge drops below this intensity.
+///
+/// @return
+///  Nothing.
+{
+	ClassifyEdges( edges, width, height, max_threshold, min_threshold );
+
+	int* parent = new int[width*height];
+	uchar* definite = new uchar[width*height];
+
+	int bands = Parallel::Pool()->maxThreadCount();
+	if( bands > height ) bands = height;
+	if( bands < 1 ) bands = 1;
+
+	Parallel::ForEach( bands, [&]( int band )
+	{
+		LabelHysteresisBand( edges, parent, definite, width, height, band*height/bands, ( band + 1 )*height/bands );
+	} );
+
+	// Join the components that touch across the seams between bands
+	for( int band = 1; band < bands; band++ )
 	{
+		int j = band*height/bands;
 		for( int i = 0; i < width; i++ )
 		{
-			if( edges[j*width + i] < 255 && edges[j*width + i] > 0)
+			if( !IsHysteresisNode( edges, width, height, i, j ) ) continue;
+			for( int x = i - 1; x <= i + 1; x++ )
 			{
-				edges[j*width + i] = 0;
+				if( x >= 0 && x < width && IsHysteresisNode( edges, width, height, x, j - 1 ) )
+				{
+					UniteEdges( parent, definite, j*width + i, ( j - 1 )*width + x );
+				}
 			}
 		}
 	}
+
+	Parallel::ForEach( bands, [&]( int band )
+	{
+		ResolveHysteresisBand( edges, parent, definite, width, height, band*height/bands, ( band + 1 )*height/bands );
+	} );
+
+	delete [] parent;
+	delete [] definite;
 }
 
 void 
-ImageProcessing::CannyEdgeDetection( uchar* source, uchar* edges, int width, int height, int channels, int gaussian_kernel_size, double sigma, int max_threshold, int min_threshold )
+ImageProcessing::CannyEdgeDetection( const uchar* source, uchar* edges, int width, int height, int channels, int gaussian_kernel_size, double sigma, int max_threshold, int min_threshold )
 ///
 /// Runs Canny edge detection on a given image and returns the result.
 ///
 /// @param source
-///  The source image to perform the edge detection on.
+///  The source image to perform the edge detection on.
+///
+/// @param edges
+///  The edges discovered by the canny operator
+/// @param width
+///  The width of the image.
+///
+/// @param height
+///  The height of the image.
+///
+/// @param channels
+///  The number of color channels that the image contains.
+///
+/// @param gaussian_kernel_size
+///  The size of the gaussian kernel used to smooth the image. 5 by default.
+///
+/// @param sigma
+///  The sigma value of the gaussian kernel used to smooth the image. 1.5 by default.
+///
+/// @param max_threshold
+///  The maximum hysteresis threshold. Edge tracing begins if an edge is at least this intensity. 80 by default.
+///
+/// @param min_threshold
+///  The minimum hysteresis threshold. Edge tracing ends if an edge drops below this intensity. 20 by default.
+///
+/// @return
+///  Nothing.
+///
+{
+	uchar* smoothed = new uchar[width*height*channels];
+
+	// Apply a Gaussian blur with kernel size 5 to get rid of any noise
+	ImageProcessing::GaussianBlur( source, smoothed, width, height, channels, gaussian_kernel_size, sigma );
+
+	// Apply the sobel operator to the smoothed image to approximate the image gradients
+	uchar* gradient_magnitude = new uchar[width*height];
+	uchar* gradient_direction = new uchar[width*height];
+	ImageProcessing::SobelEdgeDetection( smoothed, gradient_magnitude, gradient_direction, width, height, channels );
+	delete [] smoothed;
+
+	// Apply nonmaximum supression to thin edges
+	NonmaximumSupression( gradient_magnitude, gradient_direction, edges, width, height );
+	delete [] gradient_magnitude;
+	delete [] gradient_direction;
+
+	// Apply hysteresis to minimize streaking
+	if( width*height >= PARALLEL_HYSTERESIS_MIN_PIXELS && Parallel::Pool()->maxThreadCount() > 1 )
+	{
+		ParallelHysteresis( edges, width, height, max_threshold, min_threshold );
+	}
+	else
+	{
+		Hysteresis( edges, width, height, max_threshold, min_threshold );
+	}
+}
+
+void
+ImageProcessing::ConvertToOneChannel(const uchar *source, uchar *destination, int width, int height, int channels, int alpha_channel)
+///
+/// Converts a multichannel image to a one channel image by averaging each color component excluding the alpha channel.
+///
+/// @param source
+///  The image to be converted.
+///
+/// @param destination
+///  The image that will store the resulting one channel image.
+///
+/// @param width
+///  The width of the image.
+///
+/// @param height
+///  The height of the image.
+///
+/// @param channels
+///  The number of color channels that the source image contains. 4 by default.
+///
+/// @param alpha_channel
+///  The index of the source image's alpha channel. -1 if it has no alpha. 3 by default.
+///
+/// @return
+///  Nothing.
+///
+{
+	const KernelTable& kernels = CpuDispatch::Kernels();
+	Parallel::For( height, [&]( int first_row, int last_row )
+	{
+		for( int j = first_row; j < last_row; j++ )
+		{
+			kernels.ConvertToGray( source + j*width*channels, destination + j*width, width, channels, alpha_channel );
+		}
+	} );
+}
+
+void
+ImageProcessing::ConvertToOneChannel( const QImage& source, uchar* destination, GrayWeights weights )
+///
+/// Converts an image to a one channel image. ARGB32 and RGB32 images are read directly,
+/// other formats are converted to ARGB32 first.
+///
+/// @param source
+///  The image to be converted.
+///
+/// @param destination
+///  The image that will store the resulting one channel image.
+///
+/// @param weights
+///  GRAY_AVERAGE to average the color components, GRAY_LUMA to weight them by luminance.
+///
+/// @return
+///  Nothing.
+///
+{
+	QImage converted;
+	const QImage* image = &source;
+	if( source.format() != QImage::Format_ARGB32 && source.format() != QImage::Format_RGB32 )
+	{
+		converted = source.convertToFormat( QImage::Format_ARGB32 );
+		image = &converted;
+	}
+
+	// Both formats store each pixel as blue, green, red and alpha (or unused) bytes
+	const KernelTable& kernels = CpuDispatch::Kernels();
+	const int width = image->width();
+	Parallel::For( image->height(), [&]( int first_row, int last_row )
+	{
+		for( int j = first_row; j < last_row; j++ )
+		{
+			if( weights == GRAY_LUMA )
+			{
+				kernels.ConvertToLuma( image->constScanLine( j ), destination + j*width, width );
+			}
+			else
+			{
+				kernels.ConvertToGray( image->constScanLine( j ), destination + j*width, width, 4, 3 );
+			}
+		}
+	} );
+}
+
+void
+ImageProcessing::ConvertFromOneChannel(const uchar *source, uchar *destination, int width, int height, int channels, int alpha_channel)
+///
+/// Converts a one channel image to a multichannel image by setting each color component to the pixel value of the one channel image,
+/// (except the alpha channel if there is one, which is set to 255).
+///
+/// @param source
+///  The image to be converted.
+///
+/// @param destination
+///  The image that will store the resulting multichannel image.
 ///
-/// @param edges
-///  The edges discovered by the canny operator
 /// @param width
 ///  The width of the image.
 ///
@@ -701,54 +1593,67 @@ ImageProcessing::CannyEdgeDetection( uchar* source, uchar* edges, int width, int
 ///  The height of the image.
 ///
 /// @param channels
-///  The number of color channels that the image contains.
+///  The number of color channels that the destination image will contain. 4 by default.
 ///
-/// @param gaussian_kernel_size
-///  The size of the gaussian kernel used to smooth the image. 5 by default.
+/// @param alpha_channel
+///  The index of the destination image's alpha channel. -1 if it has no alpha. 3 by default.
 ///
-/// @param sigma
-///  The sigma value of the gaussian kernel used to smooth the image. 1.5 by default.
+/// @return
+///  Nothing.
 ///
-/// @param max_threshold
-///  The maximum hysteresis threshold. Edge tracing begins if an edge is at least this intensity. 80 by default.
+{
+	const KernelTable& kernels = CpuDispatch::Kernels();
+	Parallel::For( height, [&]( int first_row, int last_row )
+	{
+		kernels.ConvertFromGray( source + first_row*width, destination + first_row*width*channels, ( last_row - first_row )*width, channels, alpha_channel );
+	} );
+}
+
+void
+ImageProcessing::ConvertToPlanes( const uchar* source, float* red, float* green, float* blue, int width, int height, float scale )
 ///
-/// @param min_threshold
-///  The minimum hysteresis threshold. Edge tracing ends if an edge drops below this intensity. 20 by default.
+/// Splits an ARGB32 image into separate red, green and blue planes of floats. Analysis that
+/// treats each color the same way runs on whole planes, without picking channels out of
+/// every pixel, and float planes take half the memory of doubles.
+///
+/// @param source
+///  The ARGB32 image to be converted.
+///
+/// @param red, green, blue
+///  The planes to store each color in.
+///
+/// @param width
+///  The width of the image.
+///
+/// @param height
+///  The height of the image.
+///
+/// @param scale
+///  Every value is multiplied by this, e.g. 1/255 for values from 0 to 1. 1 by default.
 ///
 /// @return
 ///  Nothing.
 ///
 {
-	uchar* smoothed = new uchar[width*height*channels];
-
-	// Apply a Gaussian blur with kernel size 5 to get rid of any noise
-	ImageProcessing::GaussianBlur( source, smoothed, width, height, channels, gaussian_kernel_size, sigma );
-
-	// Apply the sobel operator to the smoothed image to approximate the image gradients
-	uchar* gradient_magnitude = new uchar[width*height];
-	uchar* gradient_direction = new uchar[width*height];
-	ImageProcessing::SobelEdgeDetection( smoothed, gradient_magnitude, gradient_direction, width, height, channels );
-	delete [] smoothed;
-
-	// Apply nonmaximum supression to thin edges
-	NonmaximumSupression( gradient_magnitude, gradient_direction, edges, width, height );
-	delete [] gradient_magnitude;
-	delete [] gradient_direction;
-
-	// Apply hysteresis to minimize streaking
-	Hysteresis( edges, width, height, max_threshold, min_threshold );
+	const KernelTable& kernels = CpuDispatch::Kernels();
+	Parallel::For( height, [&]( int first_row, int last_row )
+	{
+		const int offset = first_row*width;
+		kernels.ConvertToPlanes( source + offset*4, red + offset, green + offset, blue + offset, ( last_row - first_row )*width, scale );
+	} );
 }
 
 void
-ImageProcessing::ConvertToOneChannel(uchar *source, uchar *destination, int width, int height, int channels, int alpha_channel)
+ImageProcessing::ConvertFromPlanes( const float* red, const float* green, const float* blue, uchar* destination, int width, int height, float scale )
 ///
-/// Converts a multichannel image to a one channel image by averaging each color component excluding the alpha channel.
+/// Interleaves red, green and blue planes of floats into an opaque ARGB32 image, rounding
+/// each value to the nearest byte and clipping it to 0 and 255.
 ///
-/// @param source
-///  The image to be converted.
+/// @param red, green, blue
+///  The planes of each color.
 ///
 /// @param destination
-///  The image that will store the resulting one channel image.
+///  The ARGB32 image to store the result in.
 ///
 /// @param width
 ///  The width of the image.
@@ -756,47 +1661,39 @@ ImageProcessing::ConvertToOneChannel(uchar *source, uchar *destination, int widt
 /// @param height
 ///  The height of the image.
 ///
-/// @param channels
-///  The number of color channels that the source image contains. 4 by default.
-///
-/// @param alpha_channel
-///  The index of the source image's alpha channel. -1 if it has no alpha. 3 by default.
+/// @param scale
+///  Every value is multiplied by this before rounding, e.g. 255 for values from 0 to 1. 1 by default.
 ///
 /// @return
 ///  Nothing.
 ///
 {
-	for( int j = 0; j < height; j++ )
+	const KernelTable& kernels = CpuDispatch::Kernels();
+	Parallel::For( height, [&]( int first_row, int last_row )
 	{
-		for( int i = 0; i < width; i++ )
-		{
-			double average = 0.0;
-			for( int c = 0; c < channels; c++ )
-			{
-				if( c%channels != alpha_channel || alpha_channel == -1) // don't include the alpha channel
-				{
-					average += source[j*width*channels + i*channels + c];
-				}
-			}
-			average /= alpha_channel == -1 ? channels : channels - 1;
-			if( average < 0 ) average = 0;
-			if( average > 255 ) average = 255;
-			destination[j*width + i] = average;
-		}
-	}
+		const int offset = first_row*width;
+		kernels.ConvertFromPlanes( red + offset, green + offset, blue + offset, destination + offset*4, ( last_row - first_row )*width, scale );
+	} );
 }
 
 void
-ImageProcessing::ConvertFromOneChannel(uchar *source, uchar *destination, int width, int height, int channels, int alpha_channel)
+ImageProcessing::ConvertToHsv( const uchar* source, short* hue, uchar* saturation, uchar* value, int width, int height )
 ///
-/// Converts a one channel image to a multichannel image by setting each color component to the pixel value of the one channel image,
-/// (except the alpha channel if there is one, which is set to 255).
+/// Converts an ARGB32 image to planes of hue, saturation and value, with the same values
+/// that QColor::toHsv() gives for each pixel, so loops that need the HSV color of many
+/// pixels can read it instead of building a QColor for each one.
 ///
 /// @param source
-///  The image to be converted.
+///  The ARGB32 image to be converted.
 ///
-/// @param destination
-///  The image that will store the resulting multichannel image.
+/// @param hue
+///  Stores the hue of each pixel, from 0 to 359, or -1 for grays which have no hue.
+///
+/// @param saturation
+///  Stores the saturation of each pixel, from 0 to 255.
+///
+/// @param value
+///  Stores the value of each pixel, from 0 to 255.
 ///
 /// @param width
 ///  The width of the image.
@@ -804,33 +1701,54 @@ ImageProcessing::ConvertFromOneChannel(uchar *source, uchar *destination, int wi
 /// @param height
 ///  The height of the image.
 ///
-/// @param channels
-///  The number of color channels that the destination image will contain. 4 by default.
+/// @return
+///  Nothing.
 ///
-/// @param alpha_channel
-///  The index of the destination image's alpha channel. -1 if it has no alpha. 3 by default.
+{
+	const KernelTable& kernels = CpuDispatch::Kernels();
+	Parallel::For( height, [&]( int first_row, int last_row )
+	{
+		const int offset = first_row*width;
+		kernels.ConvertToHsv( source + offset*4, hue + offset, saturation + offset, value + offset, ( last_row - first_row )*width );
+	} );
+}
+
+void
+ImageProcessing::QuantizeHue( const short* hue, const short* thresholds, int levels, uchar* positions, int width, int height )
+///
+/// Maps a plane of hues to the positions of a palette in one pass over the image, such as
+/// the position of the closest palette hue. The palette splits the color wheel at a set of
+/// thresholds, and the hues past the last threshold wrap back to the first position.
+///
+/// @param hue
+///  The hues to be mapped, from 0 to 359, or -1 for grays, which go to the first position.
+///
+/// @param thresholds
+///  The hue where each position after the first starts, then the hue where the wheel wraps
+///  back to the first position, in increasing order.
+///
+/// @param levels
+///  The number of thresholds, which is the number of positions in the palette.
+///
+/// @param positions
+///  Stores the palette position of each hue.
+///
+/// @param width
+///  The width of the image.
+///
+/// @param height
+///  The height of the image.
 ///
 /// @return
 ///  Nothing.
 ///
 {
-	for( int j = 0; j < height; j++ )
+	const KernelTable& kernels = CpuDispatch::Kernels();
+	Parallel::For( height, [&]( int first_row, int last_row )
 	{
-		for( int i = 0; i < width; i++ )
-		{
-			for( int c = 0; c < channels; c++ )
-			{
-				if( c%channels != alpha_channel || alpha_channel == -1 ) // don't include the alpha channel
-				{
-					destination[j*width*channels + i*channels + c] = source[j*width + i];
-				}
-				else
-				{
-					destination[j*width*channels + i*channels + c] = 255;
-				}
-			}
-		}
-	}
+		const int offset = first_row*width;
+		kernels.QuantizeHue( hue + offset, thresholds, levels, positions + offset, ( last_row - first_row )*width );
+	} );
 }
 
 void
@@ -860,20 +1778,12 @@ ImageProcessing::AddImages(uchar *image1, uchar *image2, uchar *result, int widt
 ///  Nothing.
 ///
 {
-	for( int j = 0; j < height; j++ )
+	const KernelTable& kernels = CpuDispatch::Kernels();
+	const int row_size = width*channels;
+	Parallel::For( height, [&]( int first_row, int last_row )
 	{
-		for( int i = 0; i < width; i++ )
-		{
-			for( int c = 0; c < channels; c++ )
-			{
-				int pixel = j*width*channels + i*channels + c;
-				int total = image1[pixel] + image2[pixel];
-				if( total < 0 ) total = 0;
-				if( total > 255 ) total = 255;
-				result[pixel] = total;
-			}
-		}
-	}
+		kernels.AddSaturate( image1 + first_row*row_size, image2 + first_row*row_size, result + first_row*row_size, ( last_row - first_row )*row_size );
+	} );
 }
 
 void
@@ -903,15 +1813,283 @@ ImageProcessing::AddImages(double *image1, double *image2, double *result, int w
 ///  Nothing.
 ///
 {
-	for( int j = 0; j < height; j++ )
+	const KernelTable& kernels = CpuDispatch::Kernels();
+	const int row_size = width*channels;
+	Parallel::For( height, [&]( int first_row, int last_row )
 	{
-		for( int i = 0; i < width; i++ )
+		kernels.AddDouble( image1 + first_row*row_size, image2 + first_row*row_size, result + first_row*row_size, ( last_row - first_row )*row_size );
+	} );
+}
+
+void
+ImageProcessing::GaussianNoise( uchar* destination, int width, int height, double mean, double deviation, quint64 seed, quint64 stream )
+///
+/// Fills a one channel image with normally distributed noise, clipped to 0 and 255. The
+/// noise at each pixel depends only on the seed, stream and pixel index, so it is the same
+/// whatever the number of threads.
+///
+/// @param destination
+///  The image to store the noise in.
+///
+/// @param width
+///  The width of the image.
+///
+/// @param height
+///  The height of the image.
+///
+/// @param mean
+///  The mean of the noise.
+///
+/// @param deviation
+///  The standard deviation of the noise.
+///
+/// @param seed
+///  The seed of the random numbers.
+///
+/// @param stream
+///  The random stream to draw from, see Random.
+///
+/// @return
+///  Nothing.
+///
+{
+	const KernelTable& kernels = CpuDispatch::Kernels();
+	const quint64 key = Random::StreamKey( seed, stream );
+	Parallel::For( height, [&]( int first_row, int last_row )
+	{
+		float* normal = new float[width];
+		for( int y = first_row; y < last_row; y++ )
 		{
-			for( int c = 0; c < channels; c++ )
+			kernels.GaussianNoise( key, (quint32)y*width, normal, width );
+			for( int x = 0; x < width; x++ )
+			{
+				double value = mean + deviation*normal[x];
+				destination[y*width + x] = value <= 0.0 ? 0 : ( value >= 255.0 ? 255 : (uchar)value );
+			}
+		}
+		delete [] normal;
+	} );
+}
+
+template <typename T> static void
+BuildSummedAreaTable( const T* values, qint64* table, int width, int height )
+///
+/// Shared implementation of the SummedAreaTable overloads. Rows are summed on their own
+/// first, then the row sums are added down each column, both spread over the thread pool.
+///
+{
+	const int table_width = width + 1;
+	for( int i = 0; i < table_width; i++ )
+	{
+		table[i] = 0;
+	}
+	Parallel::For( height, [&]( int first_row, int last_row )
+	{
+		for( int j = first_row; j < last_row; j++ )
+		{
+			qint64* table_row = table + ( j + 1 )*table_width;
+			qint64 total = 0;
+			table_row[0] = 0;
+			for( int i = 0; i < width; i++ )
+			{
+				total += values[j*width + i];
+				table_row[i + 1] = total;
+			}
+		}
+	} );
+	Parallel::For( table_width, [&]( int first_column, int last_column )
+	{
+		for( int j = 1; j < height; j++ )
+		{
+			const qint64* above = table + j*table_width;
+			qint64* table_row = table + ( j + 1 )*table_width;
+			for( int i = first_column; i < last_column; i++ )
 			{
-				int pixel = j*width*channels + i*channels + c;
-				result[pixel] = image1[pixel] + image2[pixel];
+				table_row[i] += above[i];
 			}
 		}
+	}, 64 );
+}
+
+void
+ImageProcessing::SummedAreaTable( const uchar* values, qint64* table, int width, int height )
+///
+/// Builds a summed-area table, where each entry holds the sum of every value above and to
+/// the left of it. The sum of any rectangle then takes four lookups, see RegionSum.
+///
+/// @param values
+///  A one channel image.
+///
+/// @param table
+///  Stores the table. Must hold (width + 1)*(height + 1) values: the first row and column are 0.
+///
+/// @param width
+///  The width of the image.
+///
+/// @param height
+///  The height of the image.
+///
+/// @return
+///  Nothing.
+///
+{
+	BuildSummedAreaTable( values, table, width, height );
+}
+
+void
+ImageProcessing::SummedAreaTable( const int* values, qint64* table, int width, int height )
+///
+/// Same as above, for an image of integer values.
+///
+{
+	BuildSummedAreaTable( values, table, width, height );
+}
+
+qint64
+ImageProcessing::RegionSum( const qint64* table, int width, int left, int top, int right, int bottom )
+///
+/// Sums a rectangle of an image from its summed-area table.
+///
+/// @param table
+///  The table made by SummedAreaTable.
+///
+/// @param width
+///  The width of the image (not the table).
+///
+/// @param left, top, right, bottom
+///  The rectangle, from left and top up to but not including right and bottom.
+///
+/// @return
+///  The sum of the values in the rectangle.
+///
+{
+	const int table_width = width + 1;
+	return table[bottom*table_width + right] - table[top*table_width + right] - table[bottom*table_width + left] + table[top*table_width + left];
+}
+
+template <typename T> static void
+WindowMaxima( const T* values, int stride, int count, int window, int first, int step, int anchors, T* maxima, int* indices, int output_stride, int* queue )
+///
+/// Finds the maximum of the windows [first + a*step, first + a*step + window) of a line of
+/// values (clipped to the line), keeping a queue of the positions that could still be a
+/// maximum. Values are only dropped from the back when a strictly larger one arrives, so
+/// the front is always the first of equal maxima. Each value is queued at most once.
+///
+{
+	int head = 0;
+	int tail = 0;
+	int next = 0;
+	for( int a = 0; a < anchors; a++ )
+	{
+		int begin = first + a*step;
+		int end = begin + window < count ? begin + window : count;
+		if( next < begin ) next = begin;
+		for( ; next < end; next++ )
+		{
+			while( tail > head && values[queue[tail - 1]*stride] < values[next*stride] ) tail--;
+			queue[tail++] = next;
+		}
+		while( tail > head && queue[head] < begin ) head++;
+
+		maxima[a*output_stride] = tail > head ? values[queue[head]*stride] : 0;
+		indices[a*output_stride] = tail > head ? queue[head] : begin;
 	}
-}
\ No newline at end of file
+}
+
+template <typename T> static void
+FindRegionMaxima( const T* values, int width, int height, int region_width, int region_height, int first_x, int first_y, int step_x, int step_y, int columns, int rows, T* maxima, int* positions )
+///
+/// Shared implementation of the RegionMaxima overloads. The maximum of each region is the
+/// maximum, over its rows, of the maximum of each row within the region. The first row
+/// holding the largest value wins, and within it the first column, which gives the first
+/// maximum in raster order.
+///
+{
+	T* row_maxima = new T[height*columns];
+	int* row_positions = new int[height*columns];
+	Parallel::For( height, [&]( int first_row, int last_row )
+	{
+		int* queue = new int[width];
+		for( int j = first_row; j < last_row; j++ )
+		{
+			WindowMaxima( values + j*width, 1, width, region_width, first_x, step_x, columns, row_maxima + j*columns, row_positions + j*columns, 1, queue );
+		}
+		delete [] queue;
+	} );
+
+	Parallel::For( columns, [&]( int first_column, int last_column )
+	{
+		int* queue = new int[height];
+		T* column_maxima = new T[rows];
+		int* rows_found = new int[rows];
+		for( int c = first_column; c < last_column; c++ )
+		{
+			WindowMaxima( row_maxima + c, columns, height, region_height, first_y, step_y, rows, column_maxima, rows_found, 1, queue );
+			for( int r = 0; r < rows; r++ )
+			{
+				int j = rows_found[r];
+				maxima[r*columns + c] = column_maxima[r];
+				positions[r*columns + c] = j*width + row_positions[j*columns + c];
+			}
+		}
+		delete [] column_maxima;
+		delete [] rows_found;
+		delete [] queue;
+	} );
+
+	delete [] row_maxima;
+	delete [] row_positions;
+}
+
+void
+ImageProcessing::RegionMaxima( const uchar* values, int width, int height, int region_width, int region_height, int first_x, int first_y, int step_x, int step_y, int columns, int rows, uchar* maxima, int* positions )
+///
+/// Finds the largest value, and where it is, in each region of a grid of equally sized
+/// regions. Regions may overlap and are clipped to the image. The cost is about two reads
+/// per pixel, however much the regions overlap.
+///
+/// @param values
+///  A one channel image.
+///
+/// @param width
+///  The width of the image.
+///
+/// @param height
+///  The height of the image.
+///
+/// @param region_width
+///  The width of each region.
+///
+/// @param region_height
+///  The height of each region.
+///
+/// @param first_x, first_y
+///  The top left corner of the first region.
+///
+/// @param step_x, step_y
+///  The distance between the corners of neighbouring regions.
+///
+/// @param columns, rows
+///  The number of regions across and down.
+///
+/// @param maxima
+///  Stores the largest value of each region (columns*rows of them, row by row).
+///
+/// @param positions
+///  Stores the index (y*width + x) of the first largest value of each region, in raster order.
+///
+/// @return
+///  Nothing.
+///
+{
+	FindRegionMaxima( values, width, height, region_width, region_height, first_x, first_y, step_x, step_y, columns, rows, maxima, positions );
+}
+
+void
+ImageProcessing::RegionMaxima( const int* values, int width, int height, int region_width, int region_height, int first_x, int first_y, int step_x, int step_y, int columns, int rows, int* maxima, int* positions )
+///
+/// Same as above, for an image of integer values.
+///
+{
+	FindRegionMaxima( values, width, height, region_width, region_height, first_x, first_y, step_x, step_y, columns, rows, maxima, positions );
+}
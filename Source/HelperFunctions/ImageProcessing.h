@@ -8,26 +8,111 @@
 class ImageProcessing
 {
 	public:
+		///
+		/// How the color channels are combined when converting to one channel.
+		/// GRAY_LUMA uses the same 0.3/0.59/0.11 weights as the brush strokes.
+		///
+		enum GrayWeights { GRAY_AVERAGE, GRAY_LUMA };
+
 		static double ColorDistance( QColor color1, QColor color2);
+		static int ColorDistance( QRgb color1, QRgb color2 );
 
-		static std::vector<QPoint> GetPoissonDisks(int width, int height, int minDist);
+		static std::vector<QPoint> GetToroidalPoissonDisks(int& size, int minDist, quint64 seed);
+		static std::vector<QPoint> GetToroidalPoissonDisksTiled(int& size, int minDist, quint64 seed);
 
-		static void HorizontalConvo( uchar* source, uchar* destination, int width, int height, int channels, double* kernel, int kernel_size );
-		static void VerticalConvo( uchar* source, uchar* destination, int width, int height, int channels, double* kernel, int kernel_size );
-		static void TwoDConvo( uchar* source, uchar* destination, int width, int height, int channels, double* kernel, int kernel_size );
+		static void HorizontalConvo( const uchar* source, uchar* destination, int width, int height, int channels, double* kernel, int kernel_size );
+		static void VerticalConvo( const uchar* source, uchar* destination, int width, int height, int channels, double* kernel, int kernel_size );
+		static void TwoDConvo( const uchar* source, uchar* destination, int width, int height, int channels, double* kernel, int kernel_size );
 
-		static void BoxBlur( uchar* source, uchar* destination, int width, int height, int channels, int kernel_size = 5 );
-		static void GaussianBlur( uchar* source, uchar* destination, int width, int height, int channels, int kernel_size = 5, double sigma = 1.5 );
+		static void BoxBlur( const uchar* source, uchar* destination, int width, int height, int channels, int kernel_size = 5 );
+		static void BoxBlurCascade( const uchar* source, uchar* destination, int width, int height, int channels, double sigma = 1.5, int passes = 3 );
+		static void GaussianBlur( const uchar* source, uchar* destination, int width, int height, int channels, int kernel_size = 5, double sigma = 1.5 );
+		static int GaussianKernelSize( int kernel_size, double sigma = 1.5 );
 
-		static void SobelEdgeDetection( uchar* source, uchar* gradient_magnitude, int width, int height, int channels );
-		static void SobelEdgeDetection( uchar* source, uchar* gradient_magnitude, uchar* gradient_direction, int width, int height, int channels );
-		static void CannyEdgeDetection( uchar* source, uchar* edges, int width, int height, int channels, int gaussian_kernel_size = 5, double sigma = 1.5, int max_threshold = 80, int min_threshold = 20 );
+		static void SobelGradients( const uchar* gray, short* gradient_x, short* gradient_y, uchar* gradient_magnitude, uchar* gradient_direction, int width, int height, bool l2_magnitude = false );
+		static void SobelEdgeDetection( const uchar* source, uchar* gradient_magnitude, int width, int height, int channels );
+		static void SobelEdgeDetection( const uchar* source, uchar* gradient_magnitude, uchar* gradient_direction, int width, int height, int channels );
+		static void CannyEdgeDetection( const uchar* source, uchar* edges, int width, int height, int channels, int gaussian_kernel_size = 5, double sigma = 1.5, int max_threshold = 80, int min_threshold = 20 );
 
-		static void ConvertToOneChannel( uchar* source, uchar* destination, int width, int height, int channels = 4, int alpha_channel = 3);
-		static void ConvertFromOneChannel( uchar* source, uchar* destination, int width, int height, int channels = 4, int alpha_channel = 3);
+		static void ConvertToOneChannel( const uchar* source, uchar* destination, int width, int height, int channels = 4, int alpha_channel = 3);
+		static void ConvertToOneChannel( const QImage& source, uchar* destination, GrayWeights weights = GRAY_AVERAGE );
+		static void ConvertFromOneChannel( const uchar* source, uchar* destination, int width, int height, int channels = 4, int alpha_channel = 3);
+		static void ConvertToPlanes( const uchar* source, float* red, float* green, float* blue, int width, int height, float scale = 1.0f );
+		static void ConvertFromPlanes( const float* red, const float* green, const float* blue, uchar* destination, int width, int height, float scale = 1.0f );
+		static void ConvertToHsv( const uchar* source, short* hue, uchar* saturation, uchar* value, int width, int height );
+		static QRgb HsvToRgb( int hue, int saturation, int value );
+		static void QuantizeHue( const short* hue, const short* thresholds, int levels, uchar* positions, int width, int height );
 
 		static void AddImages(uchar* image1, uchar* image2, uchar* result, int width, int height, int channels = 4);
 		static void AddImages(double* image1, double* image2, double* result, int width, int height, int channels = 4);
+
+		static void GaussianNoise( uchar* destination, int width, int height, double mean, double deviation, quint64 seed, quint64 stream );
+
+		static void SummedAreaTable( const uchar* values, qint64* table, int width, int height );
+		static void SummedAreaTable( const int* values, qint64* table, int width, int height );
+		static qint64 RegionSum( const qint64* table, int width, int left, int top, int right, int bottom );
+		static void RegionMaxima( const uchar* values, int width, int height, int region_width, int region_height, int first_x, int first_y, int step_x, int step_y, int columns, int rows, uchar* maxima, int* positions );
+		static void RegionMaxima( const int* values, int width, int height, int region_width, int region_height, int first_x, int first_y, int step_x, int step_y, int columns, int rows, int* maxima, int* positions );
 };
 
-#endif
\ No newline at end of file
+inline QRgb
+ImageProcessing::HsvToRgb( int hue, int saturation, int value )
+///
+/// Converts a color from HSV to RGB, giving exactly the color that QColor::setHsv() and
+/// rgb() would in Qt 5. QColor works in floating point with 16 bit channels and narrows
+/// them to 8 bits by dividing by 257 with rounding; here the same roundings are done on
+/// exact integer fractions.
+///
+/// @param hue
+///  The hue, from 0 to 359, or -1 for a gray. Hues of 360 and above wrap around.
+///
+/// @param saturation
+///  The saturation, from 0 to 255.
+///
+/// @param value
+///  The value, from 0 to 255.
+///
+/// @return
+///  The opaque RGB color.
+///
+{
+	if( saturation == 0 || hue == -1 )
+	{
+		return qRgb( value, value, value );
+	}
+
+	// Each channel is v times a fraction, rounded to 16 bits and then divided by 257
+	hue %= 360;
+	const int fraction = hue%60;
+	const quint32 v = value*257;
+	const quint32 lowest = 2*v*( 255 - saturation ) + 255;
+	const quint32 falling = 2*v*( 15300 - saturation*fraction ) + 15300;
+	const quint32 rising = 2*v*( 15300 - saturation*( 60 - fraction ) ) + 15300;
+
+	// QColor's floating point rounds a channel that is exactly halfway between two 16 bit
+	// values either way, so the few colors with one are left to QColor
+	if( lowest%( 2*255 ) == 0 || falling%( 2*15300 ) == 0 || rising%( 2*15300 ) == 0 )
+	{
+		QColor color;
+		color.setHsv( hue, saturation, value );
+		return color.rgb();
+	}
+
+	const int low16 = lowest/( 2*255 );
+	const int fall16 = falling/( 2*15300 );
+	const int rise16 = rising/( 2*15300 );
+	const int low = ( low16 + 128 - ( ( low16 + 128 ) >> 8 ) ) >> 8;
+	const int fall = ( fall16 + 128 - ( ( fall16 + 128 ) >> 8 ) ) >> 8;
+	const int rise = ( rise16 + 128 - ( ( rise16 + 128 ) >> 8 ) ) >> 8;
+	switch( hue/60 )
+	{
+		case 0: return qRgb( value, rise, low );
+		case 1: return qRgb( fall, value, low );
+		case 2: return qRgb( low, value, rise );
+		case 3: return qRgb( low, fall, value );
+		case 4: return qRgb( rise, low, value );
+		default: return qRgb( value, low, fall );
+	}
+}
+
+#endif
@@ -0,0 +1,152 @@
+#ifndef _IMAGE_VIEW_H_
+#define _IMAGE_VIEW_H_
+
+#include <QtWidgets>
+#include <string.h>
+
+#include "ScratchArena.h"
+
+///
+/// A view of the pixels of an image: a pointer to the first row, the size, and the distance
+/// between rows (the stride, counted in values of T). Views don't own their pixels and are
+/// cheap to copy. Rows are reached with Row(), so the loops over them do no bounds or format
+/// checks, unlike QImage::pixel() and setPixel().
+///
+/// A 32 bit QImage can be viewed as four uchar channels, or as one QRgb per pixel. Views of
+/// a const QImage are read only and never detach it. Planes allocated with Allocate have
+/// every row aligned to a cache line.
+///
+template <typename T, int Channels>
+class ImageView
+{
+	public:
+		ImageView();
+		ImageView( T* data, int width, int height, int stride );
+		explicit ImageView( const QImage& image );
+		explicit ImageView( QImage* image );
+
+		static ImageView Allocate( ScratchArena& scratch, int width, int height );
+
+		int Width() const { return mWidth; }
+		int Height() const { return mHeight; }
+		int Stride() const { return mStride; }
+		bool IsPacked() const { return mStride == mWidth*Channels; }
+
+		T* Data() const { return mData; }
+		T* Row( int y ) const { return mData + (size_t)y*mStride; }
+		T* Pixel( int x, int y ) const { return mData + (size_t)y*mStride + x*Channels; }
+
+		void Clear() const;
+
+	private:
+		T* mData;
+		int mWidth;
+		int mHeight;
+		int mStride;
+};
+
+///
+/// The alignment of the rows of planes made by ImageView::Allocate.
+///
+static const int IMAGE_VIEW_ROW_ALIGNMENT = 64;
+
+template <typename T, int Channels> inline
+ImageView<T, Channels>::ImageView()
+///
+/// Constructor. An empty view.
+///
+: mData( NULL ), mWidth( 0 ), mHeight( 0 ), mStride( 0 )
+{
+}
+
+template <typename T, int Channels> inline
+ImageView<T, Channels>::ImageView( T* data, int width, int height, int stride )
+///
+/// Constructor.
+///
+/// @param data
+///  The first value of the first row.
+///
+/// @param width
+///  The width of the image in pixels.
+///
+/// @param height
+///  The height of the image.
+///
+/// @param stride
+///  The distance from one row to the next, in values of T.
+///
+: mData( data ), mWidth( width ), mHeight( height ), mStride( stride )
+{
+}
+
+template <typename T, int Channels> inline
+ImageView<T, Channels>::ImageView( const QImage& image )
+///
+/// Constructor. A read only view of a 32 bit image, which is not detached or copied.
+///
+/// @param image
+///  The image. Must be in a 32 bit format such as QImage::Format_ARGB32.
+///
+: mData( reinterpret_cast<T*>( image.constBits() ) ),
+  mWidth( image.width() ),
+  mHeight( image.height() ),
+  mStride( image.bytesPerLine()/(int)sizeof(T) )
+{
+	Q_ASSERT( image.depth() == 32 && image.depth() == (int)sizeof(T)*Channels*8 );
+}
+
+template <typename T, int Channels> inline
+ImageView<T, Channels>::ImageView( QImage* image )
+///
+/// Constructor. A view of a 32 bit image that can be written to. The image is detached
+/// first if its pixels are shared with another image.
+///
+/// @param image
+///  The image. Must be in a 32 bit format such as QImage::Format_ARGB32.
+///
+: mData( reinterpret_cast<T*>( image->bits() ) ),
+  mWidth( image->width() ),
+  mHeight( image->height() ),
+  mStride( image->bytesPerLine()/(int)sizeof(T) )
+{
+	Q_ASSERT( image->depth() == 32 && image->depth() == (int)sizeof(T)*Channels*8 );
+}
+
+template <typename T, int Channels> inline ImageView<T, Channels>
+ImageView<T, Channels>::Allocate( ScratchArena& scratch, int width, int height )
+///
+/// Allocates a plane from a scratch arena, with each row padded out to a cache line.
+/// The values are not initialized.
+///
+/// @param scratch
+///  The arena to allocate from. The plane lives until it is released from the arena.
+///
+/// @param width
+///  The width of the plane in pixels.
+///
+/// @param height
+///  The height of the plane.
+///
+/// @return
+///  A view of the plane.
+///
+{
+	const int row_values = IMAGE_VIEW_ROW_ALIGNMENT/(int)sizeof(T);
+	const int stride = ( width*Channels + row_values - 1 )/row_values*row_values;
+	return ImageView( scratch.Allocate<T>( (size_t)stride*height ), width, height, stride );
+}
+
+template <typename T, int Channels> inline void
+ImageView<T, Channels>::Clear() const
+///
+/// Sets every value of the image, including any padding between rows, to zero.
+///
+{
+	if( mHeight > 0 )
+	{
+		memset( mData, 0, ( (size_t)( mHeight - 1 )*mStride + mWidth*Channels )*sizeof(T) );
+	}
+}
+
+#endif
@@ -0,0 +1,149 @@
+#include "NoiseCache.h"
+#include "ImageProcessing.h"
+#include "Parallel.h"
+
+#include <deque>
+#include <map>
+#include <string.h>
+
+///
+/// The number of textures kept. Each job usually has its own seed, so older ones are dropped.
+///
+static const size_t MAX_TEXTURES = 4;
+
+///
+/// The random stream textures are drawn from, and the spread of the noise: a mean and standard
+/// deviation of half the range, the same as the glass pattern noise made per pixel.
+///
+static const quint64 TEXTURE_RANDOM_STREAM = 3;
+static const double TEXTURE_MEAN = 127.5;
+static const double TEXTURE_DEVIATION = 127.5;
+
+static QMutex textures_mutex;
+
+bool
+NoiseCache::TextureKey::operator<( const TextureKey& other ) const
+{
+	if( size != other.size ) return size < other.size;
+	if( kernel_size != other.kernel_size ) return kernel_size < other.kernel_size;
+	return seed < other.seed;
+}
+
+void
+NoiseCache::GetBlurredNoise( uchar* destination, int width, int height, int texture_size, int kernel_size, quint64 seed )
+///
+/// Fills a one channel image with blurred Gaussian noise by tiling a cached texture over it.
+///
+/// @param destination
+///  The image to store the noise in.
+///
+/// @param width
+///  The width of the image.
+///
+/// @param height
+///  The height of the image.
+///
+/// @param texture_size
+///  The width and height of the texture. Larger textures repeat less often.
+///
+/// @param kernel_size
+///  The size of the Gaussian blur applied to the noise.
+///
+/// @param seed
+///  The seed of the random numbers.
+///
+/// @return
+///  Nothing.
+///
+{
+	TextureKey key = { texture_size, kernel_size, seed };
+	boost::shared_ptr< std::vector<uchar> > texture = GetTexture( key );
+	const uchar* pixels = &(*texture)[0];
+
+	Parallel::For( height, [&]( int first_row, int last_row )
+	{
+		for( int y = first_row; y < last_row; y++ )
+		{
+			const uchar* texture_row = pixels + ( y%texture_size )*texture_size;
+			for( int x = 0; x < width; x += texture_size )
+			{
+				memcpy( destination + y*width + x, texture_row, width - x < texture_size ? width - x : texture_size );
+			}
+		}
+	} );
+}
+
+boost::shared_ptr< std::vector<uchar> >
+NoiseCache::GetTexture( const TextureKey& key )
+///
+/// Finds a texture, making it if it isn't cached yet. Callers share the texture, so it stays
+/// valid while they use it even if it is dropped from the cache.
+///
+/// @param key
+///  The size, blur and seed of the texture.
+///
+/// @return
+///  The texture.
+///
+{
+	static std::map< TextureKey, boost::shared_ptr< std::vector<uchar> > > textures;
+	static std::deque<TextureKey> order;
+
+	QMutexLocker locker( &textures_mutex );
+	std::map< TextureKey, boost::shared_ptr< std::vector<uchar> > >::iterator found = textures.find( key );
+	if( found != textures.end() ) return found->second;
+
+	boost::shared_ptr< std::vector<uchar> > texture = MakeTexture( key );
+	textures[key] = texture;
+	order.push_back( key );
+	if( order.size() > MAX_TEXTURES )
+	{
+		textures.erase( order.front() );
+		order.pop_front();
+	}
+	return texture;
+}
+
+boost::shared_ptr< std::vector<uchar> >
+NoiseCache::MakeTexture( const TextureKey& key )
+///
+/// Makes a texture of noise and blurs it as if it wrapped around: the noise is padded with
+/// copies of its opposite edges before blurring, so the texture tiles without seams.
+///
+/// @param key
+///  The size, blur and seed of the texture.
+///
+/// @return
+///  The texture.
+///
+{
+	const int size = key.size;
+	const int half = key.kernel_size/2 < size ? key.kernel_size/2 : size;
+	const int padded_size = size + 2*half;
+
+	uchar* noise = new uchar[size*size];
+	ImageProcessing::GaussianNoise( noise, size, size, TEXTURE_MEAN, TEXTURE_DEVIATION, key.seed, TEXTURE_RANDOM_STREAM );
+
+	uchar* padded = new uchar[padded_size*padded_size];
+	for( int j = 0; j < padded_size; j++ )
+	{
+		const uchar* noise_row = noise + ( ( j - half + size )%size )*size;
+		for( int i = 0; i < padded_size; i++ )
+		{
+			padded[j*padded_size + i] = noise_row[( i - half + size )%size];
+		}
+	}
+	delete [] noise;
+
+	uchar* blurred = new uchar[padded_size*padded_size];
+	ImageProcessing::GaussianBlur( padded, blurred, padded_size, padded_size, 1, key.kernel_size );
+	delete [] padded;
+
+	boost::shared_ptr< std::vector<uchar> > texture( new std::vector<uchar>( size*size ) );
+	for( int j = 0; j < size; j++ )
+	{
+		memcpy( &(*texture)[j*size], blurred + ( j + half )*padded_size + half, size );
+	}
+	delete [] blurred;
+	return texture;
+}
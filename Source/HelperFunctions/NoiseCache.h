@@ -0,0 +1,33 @@
+#ifndef _NOISE_CACHE_H_
+#define _NOISE_CACHE_H_
+
+#include <QtWidgets>
+#include <vector>
+#include <boost/shared_ptr.hpp>
+
+///
+/// Keeps square textures of blurred Gaussian noise that wrap around at the edges, keyed by
+/// their size, blur and seed. A canvas of any size is filled by tiling a texture, which is
+/// much cheaper than making and blurring noise for every pixel. Textures are only kept in
+/// memory, and only the few most recently made ones.
+///
+class NoiseCache
+{
+	public:
+		static void GetBlurredNoise( uchar* destination, int width, int height, int texture_size, int kernel_size, quint64 seed );
+
+	private:
+		struct TextureKey
+		{
+			int size;
+			int kernel_size;
+			quint64 seed;
+
+			bool operator<( const TextureKey& other ) const;
+		};
+
+		static boost::shared_ptr< std::vector<uchar> > GetTexture( const TextureKey& key );
+		static boost::shared_ptr< std::vector<uchar> > MakeTexture( const TextureKey& key );
+};
+
+#endif
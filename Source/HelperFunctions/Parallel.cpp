@@ -0,0 +1,140 @@
+#include "Parallel.h"
+
+///
+/// The default number of items (rows or columns) below which a band isn't worth a thread.
+///
+static const int DEFAULT_GRAIN_SIZE = 16;
+
+///
+/// How many bands are made per thread, so threads that finish early can pick up more work.
+///
+static const int BANDS_PER_THREAD = 4;
+
+static QAtomicInt grain_size( DEFAULT_GRAIN_SIZE );
+
+class ParallelHelperTask : public QRunnable
+///
+/// Lets a pool thread take tasks from a job until none are left.
+///
+{
+	public:
+		ParallelHelperTask( const boost::shared_ptr<Parallel::Job>& job, void (*work)( Parallel::Job* ) )
+		: mJob( job ), mWork( work )
+		{
+		}
+
+		void run()
+		{
+			mWork( mJob.get() );
+		}
+
+	private:
+		boost::shared_ptr<Parallel::Job> mJob;
+		void (*mWork)( Parallel::Job* );
+};
+
+QThreadPool*
+Parallel::Pool()
+///
+/// @return
+///  The thread pool shared by all image processing work.
+///
+{
+	return QThreadPool::globalInstance();
+}
+
+int
+Parallel::GrainSize()
+///
+/// @return
+///  The default grain size used by For.
+///
+{
+	return grain_size.loadAcquire();
+}
+
+void
+Parallel::SetGrainSize( int grain )
+///
+/// Sets the default grain size used by For. Larger grains mean fewer, bigger bands.
+///
+/// @param grain
+///  The smallest number of items worth giving to a thread.
+///
+/// @return
+///  Nothing.
+///
+{
+	grain_size.storeRelease( grain < 1 ? 1 : grain );
+}
+
+int
+Parallel::BandCount( int count, int grain )
+///
+/// Works out how many bands For splits a range into.
+///
+/// @param count
+///  The number of items to process.
+///
+/// @param grain
+///  The smallest number of items worth giving to a thread. 0 uses GrainSize().
+///
+/// @return
+///  The number of bands, at least 1.
+///
+{
+	if( grain <= 0 ) grain = GrainSize();
+
+	int threads = Pool()->maxThreadCount();
+	if( threads <= 1 || count <= grain ) return 1;
+
+	int bands = count/grain;
+	if( bands > threads*BANDS_PER_THREAD ) bands = threads*BANDS_PER_THREAD;
+	return bands < 1 ? 1 : bands;
+}
+
+void
+Parallel::Work( Job* job )
+///
+/// Runs tasks of a job until there are none left to claim.
+///
+/// @param job
+///  The job to work on.
+///
+/// @return
+///  Nothing.
+///
+{
+	for( ;; )
+	{
+		int task = job->mNext.fetchAndAddOrdered( 1 );
+		if( task >= job->mTasks ) break;
+		job->RunTask( task );
+		job->mDone.release();
+	}
+}
+
+void
+Parallel::Run( const boost::shared_ptr<Job>& job )
+///
+/// Starts helpers for a job on the pool, works on it from the calling thread and
+/// waits for every task to finish. The caller only ever waits on tasks that are
+/// already running, so nested calls from inside a pool thread can't deadlock.
+///
+/// @param job
+///  The job to run.
+///
+/// @return
+///  Nothing.
+///
+{
+	int helpers = Pool()->maxThreadCount() - 1;
+	if( helpers > job->mTasks - 1 ) helpers = job->mTasks - 1;
+	for( int i = 0; i < helpers; i++ )
+	{
+		Pool()->start( new ParallelHelperTask( job, Work ) );
+	}
+
+	Work( job.get() );
+	job->mDone.acquire( job->mTasks );
+}
@@ -0,0 +1,123 @@
+#ifndef _PARALLEL_H_
+#define _PARALLEL_H_
+
+#include <QtWidgets>
+#include <boost/shared_ptr.hpp>
+
+///
+/// Runs image processing work on the process-wide thread pool. Work is split into
+/// contiguous bands (of rows, columns or pixels) that never overlap, so every output
+/// value is computed by exactly one thread with the same code as the serial loop and
+/// the result does not depend on how many threads there are. The calling thread works
+/// on bands as well and only returns once all of them are done.
+///
+class Parallel
+{
+	public:
+		static QThreadPool* Pool();
+
+		static int GrainSize();
+		static void SetGrainSize( int grain );
+
+		static int BandCount( int count, int grain = 0 );
+
+		template <typename Body> static void For( int count, const Body& body, int grain = 0 );
+		template <typename Body> static void ForEach( int tasks, const Body& body );
+
+	private:
+		friend class ParallelHelperTask;
+
+		///
+		/// The shared state of one ForEach call. Helper threads hold on to it until
+		/// they are done, so it outlives the call if a helper starts late.
+		///
+		class Job
+		{
+			public:
+				Job( int tasks ) : mTasks( tasks ), mNext( 0 ) {}
+				virtual ~Job() {}
+				virtual void RunTask( int task ) = 0;
+
+				int mTasks;
+				QAtomicInt mNext;
+				QSemaphore mDone;
+		};
+
+		template <typename Body> class BodyJob : public Job
+		{
+			public:
+				BodyJob( int tasks, const Body& body ) : Job( tasks ), mBody( body ) {}
+				void RunTask( int task ) { mBody( task ); }
+
+			private:
+				const Body& mBody;
+		};
+
+		template <typename Body> class BandBody
+		{
+			public:
+				BandBody( int count, int bands, const Body& body ) : mCount( count ), mBands( bands ), mBody( body ) {}
+				void operator()( int band ) const { mBody( (int)( (qint64)band*mCount/mBands ), (int)( (qint64)( band + 1 )*mCount/mBands ) ); }
+
+			private:
+				int mCount;
+				int mBands;
+				const Body& mBody;
+		};
+
+		static void Run( const boost::shared_ptr<Job>& job );
+		static void Work( Job* job );
+};
+
+template <typename Body> void
+Parallel::For( int count, const Body& body, int grain )
+///
+/// Splits the range [0, count) into contiguous bands and calls body( first, last ) once for each.
+///
+/// @param count
+///  The number of items (usually rows) to process.
+///
+/// @param body
+///  The work to do for the items first to last - 1.
+///
+/// @param grain
+///  The smallest number of items worth giving to a thread. 0 uses GrainSize().
+///
+/// @return
+///  Nothing.
+///
+{
+	int bands = BandCount( count, grain );
+	if( bands == 1 )
+	{
+		body( 0, count );
+		return;
+	}
+	ForEach( bands, BandBody<Body>( count, bands, body ) );
+}
+
+template <typename Body> void
+Parallel::ForEach( int tasks, const Body& body )
+///
+/// Calls body( task ) for every task from 0 to tasks - 1, spread over the thread pool.
+///
+/// @param tasks
+///  The number of tasks.
+///
+/// @param body
+///  The work to do for one task.
+///
+/// @return
+///  Nothing.
+///
+{
+	if( tasks <= 0 ) return;
+	if( tasks == 1 )
+	{
+		body( 0 );
+		return;
+	}
+	Run( boost::shared_ptr<Job>( new BodyJob<Body>( tasks, body ) ) );
+}
+
+#endif
@@ -0,0 +1,1209 @@
+#include "PixelKernels.h"
+#include "CpuDispatch.h"
+#include <math.h>
+#include <string.h>
+
+#ifdef SIMD_X86
+#include <immintrin.h>
+#endif
+
+///
+/// A sum of three 8 bit values times GRAY_RECIPROCAL, shifted right by 16, is exactly the sum divided by 3.
+///
+static const int GRAY_RECIPROCAL = 21846;
+
+///
+/// Luma weights of 0.3, 0.59 and 0.11 in 15 bit fixed-point. They add up to exactly 1 so white stays white.
+///
+static const int LUMA_RED = 9830;
+static const int LUMA_GREEN = 19333;
+static const int LUMA_BLUE = 3605;
+static const int LUMA_SHIFT = 15;
+
+///
+/// QColor keeps hues in hundredths of a degree, 6000 to each sixth of the color wheel, and
+/// saturations out of 65535 before dividing them down to 8 bits.
+///
+static const int HSV_SECTOR = 6000;
+static const int HSV_FULL_CIRCLE = 36000;
+static const int HSV_SATURATION_SCALE = 65535;
+
+static inline int
+DivideBy257( int value )
+///
+/// Narrows a 16 bit channel to 8 bits the way Qt 5's QColor does, dividing by 257 and
+/// rounding to the nearest.
+///
+{
+	value += 128;
+	return ( value - ( value >> 8 ) ) >> 8;
+}
+
+///
+/// Gaussian noise is made with the Box-Muller transform from two 24 bit uniform numbers per
+/// pair of values. Each uniform number is a hash of its index (two rounds of the lowbias32
+/// mixer keyed by the stream key), so every value can be computed on its own and in any order.
+/// The logarithm and sine/cosine are short polynomials that every version evaluates with the
+/// same float operations in the same order, so the vector versions match the scalar one exactly.
+///
+static const quint32 NOISE_HASH_FIRST = 0x7feb352d;
+static const quint32 NOISE_HASH_SECOND = 0x846ca68b;
+static const float NOISE_UNIT = 1.0f/16777216.0f;
+static const float NOISE_LN2 = 0.693147180559945f;
+static const float NOISE_HALF_PI = 1.57079632679490f;
+static const float NOISE_LOG_SERIES[4] = { 1.0f/9.0f, 1.0f/7.0f, 1.0f/5.0f, 1.0f/3.0f };
+static const float NOISE_SINE_SERIES[4] = { 1.0f/362880.0f, -1.0f/5040.0f, 1.0f/120.0f, -1.0f/6.0f };
+static const float NOISE_COSINE_SERIES[5] = { -1.0f/3628800.0f, 1.0f/40320.0f, -1.0f/720.0f, 1.0f/24.0f, -0.5f };
+
+static inline quint32
+NoiseMix( quint32 x )
+{
+	x ^= x >> 16;
+	x *= NOISE_HASH_FIRST;
+	x ^= x >> 15;
+	x *= NOISE_HASH_SECOND;
+	return x ^ ( x >> 16 );
+}
+
+static inline quint32
+NoiseHash( quint32 index, quint32 key_low, quint32 key_high )
+{
+	return NoiseMix( NoiseMix( index ^ key_low ) ^ key_high );
+}
+
+static inline float
+NoiseLog( float u )
+///
+/// Natural logarithm of a number in (0, 1], from its exponent and the atanh series of its mantissa.
+///
+{
+	quint32 bits;
+	memcpy( &bits, &u, sizeof( bits ) );
+	float exponent = (float)( (int)( bits >> 23 ) - 127 );
+	bits = ( bits & 0x7fffff ) | 0x3f800000;
+	float mantissa;
+	memcpy( &mantissa, &bits, sizeof( mantissa ) );
+
+	float t = ( mantissa - 1.0f )/( mantissa + 1.0f );
+	float t2 = t*t;
+	float series = t2*NOISE_LOG_SERIES[0] + NOISE_LOG_SERIES[1];
+	series = series*t2 + NOISE_LOG_SERIES[2];
+	series = series*t2 + NOISE_LOG_SERIES[3];
+	series = series*t2 + 1.0f;
+	return exponent*NOISE_LN2 + 2.0f*t*series;
+}
+
+static inline void
+NoisePair( quint32 pair, quint32 key_low, quint32 key_high, float& first, float& second )
+///
+/// The two normally distributed values of a pair.
+///
+{
+	quint32 first_bits = NoiseHash( 2*pair, key_low, key_high );
+	quint32 second_bits = NoiseHash( 2*pair + 1, key_low, key_high );
+	float u1 = (float)(int)( ( first_bits >> 8 ) + 1 )*NOISE_UNIT;
+	float u2 = (float)(int)( second_bits >> 8 )*NOISE_UNIT;
+	float radius = sqrtf( -2.0f*NoiseLog( u1 ) );
+
+	// The angle is split into a quadrant and an angle within it, where the series are accurate
+	float quarter = u2*4.0f;
+	int quadrant = (int)quarter;
+	float a = ( quarter - (float)quadrant )*NOISE_HALF_PI;
+	float a2 = a*a;
+	float sine = a2*NOISE_SINE_SERIES[0] + NOISE_SINE_SERIES[1];
+	sine = sine*a2 + NOISE_SINE_SERIES[2];
+	sine = sine*a2 + NOISE_SINE_SERIES[3];
+	sine = ( sine*a2 + 1.0f )*a;
+	float cosine = a2*NOISE_COSINE_SERIES[0] + NOISE_COSINE_SERIES[1];
+	cosine = cosine*a2 + NOISE_COSINE_SERIES[2];
+	cosine = cosine*a2 + NOISE_COSINE_SERIES[3];
+	cosine = cosine*a2 + NOISE_COSINE_SERIES[4];
+	cosine = cosine*a2 + 1.0f;
+
+	float x = quadrant & 1 ? sine : cosine;
+	float y = quadrant & 1 ? cosine : sine;
+	if( ( quadrant + 1 ) & 2 ) x = -x;
+	if( quadrant & 2 ) y = -y;
+	first = radius*x;
+	second = radius*y;
+}
+
+void
+PixelKernels::ConvertToGrayScalar( const uchar* source, uchar* destination, int count, int channels, int alpha_channel )
+///
+/// Averages the color components of each pixel, excluding the alpha channel.
+///
+/// @param source
+///  The interleaved pixels to be converted.
+///
+/// @param destination
+///  Stores one value per pixel.
+///
+/// @param count
+///  The number of pixels to convert.
+///
+/// @param channels
+///  The number of channels per source pixel.
+///
+/// @param alpha_channel
+///  The index of the alpha channel. -1 if there is no alpha.
+///
+/// @return
+///  Nothing.
+///
+{
+	int divisor = alpha_channel >= 0 && alpha_channel < channels ? channels - 1 : channels;
+	for( int i = 0; i < count; i++ )
+	{
+		int total = 0;
+		for( int c = 0; c < channels; c++ )
+		{
+			if( c != alpha_channel ) total += source[i*channels + c];
+		}
+		destination[i] = (uchar)( total/divisor );
+	}
+}
+
+void
+PixelKernels::AddSaturateScalar( const uchar* first, const uchar* second, uchar* result, int count )
+///
+/// Adds two arrays of bytes, clipping the results at 255.
+///
+/// @param first
+///  The first array to be added.
+///
+/// @param second
+///  The second array to be added.
+///
+/// @param result
+///  Stores the sums. May be the same as either input.
+///
+/// @param count
+///  The number of bytes to add.
+///
+/// @return
+///  Nothing.
+///
+{
+	for( int i = 0; i < count; i++ )
+	{
+		int total = first[i] + second[i];
+		result[i] = total > 255 ? 255 : (uchar)total;
+	}
+}
+
+void
+PixelKernels::ConvertToLumaScalar( const uchar* source, uchar* destination, int count )
+///
+/// Converts pixels to gray with the 0.3/0.59/0.11 luma weights. The pixels are in the
+/// byte order of QImage::Format_ARGB32 and Format_RGB32 (blue, green, red, alpha).
+///
+/// @param source
+///  The pixels to be converted, 4 bytes each.
+///
+/// @param destination
+///  Stores one value per pixel.
+///
+/// @param count
+///  The number of pixels to convert.
+///
+/// @return
+///  Nothing.
+///
+{
+	for( int i = 0; i < count; i++ )
+	{
+		const uchar* pixel = source + i*4;
+		destination[i] = (uchar)( ( pixel[2]*LUMA_RED + pixel[1]*LUMA_GREEN + pixel[0]*LUMA_BLUE ) >> LUMA_SHIFT );
+	}
+}
+
+void
+PixelKernels::ConvertFromGrayScalar( const uchar* source, uchar* destination, int count, int channels, int alpha_channel )
+///
+/// Copies each gray value to every color channel of a pixel, setting the alpha channel to 255.
+///
+/// @param source
+///  One value per pixel.
+///
+/// @param destination
+///  Stores the interleaved pixels.
+///
+/// @param count
+///  The number of pixels to convert.
+///
+/// @param channels
+///  The number of channels per destination pixel.
+///
+/// @param alpha_channel
+///  The index of the alpha channel. -1 if there is no alpha.
+///
+/// @return
+///  Nothing.
+///
+{
+	for( int i = 0; i < count; i++ )
+	{
+		for( int c = 0; c < channels; c++ )
+		{
+			destination[i*channels + c] = c == alpha_channel ? 255 : source[i];
+		}
+	}
+}
+
+void
+PixelKernels::ConvertToPlanesScalar( const uchar* source, float* red, float* green, float* blue, int count, float scale )
+///
+/// Splits ARGB32 pixels into separate red, green and blue planes of floats. The alpha
+/// channel is dropped.
+///
+/// @param source
+///  The ARGB32 pixels (blue, green, red and alpha in memory) to be converted.
+///
+/// @param red, green, blue
+///  Store one value per pixel for each color.
+///
+/// @param count
+///  The number of pixels to convert.
+///
+/// @param scale
+///  Every value is multiplied by this, e.g. 1/255 for values from 0 to 1.
+///
+/// @return
+///  Nothing.
+///
+{
+	for( int i = 0; i < count; i++ )
+	{
+		blue[i] = source[i*4]*scale;
+		green[i] = source[i*4 + 1]*scale;
+		red[i] = source[i*4 + 2]*scale;
+	}
+}
+
+static inline uchar
+PlaneToByte( float value, float scale )
+///
+/// Scales a plane value and rounds it to the nearest byte, clipped to 0 and 255.
+///
+{
+	value = value*scale + 0.5f;
+	return value <= 0.0f ? 0 : ( value >= 255.0f ? 255 : (uchar)value );
+}
+
+void
+PixelKernels::ConvertFromPlanesScalar( const float* red, const float* green, const float* blue, uchar* destination, int count, float scale )
+///
+/// Interleaves red, green and blue planes of floats into opaque ARGB32 pixels.
+///
+/// @param red, green, blue
+///  One value per pixel for each color.
+///
+/// @param destination
+///  Stores the ARGB32 pixels (blue, green, red and alpha in memory).
+///
+/// @param count
+///  The number of pixels to convert.
+///
+/// @param scale
+///  Every value is multiplied by this before rounding, e.g. 255 for values from 0 to 1.
+///
+/// @return
+///  Nothing.
+///
+{
+	for( int i = 0; i < count; i++ )
+	{
+		destination[i*4] = PlaneToByte( blue[i], scale );
+		destination[i*4 + 1] = PlaneToByte( green[i], scale );
+		destination[i*4 + 2] = PlaneToByte( red[i], scale );
+		destination[i*4 + 3] = 255;
+	}
+}
+
+void
+PixelKernels::ConvertToHsvScalar( const uchar* source, short* hue, uchar* saturation, uchar* value, int count )
+///
+/// Converts ARGB32 pixels to hue, saturation and value, exactly as QColor::toHsv() and its
+/// hue(), saturation() and value() would in Qt 5. QColor divides in floating point and
+/// rounds to 16 bits, then narrows to 8 bits by dividing by 257 with rounding; here the
+/// same roundings are done on exact integer fractions.
+///
+/// @param source
+///  The ARGB32 pixels (blue, green, red and alpha in memory) to be converted.
+///
+/// @param hue
+///  Stores the hue of each pixel, from 0 to 359, or -1 for grays which have no hue.
+///
+/// @param saturation
+///  Stores the saturation of each pixel, from 0 to 255.
+///
+/// @param value
+///  Stores the value of each pixel, the largest of its red, green and blue.
+///
+/// @param count
+///  The number of pixels to convert.
+///
+/// @return
+///  Nothing.
+///
+{
+	for( int i = 0; i < count; i++ )
+	{
+		const int blue = source[i*4];
+		const int green = source[i*4 + 1];
+		const int red = source[i*4 + 2];
+		const int max = qMax( red, qMax( green, blue ) );
+		const int delta = max - qMin( red, qMin( green, blue ) );
+		value[i] = max;
+		if( delta == 0 )
+		{
+			hue[i] = -1;
+			saturation[i] = 0;
+			continue;
+		}
+
+		// The hue in hundredths of a degree, times delta, picking the sector the way QColor does
+		int sector;
+		if( red == max )
+		{
+			sector = ( green - blue )*HSV_SECTOR + ( green < blue ? HSV_FULL_CIRCLE*delta : 0 );
+		}
+		else if( green == max )
+		{
+			sector = 2*HSV_SECTOR*delta + ( blue - red )*HSV_SECTOR;
+		}
+		else
+		{
+			sector = 4*HSV_SECTOR*delta + ( red - green )*HSV_SECTOR;
+		}
+
+		// Round to the nearest hundredth, then drop the hundredths
+		hue[i] = ( 2*sector + delta )/( 200*delta );
+
+		// Round to 16 bits, then divide by 257 with rounding. A saturation exactly halfway
+		// between two 16 bit values always lands on a different 8 bit one depending on how
+		// QColor's floating point rounds it, so those few colors are left to QColor.
+		const int saturation_numerator = 2*HSV_SATURATION_SCALE*delta + max;
+		if( saturation_numerator%( 2*max ) == 0 )
+		{
+			saturation[i] = QColor( red, green, blue ).saturation();
+			continue;
+		}
+		saturation[i] = DivideBy257( saturation_numerator/( 2*max ) );
+	}
+}
+
+void
+PixelKernels::QuantizeHueScalar( const short* hue, const short* thresholds, int levels, uchar* destination, int count )
+///
+/// Maps hues to the positions of a palette going round the color wheel. A hue's position
+/// is the number of thresholds it has reached, and hues past the last threshold wrap back
+/// around to the first position, as do grays.
+///
+/// @param hue
+///  The hues to be mapped, from 0 to 359, or -1 for grays.
+///
+/// @param thresholds
+///  The hue where each position after the first starts, then the hue where the wheel wraps
+///  back to the first position, in increasing order.
+///
+/// @param levels
+///  The number of thresholds, which is the number of positions in the palette.
+///
+/// @param destination
+///  Stores the palette position of each hue.
+///
+/// @param count
+///  The number of hues to map.
+///
+/// @return
+///  Nothing.
+///
+{
+	for( int i = 0; i < count; i++ )
+	{
+		int position = 0;
+		for( int level = 0; level < levels; level++ )
+		{
+			position += hue[i] >= thresholds[level];
+		}
+		destination[i] = position == levels ? 0 : position;
+	}
+}
+
+void
+PixelKernels::DrawSpanScalar( QRgb* pixels, uchar* depth, int count, QRgb color, int z_depth )
+///
+/// Draws a run of pixels of one color and depth, keeping the pixels that are already
+/// nearer. A pixel is drawn where z_depth is greater than its depth, which then becomes
+/// z_depth, so the depth of every pixel ends up as the greater of the two.
+///
+/// @param pixels
+///  The first pixel of the run.
+///
+/// @param depth
+///  The depth of the first pixel, followed by the depths of the rest.
+///
+/// @param count
+///  The number of pixels in the run.
+///
+/// @param color
+///  The color to draw.
+///
+/// @param z_depth
+///  The depth to draw at, from 0 to 255.
+///
+/// @return
+///  Nothing.
+///
+{
+	for( int i = 0; i < count; i++ )
+	{
+		if( z_depth > depth[i] )
+		{
+			pixels[i] = color;
+			depth[i] = z_depth;
+		}
+	}
+}
+
+void
+PixelKernels::AddDoubleScalar( const double* first, const double* second, double* result, int count )
+///
+/// Adds two arrays of doubles.
+///
+/// @param first
+///  The first array to be added.
+///
+/// @param second
+///  The second array to be added.
+///
+/// @param result
+///  Stores the sums. May be the same as either input.
+///
+/// @param count
+///  The number of values to add.
+///
+/// @return
+///  Nothing.
+///
+{
+	for( int i = 0; i < count; i++ )
+	{
+		result[i] = first[i] + second[i];
+	}
+}
+
+void
+PixelKernels::WarpBilinearScalar( const uchar* image, uchar* canvas, const double* v_x, const double* v_y, int y, int width, int height, int channels, double step_size )
+///
+/// Moves one row of pixels one Euler step along a vector field, sampling the image
+/// bilinearly. Pixels whose sample falls outside the image are left untouched.
+///
+/// @param image
+///  The image to be sampled.
+///
+/// @param canvas
+///  The image where the row is stored.
+///
+/// @param v_x
+///  The x component of the vector field.
+///
+/// @param v_y
+///  The y component of the vector field.
+///
+/// @param y
+///  The row to process.
+///
+/// @param width
+///  The width of the image.
+///
+/// @param height
+///  The height of the image.
+///
+/// @param channels
+///  The number of channels per pixel.
+///
+/// @param step_size
+///  The step size of the Euler algorithm.
+///
+/// @return
+///  Nothing.
+///
+{
+	for( int x = 0; x < width; x++ )
+	{
+		double new_x = x + step_size*( v_x[y*width + x] );
+		double new_y = y + step_size*( v_y[y*width + x] );
+		int x1 = (int)new_x;
+		int x2 = x1 + 1;
+		int y1 = (int)new_y;
+		int y2 = y1 + 1;
+		if( x1 >= 0 && y1 >= 0 && x2 < width && y2 < height )
+		{
+			for( int c = 0; c < channels; c++ )
+			{
+				uchar color11 = image[y1*width*channels + x1*channels + c];
+				uchar color21 = image[y2*width*channels + x1*channels + c];
+				uchar color12 = image[y1*width*channels + x2*channels + c];
+				uchar color22 = image[y2*width*channels + x2*channels + c];
+
+				int new_color = color11*(x2 - new_x)*(y2 - new_y) + color21*(new_x - x1)*(y2 - new_y)
+					+ color12*(x2 - new_x)*(new_y - y1) + color22*(new_x - x1)*(new_y - y1);
+				if( new_color > 255 ) new_color = 255;
+				canvas[y*width*channels + x*channels + c] = (uchar)new_color;
+			}
+		}
+	}
+}
+
+void
+PixelKernels::GaussianNoiseScalar( quint64 key, quint32 first, float* destination, int count )
+///
+/// Makes normally distributed noise with a mean of 0 and a standard deviation of 1.
+/// Value i is a function of the key and first + i only, so a long run of noise can be
+/// made in pieces, on any number of threads, and always comes out the same.
+///
+/// @param key
+///  The key of the noise stream, see Random::StreamKey.
+///
+/// @param first
+///  The index of the first value.
+///
+/// @param destination
+///  Stores the values.
+///
+/// @param count
+///  The number of values to make.
+///
+/// @return
+///  Nothing.
+///
+{
+	quint32 key_low = (quint32)key;
+	quint32 key_high = (quint32)( key >> 32 );
+	int i = 0;
+	while( i < count )
+	{
+		quint32 index = first + i;
+		float pair[2];
+		NoisePair( index >> 1, key_low, key_high, pair[0], pair[1] );
+		destination[i++] = pair[index & 1];
+		if( !( index & 1 ) && i < count ) destination[i++] = pair[1];
+	}
+}
+
+#ifdef SIMD_X86
+SIMD_TARGET( "sse2" ) void
+PixelKernels::AddSaturateSse2( const uchar* first, const uchar* second, uchar* result, int count )
+///
+/// SSE2 version of AddSaturateScalar, 16 bytes at a time.
+///
+{
+	int i = 0;
+	for( ; i + 16 <= count; i += 16 )
+	{
+		__m128i a = _mm_loadu_si128( (const __m128i*)( first + i ) );
+		__m128i b = _mm_loadu_si128( (const __m128i*)( second + i ) );
+		_mm_storeu_si128( (__m128i*)( result + i ), _mm_adds_epu8( a, b ) );
+	}
+	AddSaturateScalar( first + i, second + i, result + i, count - i );
+}
+
+SIMD_TARGET( "avx2" ) void
+PixelKernels::AddSaturateAvx2( const uchar* first, const uchar* second, uchar* result, int count )
+///
+/// AVX2 version of AddSaturateScalar, 32 bytes at a time.
+///
+{
+	int i = 0;
+	for( ; i + 32 <= count; i += 32 )
+	{
+		__m256i a = _mm256_loadu_si256( (const __m256i*)( first + i ) );
+		__m256i b = _mm256_loadu_si256( (const __m256i*)( second + i ) );
+		_mm256_storeu_si256( (__m256i*)( result + i ), _mm256_adds_epu8( a, b ) );
+	}
+	AddSaturateScalar( first + i, second + i, result + i, count - i );
+}
+
+SIMD_TARGET( "sse4.1" ) void
+PixelKernels::ConvertToGraySse41( const uchar* source, uchar* destination, int count, int channels, int alpha_channel )
+///
+/// SSE4.1 version of ConvertToGrayScalar for the ARGB32 layout (4 channels, alpha last),
+/// 8 pixels at a time. Other layouts use the scalar version.
+///
+{
+	if( channels != 4 || alpha_channel != 3 )
+	{
+		ConvertToGrayScalar( source, destination, count, channels, alpha_channel );
+		return;
+	}
+
+	// Blue + green and red + 0 for each pixel, then added together
+	const __m128i color_weights = _mm_setr_epi8( 1, 1, 1, 0, 1, 1, 1, 0, 1, 1, 1, 0, 1, 1, 1, 0 );
+	const __m128i reciprocal = _mm_set1_epi16( GRAY_RECIPROCAL );
+	int i = 0;
+	for( ; i + 8 <= count; i += 8 )
+	{
+		__m128i first = _mm_maddubs_epi16( _mm_loadu_si128( (const __m128i*)( source + i*4 ) ), color_weights );
+		__m128i second = _mm_maddubs_epi16( _mm_loadu_si128( (const __m128i*)( source + i*4 + 16 ) ), color_weights );
+		__m128i gray = _mm_mulhi_epu16( _mm_hadd_epi16( first, second ), reciprocal );
+		_mm_storel_epi64( (__m128i*)( destination + i ), _mm_packus_epi16( gray, gray ) );
+	}
+	ConvertToGrayScalar( source + i*4, destination + i, count - i, channels, alpha_channel );
+}
+
+SIMD_TARGET( "avx2" ) void
+PixelKernels::ConvertToGrayAvx2( const uchar* source, uchar* destination, int count, int channels, int alpha_channel )
+///
+/// AVX2 version of ConvertToGrayScalar for the ARGB32 layout (4 channels, alpha last),
+/// 16 pixels at a time. Other layouts use the scalar version.
+///
+{
+	if( channels != 4 || alpha_channel != 3 )
+	{
+		ConvertToGrayScalar( source, destination, count, channels, alpha_channel );
+		return;
+	}
+
+	const __m256i color_weights = _mm256_set1_epi32( 0x00010101 );
+	const __m256i reciprocal = _mm256_set1_epi16( GRAY_RECIPROCAL );
+	int i = 0;
+	for( ; i + 16 <= count; i += 16 )
+	{
+		__m256i first = _mm256_maddubs_epi16( _mm256_loadu_si256( (const __m256i*)( source + i*4 ) ), color_weights );
+		__m256i second = _mm256_maddubs_epi16( _mm256_loadu_si256( (const __m256i*)( source + i*4 + 32 ) ), color_weights );
+
+		// The horizontal add works within 128 bit lanes, so put the pixels back in order
+		__m256i sums = _mm256_permute4x64_epi64( _mm256_hadd_epi16( first, second ), 0xd8 );
+		__m256i gray = _mm256_mulhi_epu16( sums, reciprocal );
+		__m256i bytes = _mm256_permute4x64_epi64( _mm256_packus_epi16( gray, gray ), 0x08 );
+		_mm_storeu_si128( (__m128i*)( destination + i ), _mm256_castsi256_si128( bytes ) );
+	}
+	ConvertToGrayScalar( source + i*4, destination + i, count - i, channels, alpha_channel );
+}
+
+SIMD_TARGET( "sse4.1" ) void
+PixelKernels::ConvertToLumaSse41( const uchar* source, uchar* destination, int count )
+///
+/// SSE4.1 version of ConvertToLumaScalar, 8 pixels at a time.
+///
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i weights = _mm_setr_epi16( LUMA_BLUE, LUMA_GREEN, LUMA_RED, 0, LUMA_BLUE, LUMA_GREEN, LUMA_RED, 0 );
+	int i = 0;
+	for( ; i + 8 <= count; i += 8 )
+	{
+		__m128i totals[2];
+		for( int half = 0; half < 2; half++ )
+		{
+			__m128i pixels = _mm_loadu_si128( (const __m128i*)( source + i*4 + half*16 ) );
+			__m128i low = _mm_madd_epi16( _mm_unpacklo_epi8( pixels, zero ), weights );
+			__m128i high = _mm_madd_epi16( _mm_unpackhi_epi8( pixels, zero ), weights );
+			totals[half] = _mm_srli_epi32( _mm_hadd_epi32( low, high ), LUMA_SHIFT );
+		}
+		__m128i gray = _mm_packus_epi32( totals[0], totals[1] );
+		_mm_storel_epi64( (__m128i*)( destination + i ), _mm_packus_epi16( gray, gray ) );
+	}
+	ConvertToLumaScalar( source + i*4, destination + i, count - i );
+}
+
+SIMD_TARGET( "sse2" ) void
+PixelKernels::ConvertFromGraySse2( const uchar* source, uchar* destination, int count, int channels, int alpha_channel )
+///
+/// SSE2 version of ConvertFromGrayScalar for the ARGB32 layout (4 channels, alpha last),
+/// 16 pixels at a time. Other layouts use the scalar version.
+///
+{
+	if( channels != 4 || alpha_channel != 3 )
+	{
+		ConvertFromGrayScalar( source, destination, count, channels, alpha_channel );
+		return;
+	}
+
+	const __m128i opaque = _mm_set1_epi8( (char)255 );
+	int i = 0;
+	for( ; i + 16 <= count; i += 16 )
+	{
+		__m128i gray = _mm_loadu_si128( (const __m128i*)( source + i ) );
+
+		// gray gray pairs and gray alpha pairs, interleaved into gray gray gray alpha
+		__m128i color_low = _mm_unpacklo_epi8( gray, gray );
+		__m128i color_high = _mm_unpackhi_epi8( gray, gray );
+		__m128i alpha_low = _mm_unpacklo_epi8( gray, opaque );
+		__m128i alpha_high = _mm_unpackhi_epi8( gray, opaque );
+		_mm_storeu_si128( (__m128i*)( destination + i*4 ), _mm_unpacklo_epi16( color_low, alpha_low ) );
+		_mm_storeu_si128( (__m128i*)( destination + i*4 + 16 ), _mm_unpackhi_epi16( color_low, alpha_low ) );
+		_mm_storeu_si128( (__m128i*)( destination + i*4 + 32 ), _mm_unpacklo_epi16( color_high, alpha_high ) );
+		_mm_storeu_si128( (__m128i*)( destination + i*4 + 48 ), _mm_unpackhi_epi16( color_high, alpha_high ) );
+	}
+	ConvertFromGrayScalar( source + i, destination + i*4, count - i, channels, alpha_channel );
+}
+
+SIMD_TARGET( "sse2" ) void
+PixelKernels::ConvertToPlanesSse2( const uchar* source, float* red, float* green, float* blue, int count, float scale )
+///
+/// SSE2 version of ConvertToPlanesScalar, 4 pixels at a time.
+///
+{
+	const __m128i low_byte = _mm_set1_epi32( 0xff );
+	const __m128 factor = _mm_set1_ps( scale );
+	int i = 0;
+	for( ; i + 4 <= count; i += 4 )
+	{
+		__m128i pixels = _mm_loadu_si128( (const __m128i*)( source + i*4 ) );
+		_mm_storeu_ps( blue + i, _mm_mul_ps( _mm_cvtepi32_ps( _mm_and_si128( pixels, low_byte ) ), factor ) );
+		_mm_storeu_ps( green + i, _mm_mul_ps( _mm_cvtepi32_ps( _mm_and_si128( _mm_srli_epi32( pixels, 8 ), low_byte ) ), factor ) );
+		_mm_storeu_ps( red + i, _mm_mul_ps( _mm_cvtepi32_ps( _mm_and_si128( _mm_srli_epi32( pixels, 16 ), low_byte ) ), factor ) );
+	}
+	ConvertToPlanesScalar( source + i*4, red + i, green + i, blue + i, count - i, scale );
+}
+
+SIMD_TARGET( "avx2" ) void
+PixelKernels::ConvertToPlanesAvx2( const uchar* source, float* red, float* green, float* blue, int count, float scale )
+///
+/// AVX2 version of ConvertToPlanesScalar, 8 pixels at a time.
+///
+{
+	const __m256i low_byte = _mm256_set1_epi32( 0xff );
+	const __m256 factor = _mm256_set1_ps( scale );
+	int i = 0;
+	for( ; i + 8 <= count; i += 8 )
+	{
+		__m256i pixels = _mm256_loadu_si256( (const __m256i*)( source + i*4 ) );
+		_mm256_storeu_ps( blue + i, _mm256_mul_ps( _mm256_cvtepi32_ps( _mm256_and_si256( pixels, low_byte ) ), factor ) );
+		_mm256_storeu_ps( green + i, _mm256_mul_ps( _mm256_cvtepi32_ps( _mm256_and_si256( _mm256_srli_epi32( pixels, 8 ), low_byte ) ), factor ) );
+		_mm256_storeu_ps( red + i, _mm256_mul_ps( _mm256_cvtepi32_ps( _mm256_and_si256( _mm256_srli_epi32( pixels, 16 ), low_byte ) ), factor ) );
+	}
+	ConvertToPlanesScalar( source + i*4, red + i, green + i, blue + i, count - i, scale );
+}
+
+SIMD_TARGET( "sse2" ) static inline __m128i
+PlaneToBytesSse2( const float* plane, __m128 factor )
+///
+/// SSE2 version of PlaneToByte for 4 values, each left in the low byte of a 32 bit lane.
+///
+{
+	__m128 value = _mm_add_ps( _mm_mul_ps( _mm_loadu_ps( plane ), factor ), _mm_set1_ps( 0.5f ) );
+	value = _mm_min_ps( _mm_max_ps( value, _mm_setzero_ps() ), _mm_set1_ps( 255.0f ) );
+	return _mm_cvttps_epi32( value );
+}
+
+SIMD_TARGET( "sse2" ) void
+PixelKernels::ConvertFromPlanesSse2( const float* red, const float* green, const float* blue, uchar* destination, int count, float scale )
+///
+/// SSE2 version of ConvertFromPlanesScalar, 4 pixels at a time.
+///
+{
+	const __m128i opaque = _mm_set1_epi32( (int)0xff000000 );
+	const __m128 factor = _mm_set1_ps( scale );
+	int i = 0;
+	for( ; i + 4 <= count; i += 4 )
+	{
+		__m128i pixels = _mm_or_si128( opaque, PlaneToBytesSse2( blue + i, factor ) );
+		pixels = _mm_or_si128( pixels, _mm_slli_epi32( PlaneToBytesSse2( green + i, factor ), 8 ) );
+		pixels = _mm_or_si128( pixels, _mm_slli_epi32( PlaneToBytesSse2( red + i, factor ), 16 ) );
+		_mm_storeu_si128( (__m128i*)( destination + i*4 ), pixels );
+	}
+	ConvertFromPlanesScalar( red + i, green + i, blue + i, destination + i*4, count - i, scale );
+}
+
+SIMD_TARGET( "sse4.1" ) static inline __m128i
+DivideSse41( __m128i numerator, __m128i denominator )
+///
+/// Divides positive 32 bit integers, rounding down. The quotient is estimated in floating
+/// point, which is at most one off for numerators below 2^26, and then corrected from the
+/// remainder.
+///
+{
+	__m128i quotient = _mm_cvttps_epi32( _mm_div_ps( _mm_cvtepi32_ps( numerator ), _mm_cvtepi32_ps( denominator ) ) );
+	__m128i remainder = _mm_sub_epi32( numerator, _mm_mullo_epi32( quotient, denominator ) );
+	__m128i too_high = _mm_srai_epi32( remainder, 31 );
+	__m128i too_low = _mm_cmpgt_epi32( remainder, _mm_sub_epi32( denominator, _mm_set1_epi32( 1 ) ) );
+	return _mm_sub_epi32( _mm_add_epi32( quotient, too_high ), too_low );
+}
+
+SIMD_TARGET( "sse4.1" ) void
+PixelKernels::ConvertToHsvSse41( const uchar* source, short* hue, uchar* saturation, uchar* value, int count )
+///
+/// SSE4.1 version of ConvertToHsvScalar, 4 pixels at a time.
+///
+{
+	const __m128i low_byte = _mm_set1_epi32( 0xff );
+	const __m128i sector = _mm_set1_epi32( HSV_SECTOR );
+	int i = 0;
+	for( ; i + 4 <= count; i += 4 )
+	{
+		__m128i pixels = _mm_loadu_si128( (const __m128i*)( source + i*4 ) );
+		__m128i blue = _mm_and_si128( pixels, low_byte );
+		__m128i green = _mm_and_si128( _mm_srli_epi32( pixels, 8 ), low_byte );
+		__m128i red = _mm_and_si128( _mm_srli_epi32( pixels, 16 ), low_byte );
+		__m128i max = _mm_max_epi32( red, _mm_max_epi32( green, blue ) );
+		__m128i delta = _mm_sub_epi32( max, _mm_min_epi32( red, _mm_min_epi32( green, blue ) ) );
+		__m128i gray = _mm_cmpeq_epi32( delta, _mm_setzero_si128() );
+
+		// Work out the hue of every sector, and keep the one QColor would pick
+		__m128i red_sector = _mm_add_epi32( _mm_mullo_epi32( _mm_sub_epi32( green, blue ), sector ),
+			_mm_and_si128( _mm_cmplt_epi32( green, blue ), _mm_mullo_epi32( delta, _mm_set1_epi32( HSV_FULL_CIRCLE ) ) ) );
+		__m128i green_sector = _mm_add_epi32( _mm_mullo_epi32( delta, _mm_set1_epi32( 2*HSV_SECTOR ) ), _mm_mullo_epi32( _mm_sub_epi32( blue, red ), sector ) );
+		__m128i blue_sector = _mm_add_epi32( _mm_mullo_epi32( delta, _mm_set1_epi32( 4*HSV_SECTOR ) ), _mm_mullo_epi32( _mm_sub_epi32( red, green ), sector ) );
+		__m128i hundredths = _mm_blendv_epi8( blue_sector, green_sector, _mm_cmpeq_epi32( green, max ) );
+		hundredths = _mm_blendv_epi8( hundredths, red_sector, _mm_cmpeq_epi32( red, max ) );
+
+		__m128i hues = DivideSse41( _mm_add_epi32( _mm_add_epi32( hundredths, hundredths ), delta ), _mm_mullo_epi32( delta, _mm_set1_epi32( 200 ) ) );
+		__m128i saturations = _mm_add_epi32( _mm_mullo_epi32( delta, _mm_set1_epi32( 2*HSV_SATURATION_SCALE ) ), max );
+		__m128i saturations16 = DivideSse41( saturations, _mm_add_epi32( max, max ) );
+		__m128i halfway = _mm_andnot_si128( gray, _mm_cmpeq_epi32( _mm_mullo_epi32( saturations16, _mm_add_epi32( max, max ) ), saturations ) );
+		saturations16 = _mm_add_epi32( saturations16, _mm_set1_epi32( 128 ) );
+		saturations = _mm_srli_epi32( _mm_sub_epi32( saturations16, _mm_srli_epi32( saturations16, 8 ) ), 8 );
+		hues = _mm_or_si128( hues, gray );
+		saturations = _mm_andnot_si128( gray, saturations );
+
+		_mm_storel_epi64( (__m128i*)( hue + i ), _mm_packs_epi32( hues, hues ) );
+		int bytes = _mm_cvtsi128_si32( _mm_packus_epi16( _mm_packs_epi32( saturations, saturations ), _mm_setzero_si128() ) );
+		memcpy( saturation + i, &bytes, 4 );
+		bytes = _mm_cvtsi128_si32( _mm_packus_epi16( _mm_packs_epi32( max, max ), _mm_setzero_si128() ) );
+		memcpy( value + i, &bytes, 4 );
+
+		// Saturations halfway between two 16 bit values are left to QColor, as in the scalar version
+		if( !_mm_testz_si128( halfway, halfway ) )
+		{
+			ConvertToHsvScalar( source + i*4, hue + i, saturation + i, value + i, 4 );
+		}
+	}
+	ConvertToHsvScalar( source + i*4, hue + i, saturation + i, value + i, count - i );
+}
+
+SIMD_TARGET( "sse2" ) void
+PixelKernels::QuantizeHueSse2( const short* hue, const short* thresholds, int levels, uchar* destination, int count )
+///
+/// SSE2 version of QuantizeHueScalar, 16 hues at a time.
+///
+{
+	const __m128i wrap = _mm_set1_epi16( levels );
+	int i = 0;
+	for( ; i + 16 <= count; i += 16 )
+	{
+		__m128i low = _mm_loadu_si128( (const __m128i*)( hue + i ) );
+		__m128i high = _mm_loadu_si128( (const __m128i*)( hue + i + 8 ) );
+		__m128i low_positions = wrap;
+		__m128i high_positions = wrap;
+		for( int level = 0; level < levels; level++ )
+		{
+			// Start from every threshold reached, and take one off for each one that isn't
+			__m128i threshold = _mm_set1_epi16( thresholds[level] );
+			low_positions = _mm_add_epi16( low_positions, _mm_cmplt_epi16( low, threshold ) );
+			high_positions = _mm_add_epi16( high_positions, _mm_cmplt_epi16( high, threshold ) );
+		}
+		low_positions = _mm_andnot_si128( _mm_cmpeq_epi16( low_positions, wrap ), low_positions );
+		high_positions = _mm_andnot_si128( _mm_cmpeq_epi16( high_positions, wrap ), high_positions );
+		_mm_storeu_si128( (__m128i*)( destination + i ), _mm_packus_epi16( low_positions, high_positions ) );
+	}
+	QuantizeHueScalar( hue + i, thresholds, levels, destination + i, count - i );
+}
+
+SIMD_TARGET( "sse2" ) static inline __m128i
+SelectPixelsSse2( __m128i kept, __m128i old_pixels, __m128i new_pixels )
+///
+/// Keeps the old pixels where kept is all ones and takes the new ones elsewhere.
+///
+{
+	return _mm_or_si128( _mm_and_si128( kept, old_pixels ), _mm_andnot_si128( kept, new_pixels ) );
+}
+
+SIMD_TARGET( "sse2" ) void
+PixelKernels::DrawSpanSse2( QRgb* pixels, uchar* depth, int count, QRgb color, int z_depth )
+///
+/// SSE2 version of DrawSpanScalar, 16 pixels at a time. The new depths are the byte
+/// maximum of the old ones and z_depth, and the pixels whose depth didn't change are kept.
+///
+{
+	const __m128i z = _mm_set1_epi8( (char)z_depth );
+	const __m128i colors = _mm_set1_epi32( (int)color );
+	int i = 0;
+	for( ; i + 16 <= count; i += 16 )
+	{
+		__m128i depths = _mm_loadu_si128( (const __m128i*)( depth + i ) );
+		__m128i nearest = _mm_max_epu8( depths, z );
+		__m128i kept = _mm_cmpeq_epi8( nearest, depths );
+		if( _mm_movemask_epi8( kept ) == 0xffff )
+		{
+			continue;
+		}
+		_mm_storeu_si128( (__m128i*)( depth + i ), nearest );
+
+		// Widen the byte mask to one mask per pixel
+		__m128i kept_low = _mm_unpacklo_epi8( kept, kept );
+		__m128i kept_high = _mm_unpackhi_epi8( kept, kept );
+		__m128i* run = (__m128i*)( pixels + i );
+		_mm_storeu_si128( run, SelectPixelsSse2( _mm_unpacklo_epi16( kept_low, kept_low ), _mm_loadu_si128( run ), colors ) );
+		_mm_storeu_si128( run + 1, SelectPixelsSse2( _mm_unpackhi_epi16( kept_low, kept_low ), _mm_loadu_si128( run + 1 ), colors ) );
+		_mm_storeu_si128( run + 2, SelectPixelsSse2( _mm_unpacklo_epi16( kept_high, kept_high ), _mm_loadu_si128( run + 2 ), colors ) );
+		_mm_storeu_si128( run + 3, SelectPixelsSse2( _mm_unpackhi_epi16( kept_high, kept_high ), _mm_loadu_si128( run + 3 ), colors ) );
+	}
+	DrawSpanScalar( pixels + i, depth + i, count - i, color, z_depth );
+}
+
+SIMD_TARGET( "sse2" ) void
+PixelKernels::AddDoubleSse2( const double* first, const double* second, double* result, int count )
+///
+/// SSE2 version of AddDoubleScalar, 2 values at a time.
+///
+{
+	int i = 0;
+	for( ; i + 2 <= count; i += 2 )
+	{
+		_mm_storeu_pd( result + i, _mm_add_pd( _mm_loadu_pd( first + i ), _mm_loadu_pd( second + i ) ) );
+	}
+	AddDoubleScalar( first + i, second + i, result + i, count - i );
+}
+
+SIMD_TARGET( "avx2" ) void
+PixelKernels::AddDoubleAvx2( const double* first, const double* second, double* result, int count )
+///
+/// AVX2 version of AddDoubleScalar, 4 values at a time.
+///
+{
+	int i = 0;
+	for( ; i + 4 <= count; i += 4 )
+	{
+		_mm256_storeu_pd( result + i, _mm256_add_pd( _mm256_loadu_pd( first + i ), _mm256_loadu_pd( second + i ) ) );
+	}
+	AddDoubleScalar( first + i, second + i, result + i, count - i );
+}
+
+SIMD_TARGET( "sse4.1" ) void
+PixelKernels::WarpBilinearSse41( const uchar* image, uchar* canvas, const double* v_x, const double* v_y, int y, int width, int height, int channels, double step_size )
+///
+/// SSE4.1 version of WarpBilinearScalar for four channel images. All four channels of a
+/// pixel are interpolated together, in double precision and in the same order of operations
+/// as the scalar version so the results match exactly. Other channel counts use the scalar version.
+///
+{
+	if( channels != 4 )
+	{
+		WarpBilinearScalar( image, canvas, v_x, v_y, y, width, height, channels, step_size );
+		return;
+	}
+
+	const __m128i max_value = _mm_set1_epi32( 255 );
+	const __m128i low_bytes = _mm_setr_epi8( 0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 );
+	const quint32* pixels = (const quint32*)image;
+	for( int x = 0; x < width; x++ )
+	{
+		double new_x = x + step_size*( v_x[y*width + x] );
+		double new_y = y + step_size*( v_y[y*width + x] );
+		int x1 = (int)new_x;
+		int x2 = x1 + 1;
+		int y1 = (int)new_y;
+		int y2 = y1 + 1;
+		if( x1 >= 0 && y1 >= 0 && x2 < width && y2 < height )
+		{
+			__m128i color11 = _mm_cvtepu8_epi32( _mm_cvtsi32_si128( (int)pixels[y1*width + x1] ) );
+			__m128i color21 = _mm_cvtepu8_epi32( _mm_cvtsi32_si128( (int)pixels[y2*width + x1] ) );
+			__m128i color12 = _mm_cvtepu8_epi32( _mm_cvtsi32_si128( (int)pixels[y1*width + x2] ) );
+			__m128i color22 = _mm_cvtepu8_epi32( _mm_cvtsi32_si128( (int)pixels[y2*width + x2] ) );
+
+			__m128d left = _mm_set1_pd( x2 - new_x );
+			__m128d right = _mm_set1_pd( new_x - x1 );
+			__m128d top = _mm_set1_pd( y2 - new_y );
+			__m128d bottom = _mm_set1_pd( new_y - y1 );
+
+			// Channels 0 and 1 go in the low half of each register, 2 and 3 in the high half
+			__m128i result[2];
+			for( int half = 0; half < 2; half++ )
+			{
+				__m128d c11 = _mm_cvtepi32_pd( half ? _mm_srli_si128( color11, 8 ) : color11 );
+				__m128d c21 = _mm_cvtepi32_pd( half ? _mm_srli_si128( color21, 8 ) : color21 );
+				__m128d c12 = _mm_cvtepi32_pd( half ? _mm_srli_si128( color12, 8 ) : color12 );
+				__m128d c22 = _mm_cvtepi32_pd( half ? _mm_srli_si128( color22, 8 ) : color22 );
+
+				__m128d total = _mm_mul_pd( _mm_mul_pd( c11, left ), top );
+				total = _mm_add_pd( total, _mm_mul_pd( _mm_mul_pd( c21, right ), top ) );
+				total = _mm_add_pd( total, _mm_mul_pd( _mm_mul_pd( c12, left ), bottom ) );
+				total = _mm_add_pd( total, _mm_mul_pd( _mm_mul_pd( c22, right ), bottom ) );
+				result[half] = _mm_cvttpd_epi32( total );
+			}
+
+			// Values above 255 are clipped, negative ones wrap like the scalar cast does
+			__m128i colors = _mm_min_epi32( _mm_unpacklo_epi64( result[0], result[1] ), max_value );
+			*(quint32*)( canvas + ( y*width + x )*4 ) = (quint32)_mm_cvtsi128_si32( _mm_shuffle_epi8( colors, low_bytes ) );
+		}
+	}
+}
+SIMD_TARGET( "sse4.1" ) static inline __m128i
+NoiseMixSse41( __m128i x )
+{
+	x = _mm_xor_si128( x, _mm_srli_epi32( x, 16 ) );
+	x = _mm_mullo_epi32( x, _mm_set1_epi32( (int)NOISE_HASH_FIRST ) );
+	x = _mm_xor_si128( x, _mm_srli_epi32( x, 15 ) );
+	x = _mm_mullo_epi32( x, _mm_set1_epi32( (int)NOISE_HASH_SECOND ) );
+	return _mm_xor_si128( x, _mm_srli_epi32( x, 16 ) );
+}
+
+SIMD_TARGET( "sse4.1" ) static inline __m128
+Series4Sse41( __m128 x2, const float* series, __m128 last )
+{
+	__m128 total = _mm_add_ps( _mm_mul_ps( x2, _mm_set1_ps( series[0] ) ), _mm_set1_ps( series[1] ) );
+	total = _mm_add_ps( _mm_mul_ps( total, x2 ), _mm_set1_ps( series[2] ) );
+	total = _mm_add_ps( _mm_mul_ps( total, x2 ), _mm_set1_ps( series[3] ) );
+	return _mm_add_ps( _mm_mul_ps( total, x2 ), last );
+}
+
+SIMD_TARGET( "sse4.1" ) static inline void
+NoisePairsSse41( __m128i even, __m128i key_low, __m128i key_high, __m128& first, __m128& second )
+///
+/// NoisePair for four pairs, given the even index of each.
+///
+{
+	const __m128i one_i = _mm_set1_epi32( 1 );
+	const __m128 one = _mm_set1_ps( 1.0f );
+	__m128i first_bits = NoiseMixSse41( _mm_xor_si128( NoiseMixSse41( _mm_xor_si128( even, key_low ) ), key_high ) );
+	__m128i second_bits = NoiseMixSse41( _mm_xor_si128( NoiseMixSse41( _mm_xor_si128( _mm_add_epi32( even, one_i ), key_low ) ), key_high ) );
+	__m128 u1 = _mm_mul_ps( _mm_cvtepi32_ps( _mm_add_epi32( _mm_srli_epi32( first_bits, 8 ), one_i ) ), _mm_set1_ps( NOISE_UNIT ) );
+	__m128 u2 = _mm_mul_ps( _mm_cvtepi32_ps( _mm_srli_epi32( second_bits, 8 ) ), _mm_set1_ps( NOISE_UNIT ) );
+
+	// Logarithm of u1
+	__m128i bits = _mm_castps_si128( u1 );
+	__m128 exponent = _mm_cvtepi32_ps( _mm_sub_epi32( _mm_srli_epi32( bits, 23 ), _mm_set1_epi32( 127 ) ) );
+	__m128 mantissa = _mm_castsi128_ps( _mm_or_si128( _mm_and_si128( bits, _mm_set1_epi32( 0x7fffff ) ), _mm_set1_epi32( 0x3f800000 ) ) );
+	__m128 t = _mm_div_ps( _mm_sub_ps( mantissa, one ), _mm_add_ps( mantissa, one ) );
+	__m128 series = Series4Sse41( _mm_mul_ps( t, t ), NOISE_LOG_SERIES, one );
+	__m128 log = _mm_add_ps( _mm_mul_ps( exponent, _mm_set1_ps( NOISE_LN2 ) ), _mm_mul_ps( _mm_mul_ps( _mm_set1_ps( 2.0f ), t ), series ) );
+	__m128 radius = _mm_sqrt_ps( _mm_mul_ps( _mm_set1_ps( -2.0f ), log ) );
+
+	// Sine and cosine of the angle within its quadrant
+	__m128 quarter = _mm_mul_ps( u2, _mm_set1_ps( 4.0f ) );
+	__m128i quadrant = _mm_cvttps_epi32( quarter );
+	__m128 a = _mm_mul_ps( _mm_sub_ps( quarter, _mm_cvtepi32_ps( quadrant ) ), _mm_set1_ps( NOISE_HALF_PI ) );
+	__m128 a2 = _mm_mul_ps( a, a );
+	__m128 sine = _mm_mul_ps( Series4Sse41( a2, NOISE_SINE_SERIES, one ), a );
+	__m128 cosine = Series4Sse41( a2, NOISE_COSINE_SERIES, _mm_set1_ps( NOISE_COSINE_SERIES[4] ) );
+	cosine = _mm_add_ps( _mm_mul_ps( cosine, a2 ), one );
+
+	// Odd quadrants swap sine and cosine, and the sign bits come from the quadrant
+	__m128 swap = _mm_castsi128_ps( _mm_cmpeq_epi32( _mm_and_si128( quadrant, one_i ), one_i ) );
+	__m128 x = _mm_blendv_ps( cosine, sine, swap );
+	__m128 y = _mm_blendv_ps( sine, cosine, swap );
+	const __m128i two = _mm_set1_epi32( 2 );
+	x = _mm_xor_ps( x, _mm_castsi128_ps( _mm_slli_epi32( _mm_and_si128( _mm_add_epi32( quadrant, one_i ), two ), 30 ) ) );
+	y = _mm_xor_ps( y, _mm_castsi128_ps( _mm_slli_epi32( _mm_and_si128( quadrant, two ), 30 ) ) );
+	first = _mm_mul_ps( radius, x );
+	second = _mm_mul_ps( radius, y );
+}
+
+SIMD_TARGET( "sse4.1" ) void
+PixelKernels::GaussianNoiseSse41( quint64 key, quint32 first, float* destination, int count )
+///
+/// SSE4.1 version of GaussianNoiseScalar, 8 values (4 pairs) at a time.
+///
+{
+	int i = 0;
+	if( ( first & 1 ) && count > 0 )
+	{
+		GaussianNoiseScalar( key, first, destination, 1 );
+		i = 1;
+	}
+
+	const __m128i key_low = _mm_set1_epi32( (int)(quint32)key );
+	const __m128i key_high = _mm_set1_epi32( (int)(quint32)( key >> 32 ) );
+	const __m128i lanes = _mm_setr_epi32( 0, 2, 4, 6 );
+	for( ; i + 8 <= count; i += 8 )
+	{
+		__m128 even_values, odd_values;
+		NoisePairsSse41( _mm_add_epi32( _mm_set1_epi32( (int)( first + i ) ), lanes ), key_low, key_high, even_values, odd_values );
+		_mm_storeu_ps( destination + i, _mm_unpacklo_ps( even_values, odd_values ) );
+		_mm_storeu_ps( destination + i + 4, _mm_unpackhi_ps( even_values, odd_values ) );
+	}
+	GaussianNoiseScalar( key, first + i, destination + i, count - i );
+}
+
+SIMD_TARGET( "avx2" ) static inline __m256i
+NoiseMixAvx2( __m256i x )
+{
+	x = _mm256_xor_si256( x, _mm256_srli_epi32( x, 16 ) );
+	x = _mm256_mullo_epi32( x, _mm256_set1_epi32( (int)NOISE_HASH_FIRST ) );
+	x = _mm256_xor_si256( x, _mm256_srli_epi32( x, 15 ) );
+	x = _mm256_mullo_epi32( x, _mm256_set1_epi32( (int)NOISE_HASH_SECOND ) );
+	return _mm256_xor_si256( x, _mm256_srli_epi32( x, 16 ) );
+}
+
+SIMD_TARGET( "avx2" ) static inline __m256
+Series4Avx2( __m256 x2, const float* series, __m256 last )
+{
+	__m256 total = _mm256_add_ps( _mm256_mul_ps( x2, _mm256_set1_ps( series[0] ) ), _mm256_set1_ps( series[1] ) );
+	total = _mm256_add_ps( _mm256_mul_ps( total, x2 ), _mm256_set1_ps( series[2] ) );
+	total = _mm256_add_ps( _mm256_mul_ps( total, x2 ), _mm256_set1_ps( series[3] ) );
+	return _mm256_add_ps( _mm256_mul_ps( total, x2 ), last );
+}
+
+SIMD_TARGET( "avx2" ) static inline void
+NoisePairsAvx2( __m256i even, __m256i key_low, __m256i key_high, __m256& first, __m256& second )
+///
+/// NoisePair for eight pairs, given the even index of each. Same steps as NoisePairsSse41.
+///
+{
+	const __m256i one_i = _mm256_set1_epi32( 1 );
+	const __m256 one = _mm256_set1_ps( 1.0f );
+	__m256i first_bits = NoiseMixAvx2( _mm256_xor_si256( NoiseMixAvx2( _mm256_xor_si256( even, key_low ) ), key_high ) );
+	__m256i second_bits = NoiseMixAvx2( _mm256_xor_si256( NoiseMixAvx2( _mm256_xor_si256( _mm256_add_epi32( even, one_i ), key_low ) ), key_high ) );
+	__m256 u1 = _mm256_mul_ps( _mm256_cvtepi32_ps( _mm256_add_epi32( _mm256_srli_epi32( first_bits, 8 ), one_i ) ), _mm256_set1_ps( NOISE_UNIT ) );
+	__m256 u2 = _mm256_mul_ps( _mm256_cvtepi32_ps( _mm256_srli_epi32( second_bits, 8 ) ), _mm256_set1_ps( NOISE_UNIT ) );
+
+	__m256i bits = _mm256_castps_si256( u1 );
+	__m256 exponent = _mm256_cvtepi32_ps( _mm256_sub_epi32( _mm256_srli_epi32( bits, 23 ), _mm256_set1_epi32( 127 ) ) );
+	__m256 mantissa = _mm256_castsi256_ps( _mm256_or_si256( _mm256_and_si256( bits, _mm256_set1_epi32( 0x7fffff ) ), _mm256_set1_epi32( 0x3f800000 ) ) );
+	__m256 t = _mm256_div_ps( _mm256_sub_ps( mantissa, one ), _mm256_add_ps( mantissa, one ) );
+	__m256 series = Series4Avx2( _mm256_mul_ps( t, t ), NOISE_LOG_SERIES, one );
+	__m256 log = _mm256_add_ps( _mm256_mul_ps( exponent, _mm256_set1_ps( NOISE_LN2 ) ), _mm256_mul_ps( _mm256_mul_ps( _mm256_set1_ps( 2.0f ), t ), series ) );
+	__m256 radius = _mm256_sqrt_ps( _mm256_mul_ps( _mm256_set1_ps( -2.0f ), log ) );
+
+	__m256 quarter = _mm256_mul_ps( u2, _mm256_set1_ps( 4.0f ) );
+	__m256i quadrant = _mm256_cvttps_epi32( quarter );
+	__m256 a = _mm256_mul_ps( _mm256_sub_ps( quarter, _mm256_cvtepi32_ps( quadrant ) ), _mm256_set1_ps( NOISE_HALF_PI ) );
+	__m256 a2 = _mm256_mul_ps( a, a );
+	__m256 sine = _mm256_mul_ps( Series4Avx2( a2, NOISE_SINE_SERIES, one ), a );
+	__m256 cosine = Series4Avx2( a2, NOISE_COSINE_SERIES, _mm256_set1_ps( NOISE_COSINE_SERIES[4] ) );
+	cosine = _mm256_add_ps( _mm256_mul_ps( cosine, a2 ), one );
+
+	__m256 swap = _mm256_castsi256_ps( _mm256_cmpeq_epi32( _mm256_and_si256( quadrant, one_i ), one_i ) );
+	__m256 x = _mm256_blendv_ps( cosine, sine, swap );
+	__m256 y = _mm256_blendv_ps( sine, cosine, swap );
+	const __m256i two = _mm256_set1_epi32( 2 );
+	x = _mm256_xor_ps( x, _mm256_castsi256_ps( _mm256_slli_epi32( _mm256_and_si256( _mm256_add_epi32( quadrant, one_i ), two ), 30 ) ) );
+	y = _mm256_xor_ps( y, _mm256_castsi256_ps( _mm256_slli_epi32( _mm256_and_si256( quadrant, two ), 30 ) ) );
+	first = _mm256_mul_ps( radius, x );
+	second = _mm256_mul_ps( radius, y );
+}
+
+SIMD_TARGET( "avx2" ) void
+PixelKernels::GaussianNoiseAvx2( quint64 key, quint32 first, float* destination, int count )
+///
+/// AVX2 version of GaussianNoiseScalar, 16 values (8 pairs) at a time.
+///
+{
+	int i = 0;
+	if( ( first & 1 ) && count > 0 )
+	{
+		GaussianNoiseScalar( key, first, destination, 1 );
+		i = 1;
+	}
+
+	const __m256i key_low = _mm256_set1_epi32( (int)(quint32)key );
+	const __m256i key_high = _mm256_set1_epi32( (int)(quint32)( key >> 32 ) );
+	const __m256i lanes = _mm256_setr_epi32( 0, 2, 4, 6, 8, 10, 12, 14 );
+	for( ; i + 16 <= count; i += 16 )
+	{
+		__m256 even_values, odd_values;
+		NoisePairsAvx2( _mm256_add_epi32( _mm256_set1_epi32( (int)( first + i ) ), lanes ), key_low, key_high, even_values, odd_values );
+
+		// Interleaving works within 128 bit lanes, so the halves are put back in order afterwards
+		__m256 low = _mm256_unpacklo_ps( even_values, odd_values );
+		__m256 high = _mm256_unpackhi_ps( even_values, odd_values );
+		_mm256_storeu_ps( destination + i, _mm256_permute2f128_ps( low, high, 0x20 ) );
+		_mm256_storeu_ps( destination + i + 8, _mm256_permute2f128_ps( low, high, 0x31 ) );
+	}
+	GaussianNoiseScalar( key, first + i, destination + i, count - i );
+}
+#endif
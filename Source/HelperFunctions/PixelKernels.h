@@ -0,0 +1,55 @@
+#ifndef _PIXEL_KERNELS_H_
+#define _PIXEL_KERNELS_H_
+
+#include <QtWidgets>
+
+///
+/// Per pixel kernels bound through CpuDispatch. Each kernel has a scalar reference
+/// implementation and vector versions that give exactly the same results.
+///
+class PixelKernels
+{
+	public:
+		static void ConvertToGrayScalar( const uchar* source, uchar* destination, int count, int channels, int alpha_channel );
+		static void ConvertToGraySse41( const uchar* source, uchar* destination, int count, int channels, int alpha_channel );
+		static void ConvertToGrayAvx2( const uchar* source, uchar* destination, int count, int channels, int alpha_channel );
+
+		static void ConvertToLumaScalar( const uchar* source, uchar* destination, int count );
+		static void ConvertToLumaSse41( const uchar* source, uchar* destination, int count );
+
+		static void ConvertFromGrayScalar( const uchar* source, uchar* destination, int count, int channels, int alpha_channel );
+		static void ConvertFromGraySse2( const uchar* source, uchar* destination, int count, int channels, int alpha_channel );
+
+		static void ConvertToPlanesScalar( const uchar* source, float* red, float* green, float* blue, int count, float scale );
+		static void ConvertToPlanesSse2( const uchar* source, float* red, float* green, float* blue, int count, float scale );
+		static void ConvertToPlanesAvx2( const uchar* source, float* red, float* green, float* blue, int count, float scale );
+
+		static void ConvertFromPlanesScalar( const float* red, const float* green, const float* blue, uchar* destination, int count, float scale );
+		static void ConvertFromPlanesSse2( const float* red, const float* green, const float* blue, uchar* destination, int count, float scale );
+
+		static void ConvertToHsvScalar( const uchar* source, short* hue, uchar* saturation, uchar* value, int count );
+		static void ConvertToHsvSse41( const uchar* source, short* hue, uchar* saturation, uchar* value, int count );
+
+		static void QuantizeHueScalar( const short* hue, const short* thresholds, int levels, uchar* destination, int count );
+		static void QuantizeHueSse2( const short* hue, const short* thresholds, int levels, uchar* destination, int count );
+
+		static void DrawSpanScalar( QRgb* pixels, uchar* depth, int count, QRgb color, int z_depth );
+		static void DrawSpanSse2( QRgb* pixels, uchar* depth, int count, QRgb color, int z_depth );
+
+		static void AddSaturateScalar( const uchar* first, const uchar* second, uchar* result, int count );
+		static void AddSaturateSse2( const uchar* first, const uchar* second, uchar* result, int count );
+		static void AddSaturateAvx2( const uchar* first, const uchar* second, uchar* result, int count );
+
+		static void AddDoubleScalar( const double* first, const double* second, double* result, int count );
+		static void AddDoubleSse2( const double* first, const double* second, double* result, int count );
+		static void AddDoubleAvx2( const double* first, const double* second, double* result, int count );
+
+		static void WarpBilinearScalar( const uchar* image, uchar* canvas, const double* v_x, const double* v_y, int y, int width, int height, int channels, double step_size );
+		static void WarpBilinearSse41( const uchar* image, uchar* canvas, const double* v_x, const double* v_y, int y, int width, int height, int channels, double step_size );
+
+		static void GaussianNoiseScalar( quint64 key, quint32 first, float* destination, int count );
+		static void GaussianNoiseSse41( quint64 key, quint32 first, float* destination, int count );
+		static void GaussianNoiseAvx2( quint64 key, quint32 first, float* destination, int count );
+};
+
+#endif
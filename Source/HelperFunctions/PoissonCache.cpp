@@ -0,0 +1,216 @@
+#include "PoissonCache.h"
+#include "ImageProcessing.h"
+#include "Random.h"
+
+#include <algorithm>
+#include <map>
+
+///
+/// The smallest tile that is sampled. Bigger spacings use tiles of TILE_SPACINGS spacings
+/// across, so there are always enough points in a tile for the repeats not to show.
+///
+static const int MIN_TILE_SIZE = 512;
+static const int TILE_SPACINGS = 32;
+
+///
+/// Tiles at least this wide are sampled on several threads.
+///
+static const int PARALLEL_TILE_MIN_SIZE = 1024;
+
+///
+/// Identifies the files written by SaveTile, and the version of their layout.
+///
+static const quint32 TILE_FILE_MAGIC = 0x504f4953;
+static const quint32 TILE_FILE_VERSION = 3;
+
+///
+/// Tiles are sampled with a fixed seed per spacing, so every machine and every run builds
+/// the same tile whether or not it was cached. Only the placement depends on the job seed.
+///
+static const quint64 TILE_SEED = Q_UINT64_C( 0x706f6973736f6e31 );
+static const quint64 PLACEMENT_RANDOM_STREAM = 2;
+
+static QMutex tiles_mutex;
+
+std::vector<QPoint> 
+PoissonCache::GetPoissonDisks( int width, int height, int min_dist, quint64 seed )
+///
+/// Covers an area with copies of the cached tile for a spacing. The tile is first moved
+/// by a random offset and given one of its eight random flips and rotations, both of which
+/// keep the minimum distance across its wrapping edges.
+///
+/// @param width
+///  The width of the area.
+///
+/// @param height
+///  The height of the area.
+///
+/// @param min_dist
+///  The minimum distance between points.
+///
+/// @param seed
+///  The seed of the random placement.
+///
+/// @return
+///  A vector of points where each point is part of the sample.
+///
+{
+	if( min_dist < 1 ) min_dist = 1;
+
+	const Tile& tile = GetTile( min_dist );
+	const int size = tile.size;
+
+	Random random( seed, PLACEMENT_RANDOM_STREAM, min_dist );
+	int offset_x = random.Below( size );
+	int offset_y = random.Below( size );
+	int symmetry = random.Below( 8 );
+
+	std::vector<QPoint> moved;
+	moved.reserve( tile.points.size() );
+	for( size_t i = 0; i < tile.points.size(); i++ )
+	{
+		int x = tile.points[i].x();
+		int y = tile.points[i].y();
+		if( symmetry & 1 ) x = size - 1 - x;
+		if( symmetry & 2 ) y = size - 1 - y;
+		if( symmetry & 4 ) std::swap( x, y );
+		moved.push_back( QPoint( ( x + offset_x )%size, ( y + offset_y )%size ) );
+	}
+
+	std::vector<QPoint> output;
+	output.reserve( (size_t)( ( width + size - 1 )/size )*( ( height + size - 1 )/size )*moved.size() );
+	for( int tile_y = 0; tile_y < height; tile_y += size )
+	{
+		for( int tile_x = 0; tile_x < width; tile_x += size )
+		{
+			bool whole = tile_x + size <= width && tile_y + size <= height;
+			for( size_t i = 0; i < moved.size(); i++ )
+			{
+				QPoint point( tile_x + moved[i].x(), tile_y + moved[i].y() );
+				if( whole || ( point.x() < width && point.y() < height ) )
+				{
+					output.push_back( point );
+				}
+			}
+		}
+	}
+	return output;
+}
+
+const PoissonCache::Tile&
+PoissonCache::GetTile( int min_dist )
+///
+/// Finds the tile for a spacing, loading it from disk or sampling and saving it the first
+/// time it's needed. Large tiles are sampled on several threads.
+///
+/// @param min_dist
+///  The minimum distance between points.
+///
+/// @return
+///  The tile. It stays valid for the rest of the run.
+///
+{
+	static std::map<int, Tile> tiles;
+
+	QMutexLocker locker( &tiles_mutex );
+	std::map<int, Tile>::iterator found = tiles.find( min_dist );
+	if( found != tiles.end() ) return found->second;
+
+	Tile& tile = tiles[min_dist];
+	if( !LoadTile( min_dist, tile ) )
+	{
+		tile.size = std::max( MIN_TILE_SIZE, TILE_SPACINGS*min_dist );
+		if( tile.size >= PARALLEL_TILE_MIN_SIZE )
+		{
+			tile.points = ImageProcessing::GetToroidalPoissonDisksTiled( tile.size, min_dist, TILE_SEED + min_dist );
+		}
+		else
+		{
+			tile.points = ImageProcessing::GetToroidalPoissonDisks( tile.size, min_dist, TILE_SEED + min_dist );
+		}
+		SaveTile( min_dist, tile );
+	}
+	return tile;
+}
+
+QString
+PoissonCache::TilePath( int min_dist )
+///
+/// @return
+///  The file the tile for a spacing is kept in.
+///
+{
+	QString directory = QStandardPaths::writableLocation( QStandardPaths::CacheLocation );
+	return directory + QString( "/poisson_%1.bin" ).arg( min_dist );
+}
+
+bool
+PoissonCache::LoadTile( int min_dist, Tile& tile )
+///
+/// Reads a tile saved by SaveTile.
+///
+/// @param min_dist
+///  The minimum distance between points.
+///
+/// @param tile
+///  Stores the tile that was read.
+///
+/// @return
+///  False if there is no saved tile for this spacing or it can't be read.
+///
+{
+	QFile file( TilePath( min_dist ) );
+	if( !file.open( QIODevice::ReadOnly ) ) return false;
+
+	QDataStream stream( &file );
+	quint32 magic, version, saved_dist, size, count;
+	stream >> magic >> version >> saved_dist >> size >> count;
+	if( stream.status() != QDataStream::Ok || magic != TILE_FILE_MAGIC || version != TILE_FILE_VERSION ) return false;
+	if( saved_dist != (quint32)min_dist || size == 0 || size > 0xffff || count > size*size ) return false;
+
+	tile.size = size;
+	tile.points.resize( count );
+	for( quint32 i = 0; i < count; i++ )
+	{
+		quint16 x, y;
+		stream >> x >> y;
+		if( x >= size || y >= size ) return false;
+		tile.points[i] = QPoint( x, y );
+	}
+	return stream.status() == QDataStream::Ok;
+}
+
+void
+PoissonCache::SaveTile( int min_dist, const Tile& tile )
+///
+/// Writes a tile to the cache folder as a header followed by a pair of 16 bit coordinates
+/// per point. The file is written under a temporary name and then moved into place, so
+/// other processes never see half a tile. Failing to save isn't an error, the tile is
+/// just sampled again next time.
+///
+/// @param min_dist
+///  The minimum distance between points.
+///
+/// @param tile
+///  The tile to save.
+///
+/// @return
+///  Nothing.
+///
+{
+	if( tile.size > 0xffff ) return;
+
+	QString path = TilePath( min_dist );
+	QDir().mkpath( QFileInfo( path ).absolutePath() );
+
+	QSaveFile file( path );
+	if( !file.open( QIODevice::WriteOnly ) ) return;
+
+	QDataStream stream( &file );
+	stream << TILE_FILE_MAGIC << TILE_FILE_VERSION << (quint32)min_dist << (quint32)tile.size << (quint32)tile.points.size();
+	for( size_t i = 0; i < tile.points.size(); i++ )
+	{
+		stream << (quint16)tile.points[i].x() << (quint16)tile.points[i].y();
+	}
+	file.commit();
+}
@@ -0,0 +1,36 @@
+#ifndef _POISSON_CACHE_H_
+#define _POISSON_CACHE_H_
+
+#include <QtWidgets>
+#include <vector>
+
+///
+/// Keeps poisson samplings of a square that wraps around at the edges (see
+/// ImageProcessing::GetToroidalPoissonDisks), one for each spacing. Tiles are kept in
+/// memory and in the application's cache folder, so a spacing is only ever sampled once.
+/// A canvas is covered by laying copies of a tile side by side, after moving and
+/// flipping it by a random amount so no two runs place their points the same way.
+///
+class PoissonCache
+{
+	public:
+		static std::vector<QPoint> GetPoissonDisks( int width, int height, int min_dist, quint64 seed );
+
+	private:
+		///
+		/// A sampling of a size x size square that wraps around.
+		///
+		struct Tile
+		{
+			int size;
+			std::vector<QPoint> points;
+		};
+
+		static const Tile& GetTile( int min_dist );
+
+		static QString TilePath( int min_dist );
+		static bool LoadTile( int min_dist, Tile& tile );
+		static void SaveTile( int min_dist, const Tile& tile );
+};
+
+#endif
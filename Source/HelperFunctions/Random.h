@@ -0,0 +1,118 @@
+#ifndef _RANDOM_H_
+#define _RANDOM_H_
+
+#include <QtWidgets>
+
+///
+/// A counter-based random number generator. Every value is a hash (the SplitMix64
+/// finalizer) of the job seed, a stream, an index and a counter, so there is no shared
+/// state. Filters make one generator per pixel, grid cell or stroke, keyed by its index,
+/// which gives the same output for a seed whatever order or thread the work runs on.
+///
+class Random
+{
+	public:
+		Random( quint64 seed, quint64 stream, quint64 index );
+
+		quint32 Next();
+		int Below( int n );
+		double Uniform();
+
+		static quint64 Mix( quint64 value );
+		static quint64 StreamKey( quint64 seed, quint64 stream );
+		static quint64 NewSeed();
+
+	private:
+		quint64 mKey;
+		quint64 mCounter;
+};
+
+///
+/// The increment of the SplitMix64 sequence (2^64 divided by the golden ratio).
+///
+static const quint64 RANDOM_GOLDEN_GAMMA = Q_UINT64_C( 0x9e3779b97f4a7c15 );
+
+inline
+Random::Random( quint64 seed, quint64 stream, quint64 index )
+///
+/// Constructor.
+///
+/// @param seed
+///  The seed of the job.
+///
+/// @param stream
+///  Tells apart the different uses of random numbers within a job, so they don't repeat each other.
+///
+/// @param index
+///  The pixel, grid cell or stroke the numbers are for.
+///
+: mKey( Mix( StreamKey( seed, stream ) + index ) ), mCounter( 0 )
+{
+}
+
+inline quint64
+Random::StreamKey( quint64 seed, quint64 stream )
+///
+/// @return
+///  The key shared by every index of a stream. Vector kernels that hash indices themselves
+///  (like PixelKernels::GaussianNoiseScalar) are keyed with it.
+///
+{
+	return Mix( seed + stream*RANDOM_GOLDEN_GAMMA );
+}
+
+inline quint64
+Random::Mix( quint64 value )
+///
+/// The SplitMix64 finalizer. Every bit of the result depends on every bit of value.
+///
+{
+	value = ( value ^ ( value >> 30 ) )*Q_UINT64_C( 0xbf58476d1ce4e5b9 );
+	value = ( value ^ ( value >> 27 ) )*Q_UINT64_C( 0x94d049bb133111eb );
+	return value ^ ( value >> 31 );
+}
+
+inline quint32
+Random::Next()
+///
+/// @return
+///  The next 32 random bits.
+///
+{
+	mCounter++;
+	return (quint32)( Mix( mKey + mCounter*RANDOM_GOLDEN_GAMMA ) >> 32 );
+}
+
+inline int
+Random::Below( int n )
+///
+/// @return
+///  A random integer from 0 to n - 1.
+///
+{
+	return (int)( ( (quint64)Next()*(quint32)n ) >> 32 );
+}
+
+inline double
+Random::Uniform()
+///
+/// @return
+///  A random number from 0.0 up to but not including 1.0.
+///
+{
+	return Next()*( 1.0/4294967296.0 );
+}
+
+inline quint64
+Random::NewSeed()
+///
+/// @return
+///  A seed for a job that didn't ask for a particular one. Differs from call to call.
+///
+{
+	static QAtomicInt calls( 0 );
+	quint64 time = (quint64)QDateTime::currentMSecsSinceEpoch();
+	return Mix( time ^ ( (quint64)calls.fetchAndAddOrdered( 1 ) << 48 ) );
+}
+
+#endif
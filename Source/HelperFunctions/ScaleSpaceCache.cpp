@@ -0,0 +1,173 @@
+#include "ScaleSpaceCache.h"
+#include "ImageProcessing.h"
+#include "Parallel.h"
+#include "Random.h"
+
+#include <algorithm>
+#include <string.h>
+
+///
+/// The most memory the levels may use. A run of LayeredStrokes with the default brushes
+/// needs three levels, so this is enough for all the levels of one run on a 32 megapixel
+/// image. Levels of other images are dropped before levels of the image being blurred, and
+/// the least recently used go first, but the newest is always kept, whatever its size.
+///
+static const size_t MAX_CACHED_BYTES = 384*1024*1024;
+
+static QMutex levels_mutex;
+
+bool
+ScaleSpaceCache::LevelKey::operator<( const LevelKey& other ) const
+{
+	if( content_hash != other.content_hash ) return content_hash < other.content_hash;
+	if( width != other.width ) return width < other.width;
+	if( height != other.height ) return height < other.height;
+	if( format != other.format ) return format < other.format;
+	return kernel_size < other.kernel_size;
+}
+
+bool
+ScaleSpaceCache::LevelKey::operator==( const LevelKey& other ) const
+{
+	return content_hash == other.content_hash && width == other.width && height == other.height && 
+		format == other.format && kernel_size == other.kernel_size;
+}
+
+quint64
+ScaleSpaceCache::ContentHash( const QImage& image )
+///
+/// Hashes the pixels of an image. Rows are hashed in parallel and then combined in order.
+///
+/// @param image
+///  The image to hash.
+///
+/// @return
+///  The hash. Images with different pixels are very unlikely to share one.
+///
+{
+	const int height = image.height();
+	const int row_bytes = image.width()*image.depth()/8;
+	std::vector<quint64> row_hashes( height );
+	Parallel::For( height, [&]( int first_row, int last_row )
+	{
+		for( int y = first_row; y < last_row; y++ )
+		{
+			const uchar* row = image.constScanLine( y );
+			quint64 hash = Random::Mix( y );
+			int i = 0;
+			for( ; i + 8 <= row_bytes; i += 8 )
+			{
+				quint64 word;
+				memcpy( &word, row + i, 8 );
+				hash = Random::Mix( hash ^ word );
+			}
+			for( ; i < row_bytes; i++ )
+			{
+				hash = Random::Mix( hash ^ row[i] );
+			}
+			row_hashes[y] = hash;
+		}
+	} );
+
+	quint64 hash = Random::Mix( row_bytes );
+	for( int y = 0; y < height; y++ )
+	{
+		hash = Random::Mix( hash ^ row_hashes[y] );
+	}
+	return hash;
+}
+
+boost::shared_ptr< std::vector<uchar> >
+ScaleSpaceCache::GetLevel( const QImage& source, quint64 content_hash, int kernel_size )
+///
+/// Finds a blurred copy of a four channel image, blurring it if it isn't cached yet.
+/// Callers share the level, so it stays valid while they use it even if it is dropped
+/// from the cache. The blur is done without holding the cache lock; if another thread
+/// cached the same level meanwhile, its copy is used and this one is thrown away.
+///
+/// @param source
+///  The image to blur.
+///
+/// @param content_hash
+///  The hash of the image, from ContentHash. Hashed once by the caller, as it is the same
+///  for every level.
+///
+/// @param kernel_size
+///  The size of the gaussian kernel, blurring with the default sigma of GaussianBlur.
+///
+/// @return
+///  The pixels of the blurred image, in the format of the source.
+///
+{
+	LevelStore& store = Store();
+	LevelKey key = { content_hash, source.width(), source.height(), (int)source.format(), ImageProcessing::GaussianKernelSize( kernel_size ) };
+
+	QMutexLocker locker( &levels_mutex );
+	std::map< LevelKey, boost::shared_ptr< std::vector<uchar> > >::iterator found = store.levels.find( key );
+	if( found != store.levels.end() ) 
+	{
+		store.order.erase( std::find( store.order.begin(), store.order.end(), key ) );
+		store.order.push_back( key );
+		return found->second;
+	}
+	locker.unlock();
+
+	const size_t level_bytes = (size_t)source.width()*source.height()*4;
+	boost::shared_ptr< std::vector<uchar> > level( new std::vector<uchar>( level_bytes ) );
+	ImageProcessing::GaussianBlur( source.constBits(), &(*level)[0], source.width(), source.height(), 4, key.kernel_size );
+
+	locker.relock();
+	found = store.levels.find( key );
+	if( found != store.levels.end() )
+	{
+		store.order.erase( std::find( store.order.begin(), store.order.end(), key ) );
+		store.order.push_back( key );
+		return found->second;
+	}
+
+	while( !store.order.empty() && store.cached_bytes + level_bytes > MAX_CACHED_BYTES )
+	{
+		// Keep the other levels of this image for the rest of the run while there are
+		// levels of other images to drop
+		std::deque<LevelKey>::iterator evicted = store.order.begin();
+		while( evicted != store.order.end() && evicted->content_hash == content_hash ) ++evicted;
+		if( evicted == store.order.end() ) evicted = store.order.begin();
+
+		store.cached_bytes -= store.levels[*evicted]->size();
+		store.levels.erase( *evicted );
+		store.order.erase( evicted );
+	}
+	store.levels[key] = level;
+	store.order.push_back( key );
+	store.cached_bytes += level_bytes;
+	return level;
+}
+
+void
+ScaleSpaceCache::Clear()
+///
+/// Drops every cached level, freeing its memory once no caller is using it any more.
+///
+/// @return
+///  Nothing.
+///
+{
+	LevelStore& store = Store();
+	QMutexLocker locker( &levels_mutex );
+	store.levels.clear();
+	store.order.clear();
+	store.cached_bytes = 0;
+}
+
+ScaleSpaceCache::LevelStore&
+ScaleSpaceCache::Store()
+///
+/// The cached levels, shared by every caller in the process.
+///
+/// @return
+///  The levels and the order they were last used in.
+///
+{
+	static LevelStore store = LevelStore();
+	return store;
+}
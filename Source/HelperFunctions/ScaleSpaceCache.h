@@ -0,0 +1,48 @@
+#ifndef _SCALE_SPACE_CACHE_H_
+#define _SCALE_SPACE_CACHE_H_
+
+#include <QtWidgets>
+#include <deque>
+#include <map>
+#include <vector>
+#include <boost/shared_ptr.hpp>
+
+///
+/// Keeps gaussian blurred copies of images, keyed by a hash of the image content and the
+/// blur, so the reference images of a layered filter are only blurred once: each level is
+/// made the first time it is asked for and reused by later layers and by later runs of
+/// the filter on the same image. Kernel sizes that give the same blur share a level.
+/// Levels are only kept in memory, and only up to a fixed number of pixels, dropping the
+/// least recently used first. Clear drops them all once they are no longer needed.
+///
+class ScaleSpaceCache
+{
+	public:
+		static quint64 ContentHash( const QImage& image );
+		static boost::shared_ptr< std::vector<uchar> > GetLevel( const QImage& source, quint64 content_hash, int kernel_size );
+		static void Clear();
+
+	private:
+		struct LevelKey
+		{
+			quint64 content_hash;
+			int width;
+			int height;
+			int format;
+			int kernel_size;
+
+			bool operator<( const LevelKey& other ) const;
+			bool operator==( const LevelKey& other ) const;
+		};
+
+		struct LevelStore
+		{
+			std::map< LevelKey, boost::shared_ptr< std::vector<uchar> > > levels;
+			std::deque<LevelKey> order; // Least recently used first
+			size_t cached_bytes;
+		};
+
+		static LevelStore& Store();
+};
+
+#endif
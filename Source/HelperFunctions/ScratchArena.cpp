@@ -0,0 +1,195 @@
+#include "ScratchArena.h"
+
+///
+/// Allocations are aligned to, and padded out to, a cache line, which is also enough for
+/// any vector load.
+///
+static const size_t SCRATCH_ALIGNMENT = 64;
+
+///
+/// The smallest block allocated, so a job of small planes doesn't make a block for each.
+///
+static const size_t MIN_BLOCK_SIZE = 4*1024*1024;
+
+///
+/// The most memory kept between jobs. A job that needed more frees it all when it is reset,
+/// as one unusually big job shouldn't hold on to its memory for the life of the filter.
+///
+static const size_t MAX_KEPT_SIZE = 128*1024*1024;
+
+ScratchArena::ScratchArena()
+///
+/// Constructor. No memory is allocated until it is first needed.
+///
+: mBlock( 0 ), mOffset( 0 ), mInUse( 0 ), mHighWater( 0 )
+{
+}
+
+ScratchArena::~ScratchArena()
+///
+/// Destructor. Frees the blocks, so nothing allocated from the arena may be used after this.
+///
+{
+	FreeBlocks();
+}
+
+void*
+ScratchArena::AllocateBytes( size_t bytes )
+///
+/// Takes space from the current block, moving on to a later block with room for it, or
+/// adding a new one, when the current block is full.
+///
+/// @param bytes
+///  The size of the allocation.
+///
+/// @return
+///  The allocation, aligned to a cache line.
+///
+{
+	bytes = ( bytes + SCRATCH_ALIGNMENT - 1 )/SCRATCH_ALIGNMENT*SCRATCH_ALIGNMENT;
+	if( bytes == 0 ) bytes = SCRATCH_ALIGNMENT;
+
+	while( mBlock < mBlocks.size() && mBlocks[mBlock].size - mOffset < bytes )
+	{
+		mBlock++;
+		mOffset = 0;
+	}
+	if( mBlock == mBlocks.size() )
+	{
+		AddBlock( bytes );
+	}
+
+	void* allocation = mBlocks[mBlock].aligned + mOffset;
+	mOffset += bytes;
+	mInUse += bytes;
+	if( mInUse > mHighWater ) mHighWater = mInUse;
+	return allocation;
+}
+
+void
+ScratchArena::AddBlock( size_t size )
+///
+/// Adds a block of at least the given size at the end of the arena.
+///
+/// @param size
+///  The smallest size the block may have.
+///
+/// @return
+///  Nothing.
+///
+{
+	Block block;
+	block.size = size > MIN_BLOCK_SIZE ? size : MIN_BLOCK_SIZE;
+	block.memory = new uchar[block.size + SCRATCH_ALIGNMENT - 1];
+	block.aligned = block.memory + ( SCRATCH_ALIGNMENT - (quintptr)block.memory%SCRATCH_ALIGNMENT )%SCRATCH_ALIGNMENT;
+	mBlocks.push_back( block );
+}
+
+void
+ScratchArena::FreeBlocks()
+///
+/// Frees every block.
+///
+/// @return
+///  Nothing.
+///
+{
+	for( size_t i = 0; i < mBlocks.size(); i++ )
+	{
+		delete [] mBlocks[i].memory;
+	}
+	mBlocks.clear();
+}
+
+ScratchArena::Marker
+ScratchArena::Mark() const
+///
+/// @return
+///  The current position in the arena. Releasing it frees everything allocated after it.
+///
+{
+	Marker marker = { mBlock, mOffset, mInUse };
+	return marker;
+}
+
+void
+ScratchArena::Release( const Marker& marker )
+///
+/// Frees everything allocated since a mark, so a stage of a job can reuse the space of
+/// the one before it. The memory is kept by the arena.
+///
+/// @param marker
+///  A mark taken since the last reset.
+///
+/// @return
+///  Nothing.
+///
+{
+	mBlock = marker.block;
+	mOffset = marker.offset;
+	mInUse = marker.in_use;
+}
+
+void
+ScratchArena::Reset()
+///
+/// Frees everything allocated from the arena, at the end of a job, and starts a new high
+/// water mark. If the job needed more than one block, they are replaced by a single block
+/// big enough for the whole job, so the next job like it fits in one. If it needed more
+/// than MAX_KEPT_SIZE, no memory is kept at all.
+///
+/// @return
+///  Nothing.
+///
+{
+	if( mHighWater > MAX_KEPT_SIZE )
+	{
+		FreeBlocks();
+	}
+	else if( mBlocks.size() > 1 )
+	{
+		FreeBlocks();
+		AddBlock( mHighWater );
+	}
+	mBlock = 0;
+	mOffset = 0;
+	mInUse = 0;
+	mHighWater = 0;
+}
+
+void
+ScratchArena::Trim()
+///
+/// Frees everything allocated from the arena, like Reset, and also the memory it kept for
+/// later jobs. For arenas that will be idle for a while.
+///
+/// @return
+///  Nothing.
+///
+{
+	FreeBlocks();
+	mBlock = 0;
+	mOffset = 0;
+	mInUse = 0;
+	mHighWater = 0;
+}
+
+size_t
+ScratchArena::BytesInUse() const
+///
+/// @return
+///  The number of bytes allocated and not yet released.
+///
+{
+	return mInUse;
+}
+
+size_t
+ScratchArena::HighWaterMark() const
+///
+/// @return
+///  The most bytes that were in use at once since the last reset.
+///
+{
+	return mHighWater;
+}
@@ -0,0 +1,88 @@
+#ifndef _SCRATCH_ARENA_H_
+#define _SCRATCH_ARENA_H_
+
+#include <QtWidgets>
+#include <string.h>
+#include <vector>
+
+///
+/// Hands out the temporary planes of a filter job (gray images, depth buffers, noise and
+/// error planes) from a few large blocks, instead of allocating each one on its own.
+/// Allocations are never freed one at a time: the whole arena is reset at the end of the
+/// job, or rewound to a mark between the stages of one. Up to a cap, the blocks are kept
+/// for the next job, so its planes land on memory that is already paged in, until Trim
+/// frees them. Not thread safe: allocate
+/// from the thread running the job, and hand the planes to worker threads from there.
+///
+class ScratchArena
+{
+	public:
+		///
+		/// A position in the arena, to rewind to with Release.
+		///
+		struct Marker
+		{
+			size_t block;
+			size_t offset;
+			size_t in_use;
+		};
+
+		ScratchArena();
+		~ScratchArena();
+
+		template <typename T> T* Allocate( size_t count );
+		template <typename T> T* AllocateZeroed( size_t count );
+
+		Marker Mark() const;
+		void Release( const Marker& marker );
+		void Reset();
+		void Trim();
+
+		size_t BytesInUse() const;
+		size_t HighWaterMark() const;
+
+	private:
+		struct Block
+		{
+			uchar* memory;
+			uchar* aligned;
+			size_t size;
+		};
+
+		ScratchArena( const ScratchArena& );
+		ScratchArena& operator=( const ScratchArena& );
+
+		void* AllocateBytes( size_t bytes );
+		void AddBlock( size_t size );
+		void FreeBlocks();
+
+		std::vector<Block> mBlocks;
+		size_t mBlock;
+		size_t mOffset;
+		size_t mInUse;
+		size_t mHighWater;
+};
+
+template <typename T> inline T*
+ScratchArena::Allocate( size_t count )
+///
+/// @return
+///  Space for count values, aligned to a cache line. The values are not initialized.
+///
+{
+	return static_cast<T*>( AllocateBytes( count*sizeof(T) ) );
+}
+
+template <typename T> inline T*
+ScratchArena::AllocateZeroed( size_t count )
+///
+/// @return
+///  Space for count values, aligned to a cache line and set to zero.
+///
+{
+	T* values = Allocate<T>( count );
+	memset( values, 0, count*sizeof(T) );
+	return values;
+}
+
+#endif
@@ -2,6 +2,7 @@ include (boost.pri)
 
 TARGET = ImageFilterMixtures
 QT += widgets
+CONFIG += c++11
 DESTDIR = ../Build
 RESOURCES = resources.qrc
 QMAKE_MAC_SDK=macosx
@@ -12,8 +13,20 @@ HEADERS += \
 	Filters/LayeredStrokesFilter.h \
 	Filters/PointillismFilter.h \
 	FilterProcessor.h \
+	HelperFunctions/AtomicCanvas.h \
+	HelperFunctions/Convolution.h \
+	HelperFunctions/CpuDispatch.h \
+	HelperFunctions/DeferredCanvas.h \
 	HelperFunctions/Drawing.h \
 	HelperFunctions/ImageProcessing.h \
+	HelperFunctions/ImageView.h \
+	HelperFunctions/NoiseCache.h \
+	HelperFunctions/Parallel.h \
+	HelperFunctions/PixelKernels.h \
+	HelperFunctions/PoissonCache.h \
+	HelperFunctions/Random.h \
+	HelperFunctions/ScaleSpaceCache.h \
+	HelperFunctions/ScratchArena.h \
 	MainWindow.h \
 
 SOURCES += \
@@ -21,8 +34,18 @@ SOURCES += \
 	Filters/LayeredStrokesFilter.cpp \
 	Filters/PointillismFilter.cpp \
 	FilterProcessor.cpp \
+	HelperFunctions/AtomicCanvas.cpp \
+	HelperFunctions/Convolution.cpp \
+	HelperFunctions/CpuDispatch.cpp \
+	HelperFunctions/DeferredCanvas.cpp \
 	HelperFunctions/Drawing.cpp \
 	HelperFunctions/ImageProcessing.cpp \
+	HelperFunctions/NoiseCache.cpp \
+	HelperFunctions/Parallel.cpp \
+	HelperFunctions/PixelKernels.cpp \
+	HelperFunctions/PoissonCache.cpp \
+	HelperFunctions/ScaleSpaceCache.cpp \
+	HelperFunctions/ScratchArena.cpp \
     main.cpp \
     MainWindow.cpp \
     
@@ -1,12 +1,17 @@
 #include <iostream>
 #include <QApplication>
 #include "MainWindow.h"
+#include "HelperFunctions/CpuDispatch.h"
 
 int main(int argc, char *argv[])
 {
     QApplication app(argc, argv);
     app.setApplicationName("artistimagefilers");
     app.setOrganizationName("crystalvalente");
+
+    // Bind the image kernels to the best instruction set before any filter runs
+    CpuDispatch::Kernels();
+
     MainWindow window;
     window.show();
     return app.exec();